@@ -0,0 +1,172 @@
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "admission.h"
+
+////////////////////////////////////////////////
+//              Admission                     //
+////////////////////////////////////////////////
+
+static double now() {
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    return clock.tv_sec + clock.tv_nsec / 1e9;
+}
+
+Admission::Admission() {
+    // Shared anonymous mapping survives fork, like the server metrics
+    state = (admission_state*) mmap(NULL, sizeof(admission_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(state, 0, sizeof(admission_state));
+
+    limits.connections = CLIENT_CONNECTIONS;
+    limits.rate = 0;
+    limits.burst = 0;
+    limits.inflight = SERVER_INFLIGHT;
+}
+
+Admission::~Admission() {
+    munmap(state, sizeof(admission_state));
+}
+
+void Admission::Configure(const admission_limits& limits) {
+    this->limits = limits;
+    if (this->limits.burst < 1) {
+        this->limits.burst = this->limits.rate * 2 >= 1 ? this->limits.rate * 2 : 1;
+    }
+}
+
+admission_client* Admission::Lock(const string& peer, admission_bucket*& bucket) {
+    struct in_addr address;
+    struct in6_addr address6;
+    admission_client* reclaim = NULL;
+    uint64_t key = 0;
+
+    // An IPv4 address, or the /64 an IPv6 client sits in (a host usually owns the whole prefix).
+    // Peers that are neither (unknown, unresolved) are never limited.
+    if (inet_pton(AF_INET, peer.c_str(), &address) == 1) {
+        key = address.s_addr;
+    } else if (inet_pton(AF_INET6, peer.c_str(), &address6) == 1) {
+        memcpy(&key, address6.s6_addr, sizeof(key));
+    }
+    if (key == 0) {
+        return NULL;
+    }
+    uint32_t hash = (uint32_t) (key ^ (key >> 32)) * 2654435761u;
+    bucket = &state->buckets[(hash >> 16) % ADMISSION_BUCKETS];
+    while (__sync_lock_test_and_set(&bucket->lock, 1)) {
+        while (bucket->lock) {
+        }
+    }
+
+    // Known client, or else a free way, or else the idle client seen longest ago
+    for (int i = 0; i < ADMISSION_WAYS; i++) {
+        admission_client* client = &bucket->ways[i];
+        if (client->address == key) {
+            return client;
+        }
+        if (client->connections == 0 && (reclaim == NULL || client->address == 0 || (reclaim->address != 0 && client->stamp < reclaim->stamp))) {
+            reclaim = client;
+        }
+    }
+
+    // Every way holds open connections, fail open rather than refuse an unknown client
+    if (reclaim == NULL) {
+        Unlock(bucket);
+        return NULL;
+    }
+    reclaim->address = key;
+    reclaim->connections = 0;
+    reclaim->tokens = limits.burst;
+    reclaim->stamp = now();
+    return reclaim;
+}
+
+bool Admission::Open(const string& peer) {
+    admission_bucket* bucket;
+    bool admitted = true;
+
+    if (limits.connections == 0) {
+        return true;
+    }
+    admission_client* client = Lock(peer, bucket);
+    if (client == NULL) {
+        return true;
+    }
+    if (client->connections >= limits.connections) {
+        admitted = false;
+    } else {
+        client->connections++;
+    }
+    Unlock(bucket);
+    return admitted;
+}
+
+void Admission::Close(const string& peer) {
+    admission_bucket* bucket;
+
+    if (limits.connections == 0) {
+        return;
+    }
+    admission_client* client = Lock(peer, bucket);
+    if (client == NULL) {
+        return;
+    }
+    if (client->connections > 0) {
+        client->connections--;
+    }
+    Unlock(bucket);
+}
+
+bool Admission::Allow(const string& peer) {
+    admission_bucket* bucket;
+    bool admitted = false;
+
+    if (limits.rate <= 0) {
+        return true;
+    }
+    admission_client* client = Lock(peer, bucket);
+    if (client == NULL) {
+        return true;
+    }
+
+    // Refill for the time since the last request, capped at the burst
+    double current = now();
+    client->tokens += (current - client->stamp) * limits.rate;
+    if (client->tokens > limits.burst) {
+        client->tokens = limits.burst;
+    }
+    client->stamp = current;
+    if (client->tokens >= 1) {
+        client->tokens -= 1;
+        admitted = true;
+    }
+    Unlock(bucket);
+    return admitted;
+}
+
+bool Admission::Begin() {
+    unsigned current = state->inflight;
+
+    // Compare and swap so concurrent workers never overshoot the limit
+    while (limits.inflight == 0 || current < limits.inflight) {
+        unsigned seen = __sync_val_compare_and_swap(&state->inflight, current, current + 1);
+        if (seen == current) {
+            return true;
+        }
+        current = seen;
+    }
+    return false;
+}
+
+void Admission::End() {
+    __sync_fetch_and_sub(&state->inflight, 1);
+}
+
+// End of file
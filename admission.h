@@ -0,0 +1,75 @@
+#pragma once
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <string>
+
+#define ADMISSION_BUCKETS   1024
+#define ADMISSION_WAYS      8
+#define CLIENT_CONNECTIONS  256
+#define SERVER_INFLIGHT     512
+#define RETRY_AFTER_SECONDS 1
+
+using std::string;
+
+// Admission policy, 0 disables a limit. Set with the config's limit directive.
+struct admission_limits {
+    unsigned connections;   // open connections per client address
+    double rate;            // requests per second per client address
+    double burst;           // token bucket depth, defaults to twice the rate
+    unsigned inflight;      // requests being served across all workers
+};
+
+struct admission_client {
+    uint64_t address;       // IPv4 in network order or an IPv6 /64 prefix, 0 marks a free slot
+    unsigned connections;
+    double tokens;
+    double stamp;           // last refill, monotonic seconds
+};
+
+// Set associative: an address hashes to one bucket and may sit in any of its ways,
+// so a single spinlock covers every slot a lookup can touch.
+struct admission_bucket {
+    volatile int lock;
+    admission_client ways[ADMISSION_WAYS];
+};
+
+struct admission_state {
+    volatile unsigned inflight;
+    admission_bucket buckets[ADMISSION_BUCKETS];
+};
+
+// Per-client connection caps and token buckets plus a server wide in-flight limit.
+// State lives in a shared mapping so forked workers and threads see the same table.
+class Admission {
+private:
+    admission_state* state;
+    admission_limits limits;
+
+    // Returns the client's slot with its bucket locked, NULL (and nothing locked) when it can't be tracked
+    admission_client* Lock(const string& peer, admission_bucket*& bucket);
+    void Unlock(admission_bucket* bucket) { __sync_lock_release(&bucket->lock); }
+public:
+    // Constructor/Destructor
+    Admission();
+    ~Admission();
+
+    void Configure(const admission_limits& limits);
+
+    // Connection caps, Close must follow every successful Open
+    bool Open(const string& peer);
+    void Close(const string& peer);
+
+    // Takes a token from the client's bucket
+    bool Allow(const string& peer);
+
+    // Server wide in-flight requests, End must follow every successful Begin
+    bool Begin();
+    void End();
+    unsigned get_inflight() { return state->inflight; }
+};
+
+#endif
+
+// End of header
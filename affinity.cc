@@ -0,0 +1,166 @@
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+////////////////////////////////////////////////
+//              Placement                     //
+////////////////////////////////////////////////
+
+Placement::Placement() {
+    numa = false;
+    steer = false;
+    next = 0;
+}
+
+bool Placement::Configure(const char* list, bool numa, bool steer) {
+    cpu_set_t allowed;
+    const char* cursor = list;
+    char* end;
+
+    // Only CPUs this process may run on, e.g. inside a cgroup or taskset
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return false;
+    }
+    cpus.clear();
+    while (*cursor != '\0') {
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+        if (end == cursor || first < 0) {
+            return false;
+        }
+        cursor = end;
+        if (*cursor == '-') {
+            cursor++;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor || last < first) {
+                return false;
+            }
+            cursor = end;
+        }
+        if (last >= AFFINITY_MAX_CPUS || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+        if (*cursor == ',') {
+            cursor++;
+        } else if (*cursor != '\0') {
+            return false;
+        }
+    }
+    this->numa = numa;
+    this->steer = steer;
+    return !cpus.empty();
+}
+
+int Placement::Choose(int connection) {
+    int incoming = -1;
+    socklen_t length = sizeof(incoming);
+
+    // The CPU that ran the receive softirq already has the socket's cache lines
+    if (steer && getsockopt(connection, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &length) == 0 && incoming >= 0) {
+        for (size_t i = 0; i < cpus.size(); i++) {
+            if (cpus[i] == incoming) {
+                return incoming;
+            }
+        }
+    }
+    return cpus[next++ % cpus.size()];
+}
+
+bool Placement::Apply(int cpu) {
+    cpu_set_t set;
+
+    // Affinity of pid 0 is that of the calling thread only
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return false;
+    }
+
+    // Preferred rather than bound, so a full node spills over instead of failing allocations
+    int node = numa ? CpuNode(cpu) : -1;
+    if (node >= 0) {
+        unsigned long mask[AFFINITY_MAX_CPUS / (8 * sizeof(unsigned long))];
+        memset(mask, 0, sizeof(mask));
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) < 0) {
+            perror("set_mempolicy");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Placement::Steer(int listening) {
+    vector<struct sock_filter> code;
+    struct sock_fprog program;
+
+    if (!steer) {
+        return true;
+    }
+
+    // A = current CPU; one compare and return per worker; out of range means hash as usual
+    struct sock_filter load = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (unsigned) (SKF_AD_OFF + SKF_AD_CPU));
+    code.push_back(load);
+    for (size_t i = 0; i < cpus.size(); i++) {
+        struct sock_filter compare = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) cpus[i], 0, 1);
+        struct sock_filter select = BPF_STMT(BPF_RET | BPF_K, (unsigned) i);
+        code.push_back(compare);
+        code.push_back(select);
+    }
+    struct sock_filter fallback = BPF_STMT(BPF_RET | BPF_K, (unsigned) cpus.size());
+    code.push_back(fallback);
+
+    program.len = code.size();
+    program.filter = &code[0];
+    if (setsockopt(listening, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+}
+
+int CpuNode(int cpu) {
+    char path[64];
+    struct dirent* entry;
+    int node = -1;
+
+    // Every cpuN directory links to its nodeM
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// End of file
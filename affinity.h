@@ -0,0 +1,49 @@
+#pragma once
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <string>
+#include <vector>
+
+#define AFFINITY_MAX_CPUS 1024
+
+using std::string;
+using std::vector;
+
+// Where workers run. A CPU list ("0-3,8") pins every forked child or connection
+// thread to one of its CPUs, and gives the evented backends one worker process
+// per CPU. With numa, a pinned worker prefers memory from its CPU's node. With
+// steer, work follows the CPU that received the connection (SO_INCOMING_CPU).
+class Placement {
+private:
+    vector<int> cpus;
+    bool numa;
+    bool steer;
+    unsigned next;
+public:
+    Placement();
+
+    // Parses the CPU list, false when it is malformed or names no usable CPU
+    bool Configure(const char* list, bool numa, bool steer);
+    bool is_enabled() const { return !cpus.empty(); }
+    bool is_steered() const { return steer; }
+    size_t size() const { return cpus.size(); }
+    int get_cpu(size_t index) const { return cpus[index]; }
+
+    // CPU for a new connection: the one its packets arrive on when steering and it is ours, else round robin
+    int Choose(int connection);
+
+    // Pins the calling thread (or single threaded process) and, with numa, prefers local memory
+    bool Apply(int cpu);
+
+    // Listener i of a SO_REUSEPORT group belongs to the worker on CPU i of the list. When steering, a
+    // BPF program picks the listener of the CPU that received the SYN, any other CPU falls back to hashing.
+    bool Steer(int listening);
+};
+
+// NUMA node of a CPU from sysfs, -1 when unknown
+int CpuNode(int cpu);
+
+#endif
+
+// End of header
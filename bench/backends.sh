@@ -0,0 +1,39 @@
+#!/bin/bash
+# Compares the evented backends: throughput from bench/loadgen and, when
+# strace is installed, syscalls per request counted on the server process.
+# Usage: bench/backends.sh [requests] [connections] [path]
+REQUESTS=${1:-20000}
+CONNECTIONS=${2:-16}
+URIPATH=${3:-/hello.html}
+cd "$(dirname "$0")/.."
+
+if [ ! -x http ] || [ ! -x bench/loadgen ]; then
+    make all bench > /dev/null || exit 1
+fi
+
+for BACKEND in evented io-uring; do
+    ./http --$BACKEND --silent > /dev/null &
+    SERVER=$!
+    sleep 0.5
+
+    # Attach strace for the measured run only
+    if command -v strace > /dev/null; then
+        strace -c -f -p $SERVER -o /tmp/backends.$BACKEND.strace &
+        TRACER=$!
+        sleep 0.5
+    fi
+
+    echo "== $BACKEND"
+    bench/loadgen -n $REQUESTS -c $CONNECTIONS --path $URIPATH
+
+    if [ -n "$TRACER" ]; then
+        kill -INT $TRACER
+        wait $TRACER 2> /dev/null
+        CALLS=$(awk '/total/ { print $3 }' /tmp/backends.$BACKEND.strace)
+        echo "syscalls $CALLS ($(echo "scale=2; $CALLS / $REQUESTS" | bc) per request)"
+        TRACER=""
+    fi
+
+    kill -INT $SERVER
+    wait $SERVER 2> /dev/null
+done
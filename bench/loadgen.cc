@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+// Load generator for comparing server backends: every thread drives one
+// connection (or a fresh connection per request with --close) and records
+// per-request latency.
+struct loadgen_args {
+    const char* host;
+    int port;
+    string request;
+    int requests;
+    bool reconnect;
+    vector<double> latencies;
+    int errors;
+};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int openConnection(const char* host, int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Reads one response, framed by Content-Length when the server sends one
+static bool readResponse(int fd) {
+    char buffer[65536];
+    string head = "";
+    size_t end = string::npos;
+    long remaining = 0;
+    ssize_t count;
+
+    while (end == string::npos) {
+        count = recv(fd, buffer, sizeof(buffer), 0);
+        if (count <= 0) {
+            return false;
+        }
+        head.append(buffer, count);
+        end = head.find("\n\r\n");
+    }
+    size_t length = head.find("Content-Length: ");
+    if (length != string::npos && length < end) {
+        remaining = atol(head.c_str() + length + 16);
+    }
+    remaining -= head.length() - (end + 3);
+    while (remaining > 0) {
+        count = recv(fd, buffer, std::min((long) sizeof(buffer), remaining), 0);
+        if (count <= 0) {
+            return false;
+        }
+        remaining -= count;
+    }
+    return true;
+}
+
+static void* runClient(void* ptr) {
+    loadgen_args* args = (loadgen_args*) ptr;
+    int fd = -1;
+
+    for (int i = 0; i < args->requests; i++) {
+        double begin = nowSeconds();
+        if (fd < 0) {
+            fd = openConnection(args->host, args->port);
+            if (fd < 0) {
+                args->errors++;
+                continue;
+            }
+        }
+        if (send(fd, args->request.c_str(), args->request.length(), MSG_NOSIGNAL) < 0 || !readResponse(fd)) {
+            args->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        args->latencies.push_back(nowSeconds() - begin);
+        if (args->reconnect) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    const char* path = "/hello.html";
+    int port = 8000;
+    int requests = 10000;
+    int concurrency = 16;
+    bool reconnect = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            requests = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            concurrency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--close") == 0) {
+            reconnect = true;
+        } else {
+            printf("Usage: loadgen [--host ip] [--port n] [--path /uri] [-n requests] [-c connections] [--close]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Split the requests evenly across client threads
+    vector<loadgen_args> args(concurrency);
+    vector<pthread_t> threads(concurrency);
+    for (int i = 0; i < concurrency; i++) {
+        args[i].host = host;
+        args[i].port = port;
+        args[i].request = string("GET ") + path + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+        args[i].requests = requests / concurrency + (i < requests % concurrency ? 1 : 0);
+        args[i].reconnect = reconnect;
+        args[i].errors = 0;
+    }
+    double begin = nowSeconds();
+    for (int i = 0; i < concurrency; i++) {
+        pthread_create(&threads[i], NULL, runClient, &args[i]);
+    }
+    for (int i = 0; i < concurrency; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = nowSeconds() - begin;
+
+    // Merge latencies and report
+    vector<double> latencies;
+    int errors = 0;
+    for (int i = 0; i < concurrency; i++) {
+        latencies.insert(latencies.end(), args[i].latencies.begin(), args[i].latencies.end());
+        errors += args[i].errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    size_t done = latencies.size();
+    printf("requests %zu errors %d time %.3fs\n", done, errors, elapsed);
+    printf("throughput %.0f req/s\n", done / elapsed);
+    if (done > 0) {
+        printf("latency p50 %.1fus p99 %.1fus max %.1fus\n", latencies[done / 2] * 1e6, latencies[done * 99 / 100] * 1e6, latencies[done - 1] * 1e6);
+    }
+    return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,232 @@
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "../server.h"
+
+using std::string;
+using std::vector;
+
+// Microbenchmarks for the request pipeline, run from the repository root:
+//   make microbench && ./bench/microbench [--benchmark_filter=ParseRequest]
+// Requests come from bench/corpus, one raw capture per .http file. Besides
+// ns/op every benchmark reports allocs/op and bytes/op (heap bytes requested),
+// counted by the operator new below.
+
+////////////////////////////////////////////////
+//              Allocation Counting           //
+////////////////////////////////////////////////
+
+static size_t allocations = 0;
+static size_t allocated = 0;
+
+// Kept out of line so the compiler doesn't pair the inlined malloc and free as mismatched
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations++;
+    allocated += size;
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == NULL) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t size) noexcept {
+    free(memory);
+}
+
+struct alloc_snapshot {
+    size_t count;
+    size_t bytes;
+};
+
+static alloc_snapshot Snapshot() {
+    alloc_snapshot snapshot = { allocations, allocated };
+    return snapshot;
+}
+
+// Per-iteration averages, input is the number of request bytes handled per op
+static void Report(benchmark::State& state, const alloc_snapshot& before, size_t input) {
+    state.counters["allocs/op"] = benchmark::Counter(allocations - before.count, benchmark::Counter::kAvgIterations);
+    state.counters["bytes/op"] = benchmark::Counter(allocated - before.bytes, benchmark::Counter::kAvgIterations);
+    if (input > 0) {
+        state.SetBytesProcessed(state.iterations() * input);
+    }
+}
+
+////////////////////////////////////////////////
+//              Corpus                        //
+////////////////////////////////////////////////
+
+struct capture {
+    string name;
+    string text;
+};
+
+static vector<capture> LoadCorpus(const char* directory) {
+    vector<capture> corpus;
+    DIR* dir = opendir(directory);
+    struct dirent* entry;
+
+    if (dir == NULL) {
+        perror(directory);
+        exit(EXIT_FAILURE);
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        string name = entry->d_name;
+        if (name.length() < 6 || name.compare(name.length() - 5, 5, ".http") != 0) {
+            continue;
+        }
+        std::ifstream file(string(directory) + "/" + name, std::ios::binary);
+        std::stringstream text;
+        text << file.rdbuf();
+        capture item = { name.substr(0, name.length() - 5), text.str() };
+        corpus.push_back(item);
+    }
+    closedir(dir);
+    return corpus;
+}
+
+// Request line pieces, without going through the parser being measured
+static string RequestUri(const string& text) {
+    size_t start = text.find(' ') + 1;
+    return text.substr(start, text.find(' ', start) - start);
+}
+
+static HttpServer* server;
+
+////////////////////////////////////////////////
+//              Benchmarks                    //
+////////////////////////////////////////////////
+
+static void BM_ParseRequest(benchmark::State& state, const string& text) {
+    alloc_snapshot before = Snapshot();
+    for (auto _ : state) {
+        HttpRequest request;
+        server->ParseRequest(request, false, text.c_str());
+        benchmark::DoNotOptimize(request.get_path());
+        request.Reset();
+    }
+    Report(state, before, text.length());
+}
+
+static void BM_ParseHeaders(benchmark::State& state, const string& text) {
+    int index = text.find("\r\n") + 2;
+    alloc_snapshot before = Snapshot();
+    HttpRequest request;
+    request.set_copy(text);
+    for (auto _ : state) {
+        request.ParseHeaders(index);
+        benchmark::DoNotOptimize(request.GetHeader(HEADER_HOST));
+    }
+    Report(state, before, text.length() - index);
+}
+
+static void BM_ParseUri(benchmark::State& state, const string& text) {
+    string uri = RequestUri(text);
+    alloc_snapshot before = Snapshot();
+    for (auto _ : state) {
+        string path = "";
+        string query = "";
+        string type = "";
+        server->ParseUri(uri, path, query, type);
+        benchmark::DoNotOptimize(path);
+    }
+    Report(state, before, uri.length());
+}
+
+static void BM_GetMimeType(benchmark::State& state, const string& extension) {
+    alloc_snapshot before = Snapshot();
+    for (auto _ : state) {
+        string type = server->GetMimeType(extension);
+        benchmark::DoNotOptimize(type);
+    }
+    Report(state, before, 0);
+}
+
+static void BM_CreateResponseString(benchmark::State& state) {
+    HttpRequest request;
+    string body(state.range(0), 'x');
+    server->ParseRequest(request, false, "GET /hello.html HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    alloc_snapshot before = Snapshot();
+    for (auto _ : state) {
+        string response = server->CreateResponseString(request, "", body, OK);
+        benchmark::DoNotOptimize(response);
+    }
+    Report(state, before, body.length());
+    request.Reset();
+}
+
+// Cache of range(0) distinct responses, looking up the one in the middle
+static void BM_CacheLookup(benchmark::State& state) {
+    HttpServer cached;
+    HttpRequest request;
+    string body(1024, 'x');
+    for (int i = 0; i < state.range(0); i++) {
+        HttpRequest entry;
+        string text = "GET /cached/" + std::to_string(i) + ".html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        cached.ParseRequest(entry, false, text.c_str());
+        cached.CacheResponse(entry, cached.CreateResponseString(entry, "", body, OK));
+    }
+    string text = "GET /cached/" + std::to_string(state.range(0) / 2) + ".html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    cached.ParseRequest(request, false, text.c_str());
+    alloc_snapshot before = Snapshot();
+    for (auto _ : state) {
+        string response = cached.HandleRequestCached(request, false);
+        benchmark::DoNotOptimize(response);
+    }
+    Report(state, before, 0);
+    request.Reset();
+}
+
+static void BM_ExecutePhp(benchmark::State& state) {
+    fstream file("test/hello.php", fstream::in);
+    string text = "GET /hello.php?name=world HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    if (!file.is_open()) {
+        state.SkipWithError("test/hello.php not found, run from the repository root");
+        return;
+    }
+    alloc_snapshot before = Snapshot();
+    for (auto _ : state) {
+        file.clear();
+        file.seekg(0);
+        string body = server->ExecutePhp(file, text);
+        benchmark::DoNotOptimize(body);
+    }
+    Report(state, before, 0);
+}
+
+int main(int argc, char** argv) {
+    const char* extensions[] = { "html", "js", "png", "php", "css", "unknown" };
+
+    benchmark::Initialize(&argc, argv);
+    server = new HttpServer;
+    vector<capture> corpus = LoadCorpus("bench/corpus");
+    for (size_t i = 0; i < corpus.size(); i++) {
+        benchmark::RegisterBenchmark(("ParseRequest/" + corpus[i].name).c_str(), BM_ParseRequest, corpus[i].text);
+        benchmark::RegisterBenchmark(("ParseHeaders/" + corpus[i].name).c_str(), BM_ParseHeaders, corpus[i].text);
+        benchmark::RegisterBenchmark(("ParseUri/" + corpus[i].name).c_str(), BM_ParseUri, corpus[i].text);
+    }
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        benchmark::RegisterBenchmark((string("GetMimeType/") + extensions[i]).c_str(), BM_GetMimeType, string(extensions[i]));
+    }
+    benchmark::RegisterBenchmark("CreateResponseString", BM_CreateResponseString)->Arg(0)->Arg(1024)->Arg(65536);
+    benchmark::RegisterBenchmark("CacheLookup", BM_CacheLookup)->Arg(16)->Arg(256)->Arg(4096);
+    benchmark::RegisterBenchmark("ExecutePhp", BM_ExecutePhp);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    delete server;
+    return 0;
+}
+
+// End of file
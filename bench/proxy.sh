@@ -0,0 +1,35 @@
+#!/bin/bash
+# Measures the proxy handler against two stand-in upstreams: throughput from
+# bench/loadgen and upstream connection reuse from /metrics.
+# Usage: bench/proxy.sh [requests] [connections] [mode]
+REQUESTS=${1:-5000}
+CONNECTIONS=${2:-8}
+MODE=${3:-evented}
+CONFIG=/tmp/proxy.$$.conf
+cd "$(dirname "$0")/.."
+
+if [ ! -x http ] || [ ! -x bench/loadgen ]; then
+    make all bench > /dev/null || exit 1
+fi
+
+cat > $CONFIG <<CONF
+route prefix /api/   proxy   127.0.0.1:9001,127.0.0.1:9002
+route exact  /metrics metrics cache=off
+CONF
+
+bench/upstream.py 9001 &
+FIRST=$!
+bench/upstream.py 9002 &
+SECOND=$!
+./http --$MODE --silent --config $CONFIG > /dev/null &
+SERVER=$!
+sleep 1
+
+echo "== $MODE"
+bench/loadgen -n $REQUESTS -c $CONNECTIONS --path /api/hello
+curl -s http://127.0.0.1:8000/metrics | grep upstream
+
+kill -INT $SERVER
+kill $FIRST $SECOND
+wait 2> /dev/null
+rm -f $CONFIG
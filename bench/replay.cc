@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "../capture.h"
+#include "../deadline.h"
+
+using std::deque;
+using std::string;
+using std::vector;
+
+// Replays a capture recorded with http --capture: one socket per captured connection, the
+// same bytes in the same chunks, at the original pace (--speed 1), scaled (--speed 4 is four
+// times faster) or as fast as responses come back (--max). With --max a connection sends its
+// next chunk once everything it has sent so far is answered, and no more connections are open
+// at once than the capture ever had. Latency runs from the last byte of a request to the last
+// byte of its response.
+struct replay_request {
+    double sent;
+    bool head;
+};
+
+struct replay_connection {
+    vector<const capture_event*> events;
+    size_t next;
+    int fd;
+    string outgoing;            // queued for the socket
+    string framing;             // sent since the last complete request
+    string incoming;
+    deque<replay_request> pending;
+    bool raw;                   // HTTP/2 or unframeable input: sent and drained, not timed
+    bool started;
+    bool finished;
+};
+
+struct replay_totals {
+    size_t connections;
+    size_t reconnects;
+    size_t errors;
+    size_t statuses[6];         // by first digit
+    vector<double> latencies;
+    double lag;                 // worst delay behind the capture's schedule
+    size_t finished;
+};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int openConnection(const char* host, int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Header value in a response head, empty when absent. Lines end in \n, with or without \r.
+static string headerValue(const string& head, const char* name) {
+    size_t length = strlen(name);
+    for (size_t line = head.find('\n'); line != string::npos && line + 1 < head.length(); line = head.find('\n', line + 1)) {
+        if (strncasecmp(head.c_str() + line + 1, name, length) == 0 && head[line + 1 + length] == ':') {
+            size_t value = head.find_first_not_of(' ', line + 2 + length);
+            return head.substr(value, head.find_first_of("\r\n", value) - value);
+        }
+    }
+    return "";
+}
+
+// Length of a chunked body at offset, 0 until all of it has arrived
+static size_t chunkedLength(const string& input, size_t offset) {
+    size_t at = offset;
+    for (;;) {
+        size_t line = input.find("\r\n", at);
+        if (line == string::npos) {
+            return 0;
+        }
+        size_t size = strtoul(input.c_str() + at, NULL, 16);
+        at = line + 2 + size + 2;
+        if (size == 0) {
+            size_t trailer = input.find("\r\n\r\n", line);
+            return trailer == string::npos ? 0 : trailer + 4 - offset;
+        }
+        if (at > input.length()) {
+            return 0;
+        }
+    }
+}
+
+// Takes every complete response off the front of incoming. At end of stream a response
+// without a length ends there.
+static void readResponses(replay_connection& conn, replay_totals& totals, bool eof) {
+    while (!conn.raw && !conn.pending.empty()) {
+        size_t end = conn.incoming.find("\n\r\n");
+        if (end == string::npos) {
+            return;
+        }
+        string head = conn.incoming.substr(0, end + 1);
+        int status = head.length() > 12 ? atoi(head.c_str() + 9) : 0;
+        size_t body = 0;
+
+        if (status == 100) {
+            conn.incoming.erase(0, end + 3);
+            continue;
+        }
+        if (conn.pending.front().head || status == 204 || status == 304) {
+            body = 0;
+        } else if (headerValue(head, "Content-Length") != "") {
+            body = atol(headerValue(head, "Content-Length").c_str());
+        } else if (strcasecmp(headerValue(head, "Transfer-Encoding").c_str(), "chunked") == 0) {
+            body = chunkedLength(conn.incoming, end + 3);
+            if (body == 0) {
+                return;
+            }
+        } else if (eof) {
+            body = conn.incoming.length() - (end + 3);
+        } else if (strcasecmp(headerValue(head, "Connection").c_str(), "close") == 0) {
+            return;
+        }
+        if (conn.incoming.length() < end + 3 + body) {
+            return;
+        }
+        conn.incoming.erase(0, end + 3 + body);
+        totals.latencies.push_back(nowSeconds() - conn.pending.front().sent);
+        totals.statuses[std::min(status / 100, 5)]++;
+        conn.pending.pop_front();
+    }
+    if (conn.raw) {
+        conn.incoming.clear();
+    }
+}
+
+// Counts the requests a chunk completes, starting each one's clock
+static void frameRequests(replay_connection& conn, const string& data, const client_limits& limits) {
+    if (conn.framing.empty() && data.compare(0, 3, "PRI") == 0) {
+        conn.raw = true;
+    }
+    if (conn.raw) {
+        return;
+    }
+    conn.framing.append(data);
+    for (;;) {
+        size_t head = 0;
+        size_t total = 0;
+        frame_t frame = FrameRequest(conn.framing, limits, head, total);
+        if (frame == FRAME_PARTIAL) {
+            return;
+        }
+        if (frame != FRAME_REQUEST) {
+            conn.raw = true;
+            conn.framing.clear();
+            return;
+        }
+        replay_request request = {nowSeconds(), conn.framing.compare(0, 5, "HEAD ") == 0};
+        conn.pending.push_back(request);
+        conn.framing.erase(0, total);
+    }
+}
+
+static void watch(int epoll, replay_connection& conn, size_t index) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | (conn.outgoing.empty() ? 0 : EPOLLOUT);
+    event.data.u64 = index;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, conn.fd, &event);
+}
+
+static void flush(int epoll, replay_connection& conn, size_t index) {
+    ssize_t count = 0;
+    while (!conn.outgoing.empty() && (count = send(conn.fd, conn.outgoing.data(), conn.outgoing.length(), MSG_NOSIGNAL | MSG_DONTWAIT)) > 0) {
+        conn.outgoing.erase(0, count);
+    }
+    watch(epoll, conn, index);
+}
+
+static bool connectTo(int epoll, replay_connection& conn, size_t index, const char* host, int port) {
+    struct epoll_event event;
+    conn.fd = openConnection(host, port);
+    if (conn.fd < 0) {
+        return false;
+    }
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.u64 = index;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, conn.fd, &event);
+    return true;
+}
+
+static void disconnect(replay_connection& conn, replay_totals& totals) {
+    if (conn.fd >= 0) {
+        close(conn.fd);
+        conn.fd = -1;
+    }
+    totals.errors += conn.pending.size();
+    conn.pending.clear();
+    conn.outgoing.clear();
+    conn.framing.clear();
+    conn.incoming.clear();
+}
+
+// Applies the connection's due events: all of them up to now when timed, with --max until it
+// has to wait for responses. A connection the server closed early is reopened for the rest.
+static void advance(int epoll, vector<replay_connection>& conns, size_t index, replay_totals& totals,
+                    const char* host, int port, double begin, double speed) {
+    replay_connection& conn = conns[index];
+    static client_limits limits = { 0, 0, 0, (size_t) -1, (size_t) -1 };
+
+    while (conn.next < conn.events.size()) {
+        const capture_event* event = conn.events[conn.next];
+        double due = speed > 0 ? begin + event->time / 1e6 / speed : 0;
+        if (speed > 0 && due > nowSeconds()) {
+            return;
+        }
+        if (speed == 0 && (!conn.pending.empty() || !conn.outgoing.empty()) && !conn.raw) {
+            return;
+        }
+        if (speed > 0) {
+            totals.lag = std::max(totals.lag, nowSeconds() - due);
+        }
+        if (event->kind == CAPTURE_OPEN || (event->kind == CAPTURE_DATA && conn.fd < 0)) {
+            if (event->kind == CAPTURE_DATA && conn.started) {
+                totals.reconnects++;
+            }
+            conn.started = true;
+            totals.connections++;
+            if (!connectTo(epoll, conn, index, host, port)) {
+                totals.errors++;
+                conn.next = conn.events.size();
+                break;
+            }
+        }
+        if (event->kind == CAPTURE_DATA) {
+            conn.outgoing.append(event->data);
+            frameRequests(conn, event->data, limits);
+            flush(epoll, conn, index);
+        } else if (event->kind == CAPTURE_CLOSE && conn.pending.empty() && conn.outgoing.empty()) {
+            disconnect(conn, totals);
+        } else if (event->kind == CAPTURE_CLOSE) {
+            // Waits for the responses to what was sent
+            return;
+        }
+        conn.next++;
+    }
+
+    // Captures cut short by a server shutdown have no close, the last response ends them
+    if (conn.fd >= 0 && (conn.raw || conn.pending.empty()) && conn.outgoing.empty()) {
+        disconnect(conn, totals);
+    }
+    if (conn.fd < 0 && !conn.finished) {
+        conn.finished = true;
+        totals.finished++;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    const char* filename = NULL;
+    int port = 8000;
+    double speed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max") == 0) {
+            speed = 0;
+        } else if (argv[i][0] != '-' && filename == NULL) {
+            filename = argv[i];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    if (filename == NULL) {
+        printf("Usage: replay [--host ip] [--port n] [--speed x | --max] capture\n");
+        return EXIT_FAILURE;
+    }
+
+    // Split the capture by connection, in the order connections first appear
+    vector<capture_event> events;
+    if (!LoadCapture(filename, events)) {
+        return EXIT_FAILURE;
+    }
+    vector<replay_connection> conns;
+    std::unordered_map<uint32_t, size_t> ids;
+    size_t open = 0;
+    size_t peak = 0;
+    for (const capture_event& event : events) {
+        auto found = ids.find(event.connection);
+        if (found == ids.end()) {
+            found = ids.emplace(event.connection, conns.size()).first;
+            conns.push_back(replay_connection());
+            conns.back().next = 0;
+            conns.back().fd = -1;
+            conns.back().raw = false;
+            conns.back().started = false;
+            conns.back().finished = false;
+        }
+        conns[found->second].events.push_back(&event);
+        open += event.kind == CAPTURE_OPEN ? 1 : 0;
+        open -= event.kind == CAPTURE_CLOSE && open > 0 ? 1 : 0;
+        peak = std::max(peak, open);
+    }
+    peak = std::max(peak, (size_t) 1);
+
+    // Timed connections wait in a queue ordered by their next event
+    typedef std::pair<double, size_t> due_t;
+    std::priority_queue<due_t, vector<due_t>, std::greater<due_t>> timers;
+    int epoll = epoll_create1(0);
+    replay_totals totals = {};
+    size_t started = 0;
+    double begin = nowSeconds();
+
+    if (speed > 0) {
+        for (size_t i = 0; i < conns.size(); i++) {
+            timers.push(due_t(conns[i].events[0]->time / 1e6 / speed, i));
+        }
+    }
+    while (totals.finished < conns.size()) {
+        // With --max, start connections in capture order up to the capture's own peak
+        while (speed == 0 && started - totals.finished < peak && started < conns.size()) {
+            advance(epoll, conns, started++, totals, host, port, begin, speed);
+        }
+        while (!timers.empty() && begin + timers.top().first <= nowSeconds()) {
+            size_t index = timers.top().second;
+            timers.pop();
+            advance(epoll, conns, index, totals, host, port, begin, speed);
+            replay_connection& conn = conns[index];
+            if (conn.next < conn.events.size() && begin + conn.events[conn.next]->time / 1e6 / speed > nowSeconds()) {
+                timers.push(due_t(conn.events[conn.next]->time / 1e6 / speed, index));
+            }
+        }
+
+        if (totals.finished == conns.size()) {
+            break;
+        }
+        int timeout = -1;
+        if (!timers.empty()) {
+            timeout = std::max(0, (int) ((begin + timers.top().first - nowSeconds()) * 1000));
+        }
+        struct epoll_event ready[64];
+        int count = epoll_wait(epoll, ready, 64, timeout);
+        for (int i = 0; i < count; i++) {
+            size_t index = ready[i].data.u64;
+            replay_connection& conn = conns[index];
+            bool eof = false;
+            char buffer[65536];
+            ssize_t received;
+
+            if (conn.fd < 0) {
+                continue;
+            }
+            if (ready[i].events & EPOLLOUT) {
+                flush(epoll, conn, index);
+            }
+            while ((received = recv(conn.fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+                conn.incoming.append(buffer, received);
+            }
+            eof = received == 0 || (received < 0 && errno != EAGAIN);
+            readResponses(conn, totals, eof);
+            if (eof) {
+                disconnect(conn, totals);
+            }
+
+            // Due events held back by outstanding responses go out now, the rest stay on their timers
+            advance(epoll, conns, index, totals, host, port, begin, speed);
+        }
+    }
+    double elapsed = nowSeconds() - begin;
+    close(epoll);
+
+    std::sort(totals.latencies.begin(), totals.latencies.end());
+    size_t done = totals.latencies.size();
+    printf("connections %zu reconnects %zu requests %zu errors %zu time %.3fs\n", totals.connections, totals.reconnects, done, totals.errors, elapsed);
+    printf("status 1xx %zu 2xx %zu 3xx %zu 4xx %zu 5xx %zu\n", totals.statuses[1], totals.statuses[2], totals.statuses[3], totals.statuses[4], totals.statuses[5]);
+    printf("throughput %.0f req/s\n", done / elapsed);
+    if (done > 0) {
+        printf("latency p50 %.1fus p99 %.1fus max %.1fus\n", totals.latencies[done / 2] * 1e6, totals.latencies[done * 99 / 100] * 1e6, totals.latencies[done - 1] * 1e6);
+    }
+    if (speed > 0) {
+        printf("schedule lag max %.1fms\n", totals.lag * 1e3);
+    }
+    return totals.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// End of file
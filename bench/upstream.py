@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# Stand-in upstream for testing the proxy handler. Keep-alive HTTP/1.1 that
+# reports which connection served each request, so reuse is visible.
+# Usage: bench/upstream.py [port]
+#   .../chunked   chunked response body
+#   .../bytes/N   N bytes with a Content-Length
+#   anything else "port P connection C request R"
+import itertools
+import sys
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+PORT = int(sys.argv[1]) if len(sys.argv) > 1 else 9001
+connections = itertools.count(1)
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # Buffered, so each response leaves in one write and Nagle never delays it
+    wbufsize = -1
+
+    def setup(self):
+        super().setup()
+        self.connection_id = next(connections)
+        self.served = 0
+
+    def do_GET(self):
+        self.served += 1
+        if self.path.endswith("/chunked"):
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain")
+            self.send_header("Transfer-Encoding", "chunked")
+            self.end_headers()
+            for part in (b"chunked ", b"upstream ", b"body\n"):
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+            self.wfile.write(b"0\r\n\r\n")
+            return
+        if "/bytes/" in self.path:
+            body = b"x" * int(self.path.rsplit("/", 1)[1])
+        else:
+            body = b"port %d connection %d request %d forwarded-for %s\n" % (
+                PORT, self.connection_id, self.served,
+                self.headers.get("X-Forwarded-For", "-").encode())
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+ThreadingHTTPServer(("127.0.0.1", PORT), Handler).serve_forever()
@@ -0,0 +1,96 @@
+#include "bufpool.h"
+
+////////////////////////////////////////////////
+//              BufferPool                    //
+////////////////////////////////////////////////
+memory_limits DefaultMemoryLimits() {
+    memory_limits limits;
+    limits.budget = MEMORY_BUDGET;
+    limits.pool = POOL_BYTES;
+    return limits;
+}
+
+BufferPool::BufferPool() {
+    bytes = 0;
+    limit = POOL_BYTES;
+    reused = 0;
+    allocated = 0;
+    total = NULL;
+}
+
+void BufferPool::Configure(size_t limit, unsigned long* total) {
+    this->limit = limit;
+    this->total = total;
+    Trim(limit);
+}
+
+void BufferPool::Account(size_t added, size_t removed) {
+    bytes += added;
+    bytes -= removed;
+    if (total != NULL) {
+        __sync_add_and_fetch(total, added);
+        __sync_sub_and_fetch(total, removed);
+    }
+}
+
+int BufferPool::ClassOf(size_t length, bool up) {
+    // Smallest class holding length when acquiring, largest one length holds when releasing
+    int index = 0;
+    size_t size = POOL_MIN_LENGTH;
+    while (index < POOL_CLASSES - 1 && size < length) {
+        index++;
+        size <<= 1;
+    }
+    if (!up && size > length) {
+        index--;
+    }
+    return length > size ? -1 : index;
+}
+
+void BufferPool::Acquire(string& buffer, size_t length) {
+    if (HeapBytes(buffer) > 0) {
+        return;
+    }
+    int index = ClassOf(length, true);
+    if (index >= 0 && !free[index].empty()) {
+        buffer.swap(free[index].back());
+        free[index].pop_back();
+        Account(0, HeapBytes(buffer));
+        reused++;
+        return;
+    }
+    buffer.reserve(index >= 0 ? (size_t) POOL_MIN_LENGTH << index : length);
+    allocated++;
+}
+
+void BufferPool::Release(string& buffer) {
+    size_t size = HeapBytes(buffer);
+    if (size == 0 || !buffer.empty()) {
+        return;
+    }
+    int index = ClassOf(buffer.capacity(), false);
+    if (index >= 0 && bytes + size <= limit) {
+        free[index].push_back(string());
+        free[index].back().swap(buffer);
+        Account(size, 0);
+        return;
+    }
+    string().swap(buffer);
+}
+
+size_t BufferPool::Trim(size_t keep) {
+    size_t freed = 0;
+
+    // Largest buffers go first
+    for (int index = POOL_CLASSES - 1; index >= 0 && bytes > keep; index--) {
+        while (!free[index].empty() && bytes > keep) {
+            size_t size = HeapBytes(free[index].back());
+            free[index].pop_back();
+            Account(0, size);
+            freed += size;
+        }
+    }
+    return freed;
+}
+
+// End of file
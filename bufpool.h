@@ -0,0 +1,68 @@
+#pragma once
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define POOL_CLASSES       5           // size classes, 4 KB doubling up to 64 KB
+#define POOL_MIN_LENGTH    4096
+#define POOL_BYTES         4194304     // free buffer bytes a worker keeps
+#define MEMORY_BUDGET      0           // bytes for connections and pools across workers, 0 turns shedding off
+#define MEMORY_LOW_MARK    0.875       // shedding stops below this share of the budget
+
+using std::string;
+using std::vector;
+
+// Memory policy, set with the config's memory directive
+struct memory_limits {
+    size_t budget;
+    size_t pool;
+};
+
+memory_limits DefaultMemoryLimits();
+
+// Free connection buffers of one worker, by size class. Idle connections hand their buffers
+// back and take one again once readable, so a connection that isn't moving bytes holds no
+// buffer at all. Buffers over the largest class, and anything past the pool's byte limit,
+// are freed instead of kept.
+class BufferPool {
+private:
+    vector<string> free[POOL_CLASSES];
+    size_t bytes;
+    size_t limit;
+    size_t reused;
+    size_t allocated;
+    unsigned long* total;       // shared gauge of pooled bytes across workers, may be NULL
+
+    static int ClassOf(size_t length, bool up);
+    void Account(size_t added, size_t removed);
+public:
+    // Constructor
+    BufferPool();
+
+    void Configure(size_t limit, unsigned long* total);
+
+    // Gives an empty buffer at least length bytes of storage, unless it has some already
+    void Acquire(string& buffer, size_t length);
+
+    // Takes the storage of an empty buffer, leaving it with none. Buffers holding data are kept.
+    void Release(string& buffer);
+
+    // Frees pooled buffers until at most keep bytes remain, returns the bytes freed
+    size_t Trim(size_t keep);
+
+    size_t get_bytes() { return bytes; }
+    size_t get_reused() { return reused; }
+    size_t get_allocated() { return allocated; }
+};
+
+// Heap bytes a string owns, nothing while its contents fit inline
+inline size_t HeapBytes(const string& buffer) {
+    return buffer.capacity() > string().capacity() ? buffer.capacity() + 1 : 0;
+}
+
+#endif
+
+// End of header
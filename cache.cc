@@ -0,0 +1,208 @@
+#include <sys/mman.h>
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "cache.h"
+#include "pack.h"
+
+////////////////////////////////////////////////
+//              ResponseCache                 //
+////////////////////////////////////////////////
+
+ResponseCache::ResponseCache() {
+    size_t slabsize = (size_t) CACHE_CLASSES * CACHE_CLASS_BYTES;
+    uint64_t offset = 0;
+
+    // Shared anonymous mapping survives fork, slab pages are only backed once written
+    mapped = sizeof(cache_state) + slabsize;
+    state = (cache_state*) mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(state, 0, sizeof(cache_state));
+    slab = (char*) state + sizeof(cache_state);
+
+    for (int kind = 0; kind < CACHE_CLASSES; kind++) {
+        cache_class* each = &state->classes[kind];
+        each->size = CACHE_SMALLEST << (2 * kind);
+        each->count = CACHE_CLASS_BYTES / each->size;
+        each->hand = 0;
+        each->offset = offset;
+        offset += CACHE_CLASS_BYTES;
+    }
+}
+
+ResponseCache::~ResponseCache() {
+    munmap(state, mapped);
+}
+
+cache_slot* ResponseCache::Slot(uint32_t id) {
+    cache_class* each = &state->classes[id >> 24];
+    return (cache_slot*) (slab + each->offset + (uint64_t) (id & 0xffffff) * each->size);
+}
+
+bool ResponseCache::Lookup(const string& key, string& response) {
+    uint64_t hash = PackHash(key.c_str(), key.length()) | 1;
+    uint32_t home = hash & (CACHE_INDEX - 1);
+
+    // Every probe entry is checked, removals leave holes rather than tombstones
+    for (uint32_t i = 0; i < CACHE_PROBES; i++) {
+        cache_index_entry* entry = &state->index[(home + i) & (CACHE_INDEX - 1)];
+        if (entry->hash != hash) {
+            continue;
+        }
+        uint32_t id = entry->slot;
+        if ((id >> 24) < CACHE_CLASSES && (id & 0xffffff) < state->classes[id >> 24].count && Read(id, hash, key, response)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ResponseCache::Read(uint32_t id, uint64_t hash, const string& key, string& response) {
+    cache_slot* slot = Slot(id);
+    size_t capacity = state->classes[id >> 24].size - sizeof(cache_slot);
+    const char* data = (const char*) (slot + 1);
+
+    for (int attempt = 0; attempt < CACHE_READ_RETRIES; attempt++) {
+        unsigned begin = slot->sequence;
+        if (begin & 1) {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+
+        // Fields may be torn while a writer is inside, bound them before copying anything
+        size_t keylength = slot->keylength;
+        size_t length = slot->length;
+        bool match = slot->hash == hash && keylength == key.length() && keylength + length <= capacity &&
+                     memcmp(data, key.c_str(), keylength) == 0;
+        bool fresh = slot->expires > time(NULL);
+        if (match && fresh) {
+            response.assign(data + keylength, length);
+        }
+        __sync_synchronize();
+        if (slot->sequence != begin) {
+            continue;
+        }
+        if (!match || !fresh) {
+            return false;
+        }
+        slot->referenced = 1;
+        return true;
+    }
+    return false;
+}
+
+bool ResponseCache::Store(const string& key, const string& response, int ttl) {
+    uint64_t hash = PackHash(key.c_str(), key.length()) | 1;
+    uint32_t home = hash & (CACHE_INDEX - 1);
+    size_t needed = sizeof(cache_slot) + key.length() + response.length();
+    cache_index_entry* open = NULL;
+    int kind = 0;
+
+    // Smallest class that fits
+    while (kind < CACHE_CLASSES && state->classes[kind].size < needed) {
+        kind++;
+    }
+    if (kind == CACHE_CLASSES || ttl <= 0) {
+        return false;
+    }
+
+    Lock();
+
+    // Another worker may have stored the same key meanwhile, the newer response replaces it
+    for (uint32_t i = 0; i < CACHE_PROBES; i++) {
+        cache_index_entry* entry = &state->index[(home + i) & (CACHE_INDEX - 1)];
+        if (entry->hash == hash) {
+            Evict(entry->slot);
+        }
+        if (entry->hash == 0 && open == NULL) {
+            open = entry;
+        }
+    }
+
+    // No free index entry in the probe window: the home entry's response goes
+    if (open == NULL) {
+        open = &state->index[home];
+        Evict(open->slot);
+        open->hash = 0;
+    }
+
+    uint32_t id = Victim(kind);
+    cache_slot* slot = Slot(id);
+    char* data = (char*) (slot + 1);
+    __sync_fetch_and_add(&slot->sequence, 1);
+    slot->hash = hash;
+    slot->expires = time(NULL) + ttl;
+    slot->keylength = key.length();
+    slot->length = response.length();
+    slot->referenced = 0;
+    memcpy(data, key.c_str(), key.length());
+    memcpy(data + key.length(), response.c_str(), response.length());
+    __sync_fetch_and_add(&slot->sequence, 1);
+
+    // Publish the slot before the hash, so a matching hash never points at an old slot id
+    open->slot = id;
+    __sync_synchronize();
+    open->hash = hash;
+    __sync_fetch_and_add(&state->stores, 1);
+
+    Unlock();
+    return true;
+}
+
+uint32_t ResponseCache::Victim(int kind) {
+    cache_class* each = &state->classes[kind];
+
+    // CLOCK: a free slot, else the first one not hit since the hand last passed it
+    for (uint32_t i = 0; i < 2 * each->count; i++) {
+        uint32_t id = (kind << 24) | (each->hand++ % each->count);
+        cache_slot* slot = Slot(id);
+        if (slot->hash == 0) {
+            return id;
+        }
+        if (slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+        Evict(id);
+        return id;
+    }
+    uint32_t id = (kind << 24) | (each->hand++ % each->count);
+    Evict(id);
+    return id;
+}
+
+void ResponseCache::Evict(uint32_t id) {
+    cache_slot* slot = Slot(id);
+    uint32_t home = slot->hash & (CACHE_INDEX - 1);
+
+    // Called with the lock held, drops the slot and the index entry pointing at it
+    if (slot->hash == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < CACHE_PROBES; i++) {
+        cache_index_entry* entry = &state->index[(home + i) & (CACHE_INDEX - 1)];
+        if (entry->hash == slot->hash && entry->slot == id) {
+            entry->hash = 0;
+        }
+    }
+    __sync_fetch_and_add(&slot->sequence, 1);
+    slot->hash = 0;
+    __sync_fetch_and_add(&slot->sequence, 1);
+    __sync_fetch_and_add(&state->evictions, 1);
+}
+
+void ResponseCache::Lock() {
+    // A writer holds it for two memcpys, spinning beats sleeping
+    while (__sync_lock_test_and_set(&state->lock, 1)) {
+        while (state->lock) {
+        }
+    }
+}
+
+// End of file
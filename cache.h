@@ -0,0 +1,81 @@
+#pragma once
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <string>
+
+#define CACHE_INDEX         8192        // index entries, a power of two
+#define CACHE_PROBES        8           // index entries a key may sit in, from its home entry on
+#define CACHE_CLASSES       5
+#define CACHE_SMALLEST      4096        // slot size of the first class, each next class is 4x larger
+#define CACHE_CLASS_BYTES   8388608     // every class gets the same share of the slab
+#define CACHE_TTL           60          // seconds, for routes without maxage
+#define CACHE_READ_RETRIES  4
+
+using std::string;
+
+// Slab slot header, the key and then the response follow it. Writers bump sequence to odd
+// before touching a slot and back to even after, readers retry when it moved under them.
+struct cache_slot {
+    volatile unsigned sequence;
+    volatile unsigned char referenced;  // CLOCK bit, set on every hit
+    uint64_t hash;                      // 0 marks a free slot
+    int64_t expires;                    // wall clock seconds
+    uint32_t keylength;
+    uint32_t length;
+};
+
+struct cache_class {
+    uint32_t size;                      // bytes per slot, header included
+    uint32_t count;
+    uint32_t hand;                      // CLOCK hand
+    uint64_t offset;                    // of the first slot from the start of the slab
+};
+
+// A hint only: readers check the slot's own hash and key under its seqlock
+struct cache_index_entry {
+    volatile uint64_t hash;
+    volatile uint32_t slot;             // class << 24 | slot number
+};
+
+struct cache_state {
+    volatile int lock;                  // held by writers, readers never take it
+    volatile unsigned long stores;
+    volatile unsigned long evictions;
+    cache_class classes[CACHE_CLASSES];
+    cache_index_entry index[CACHE_INDEX];
+};
+
+// Response cache in one shared anonymous mapping created before any fork, so every worker
+// process and thread reads and fills the same entries. Responses go to the smallest slab
+// class they fit; a full class evicts with a CLOCK hand kept in the mapping, whichever
+// process runs it. Lookups are lock free, stores serialize on a spinlock.
+class ResponseCache {
+private:
+    cache_state* state;
+    char* slab;
+    size_t mapped;
+
+    cache_slot* Slot(uint32_t id);
+    bool Read(uint32_t id, uint64_t hash, const string& key, string& response);
+    uint32_t Victim(int kind);
+    void Evict(uint32_t id);
+    void Lock();
+    void Unlock() { __sync_lock_release(&state->lock); }
+public:
+    // Constructor/Destructor
+    ResponseCache();
+    ~ResponseCache();
+
+    bool Lookup(const string& key, string& response);
+
+    // False when the response is larger than the largest slot
+    bool Store(const string& key, const string& response, int ttl);
+    unsigned long get_stores() { return state->stores; }
+    unsigned long get_evictions() { return state->evictions; }
+};
+
+#endif
+
+// End of header
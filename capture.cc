@@ -0,0 +1,140 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include "capture.h"
+
+////////////////////////////////////////////////
+//              Capture                       //
+////////////////////////////////////////////////
+
+static long long nowMicroseconds() {
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    return (long long) clock.tv_sec * 1000000 + clock.tv_nsec / 1000;
+}
+
+Capture::Capture() {
+    file = -1;
+    started = 0;
+    counter = NULL;
+}
+
+Capture::~Capture() {
+    if (file >= 0) {
+        close(file);
+    }
+    if (counter != NULL) {
+        munmap((void*) counter, sizeof(*counter));
+    }
+}
+
+bool Capture::Start(const char* filename) {
+    // O_APPEND keeps each record's single write whole when workers write at once. Requests hold
+    // credentials and cookies, only the server's user may read them, also from an older file.
+    file = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (file < 0 || fchmod(file, 0600) < 0) {
+        perror(filename);
+        return false;
+    }
+    if (write(file, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != CAPTURE_MAGIC_LENGTH) {
+        perror("write");
+        close(file);
+        file = -1;
+        return false;
+    }
+
+    // Connection ids come from a counter forked children share
+    counter = (volatile uint32_t*) mmap(NULL, sizeof(*counter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counter == MAP_FAILED) {
+        perror("mmap");
+        counter = NULL;
+        close(file);
+        file = -1;
+        return false;
+    }
+    *counter = 0;
+    started = nowMicroseconds();
+    return true;
+}
+
+uint32_t Capture::Connect() {
+    if (file < 0) {
+        return 0;
+    }
+    uint32_t connection = __sync_add_and_fetch(counter, 1);
+    Write(CAPTURE_OPEN, connection, NULL, 0);
+    return connection;
+}
+
+void Capture::Write(capture_kind_t kind, uint32_t connection, const char* data, size_t length) {
+    char header[1 + 3 * CAPTURE_VARINT_MAX];
+    struct iovec iov[2];
+    size_t used = 0;
+
+    header[used++] = (char) kind;
+    used += PutVarint(header + used, nowMicroseconds() - started);
+    used += PutVarint(header + used, connection);
+    if (kind == CAPTURE_DATA) {
+        used += PutVarint(header + used, length);
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = used;
+    iov[1].iov_base = (void*) data;
+    iov[1].iov_len = length;
+
+    // A failed write loses the record, never the connection it belongs to
+    if (writev(file, iov, length > 0 ? 2 : 1) < 0) {
+        perror("capture");
+    }
+}
+
+bool LoadCapture(const char* filename, vector<capture_event>& events) {
+    std::ifstream input(filename, std::ios::binary);
+    string contents;
+
+    if (!input.good()) {
+        perror(filename);
+        return false;
+    }
+    contents.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    if (contents.compare(0, CAPTURE_MAGIC_LENGTH, CAPTURE_MAGIC) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", filename);
+        return false;
+    }
+
+    const char* in = contents.c_str() + CAPTURE_MAGIC_LENGTH;
+    const char* end = contents.c_str() + contents.length();
+    while (in < end) {
+        capture_event event;
+        uint64_t connection;
+        uint64_t length = 0;
+
+        event.kind = (capture_kind_t) *in++;
+        if (event.kind < CAPTURE_OPEN || event.kind > CAPTURE_CLOSE || !GetVarint(in, end, event.time) ||
+            !GetVarint(in, end, connection) || (event.kind == CAPTURE_DATA && !GetVarint(in, end, length)) ||
+            length > (uint64_t) (end - in)) {
+            fprintf(stderr, "%s: truncated or corrupt at byte %zu\n", filename, (size_t) (in - contents.c_str()));
+            return false;
+        }
+        event.connection = connection;
+        event.data.assign(in, length);
+        in += length;
+        events.push_back(event);
+    }
+
+    // Workers append independently, a stable sort restores time order without reordering a connection
+    std::stable_sort(events.begin(), events.end(), [](const capture_event& a, const capture_event& b) {
+        return a.time < b.time;
+    });
+    return true;
+}
+
+// End of file
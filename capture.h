@@ -0,0 +1,98 @@
+#pragma once
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#define CAPTURE_MAGIC        "HTTPCAP1"
+#define CAPTURE_MAGIC_LENGTH 8
+#define CAPTURE_VARINT_MAX   10      // bytes of a 64 bit LEB128 varint
+
+using std::string;
+using std::vector;
+
+// Capture file: CAPTURE_MAGIC, then one record per event, in the order workers wrote them.
+//
+//   kind        1 byte, capture_kind_t
+//   time        varint, microseconds since the capture started
+//   connection  varint, capture-wide id, unique across forked workers
+//   length      varint, CAPTURE_DATA only
+//   bytes       length raw bytes as read from the socket (decrypted for TLS)
+//
+// Varints are unsigned LEB128. Records of one connection are in time order, records of
+// different workers may interleave slightly out of it.
+enum capture_kind_t {
+    CAPTURE_OPEN = 1, CAPTURE_DATA, CAPTURE_CLOSE,
+};
+
+struct capture_event {
+    capture_kind_t kind;
+    uint64_t time;
+    uint32_t connection;
+    string data;
+};
+
+inline size_t PutVarint(char* out, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (char) value;
+    return length;
+}
+
+// False when the varint runs past end
+inline bool GetVarint(const char*& in, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Records what clients send, connection by connection, for bench/replay. Started before any
+// fork: every worker process and thread appends to the same file with one write per record.
+// Connections get id 0 while capturing is off, and recording for id 0 does nothing.
+class Capture {
+private:
+    int file;
+    long long started;              // monotonic microseconds
+    volatile uint32_t* counter;     // shared, last connection id handed out
+
+    void Write(capture_kind_t kind, uint32_t connection, const char* data, size_t length);
+public:
+    // Constructor/Destructor
+    Capture();
+    ~Capture();
+
+    // Truncates filename and writes the file header
+    bool Start(const char* filename);
+    bool is_enabled() { return file >= 0; }
+
+    uint32_t Connect();
+    void Record(uint32_t connection, const char* data, size_t length) {
+        if (connection != 0) {
+            Write(CAPTURE_DATA, connection, data, length);
+        }
+    }
+    void Disconnect(uint32_t connection) {
+        if (connection != 0) {
+            Write(CAPTURE_CLOSE, connection, NULL, 0);
+        }
+    }
+};
+
+// Reads a whole capture, events sorted by time. False on a missing or malformed file.
+bool LoadCapture(const char* filename, vector<capture_event>& events);
+
+#endif
+
+// End of header
@@ -0,0 +1,367 @@
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "config.h"
+#include "http.h"
+
+using std::cerr;
+using std::endl;
+using std::ifstream;
+using std::stringstream;
+
+// Whole numbers without a sign that fit an int
+static bool parseCount(const string& value, int& number) {
+    if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+        return false;
+    }
+    errno = 0;
+    long parsed = strtol(value.c_str(), NULL, 10);
+    if (errno == ERANGE || parsed > INT_MAX) {
+        return false;
+    }
+    number = parsed;
+    return true;
+}
+
+// Non-negative decimals, rates may be fractions of a request per second
+static bool parseRate(const string& value, double& number) {
+    size_t point = value.find('.');
+    if (value.empty() || value.compare(".") == 0 || value.find_first_not_of("0123456789.") != string::npos ||
+        (point != string::npos && value.find('.', point + 1) != string::npos)) {
+        return false;
+    }
+    number = strtod(value.c_str(), NULL);
+    return true;
+}
+
+////////////////////////////////////////////////
+//              ServerConfig                  //
+////////////////////////////////////////////////
+ServerConfig::ServerConfig() {
+    // Everything under DIRECTORY, PHP chosen by extension
+    route root;
+    root.uri = "/";
+    root.exact = false;
+    root.handler = STATIC_HANDLER;
+    root.target = DIRECTORY;
+    root.cache = true;
+    root.gzip = true;
+    root.maxage = -1;
+    root.microcache = 0;
+    root.stale = 0;
+    routes.push_back(root);
+
+    // Admission limits, rate limiting stays off unless configured
+    limits.connections = CLIENT_CONNECTIONS;
+    limits.rate = 0;
+    limits.burst = 0;
+    limits.inflight = SERVER_INFLIGHT;
+    clients = DefaultClientLimits();
+    sockets = DefaultSocketOptions();
+    memory = DefaultMemoryLimits();
+}
+
+bool ServerConfig::Load(const char* filename) {
+    ifstream file(filename);
+    vector<route> loaded;
+    string line;
+    string error;
+    int number = 0;
+
+    if (!file.good()) {
+        perror(filename);
+        return false;
+    }
+    while (getline(file, line)) {
+        number++;
+
+        // Split into words, dropping comments
+        size_t comment = line.find('#');
+        if (comment != string::npos) {
+            line.erase(comment);
+        }
+        stringstream stream(line);
+        vector<string> words;
+        string word;
+        while (stream >> word) {
+            words.push_back(word);
+        }
+        if (words.empty()) {
+            continue;
+        }
+
+        if (words[0].compare("route") == 0) {
+            route entry;
+            if (!ParseRoute(words, entry, error)) {
+                cerr << filename << ":" << number << ": " << error << endl;
+                return false;
+            }
+            loaded.push_back(entry);
+        } else if (words[0].compare("limit") == 0) {
+            if (!ParseLimit(words, error)) {
+                cerr << filename << ":" << number << ": " << error << endl;
+                return false;
+            }
+        } else if (words[0].compare("client") == 0) {
+            if (!ParseClient(words, error)) {
+                cerr << filename << ":" << number << ": " << error << endl;
+                return false;
+            }
+        } else if (words[0].compare("socket") == 0) {
+            if (!ParseSocket(words, error)) {
+                cerr << filename << ":" << number << ": " << error << endl;
+                return false;
+            }
+        } else if (words[0].compare("memory") == 0) {
+            if (!ParseMemory(words, error)) {
+                cerr << filename << ":" << number << ": " << error << endl;
+                return false;
+            }
+        } else {
+            cerr << filename << ":" << number << ": unknown directive " << words[0] << endl;
+            return false;
+        }
+    }
+
+    // A config with routes replaces the default table
+    if (!loaded.empty()) {
+        routes = loaded;
+    }
+    return true;
+}
+
+bool ServerConfig::ParseRoute(const vector<string>& words, route& entry, string& error) {
+    size_t i = 4;
+
+    // route <exact|prefix> <uri> <handler> [target] [options]
+    if (words.size() < 4) {
+        error = "route needs a match type, a URI and a handler";
+        return false;
+    }
+    if (words[1].compare("exact") == 0) {
+        entry.exact = true;
+    } else if (words[1].compare("prefix") == 0) {
+        entry.exact = false;
+    } else {
+        error = "match type must be exact or prefix";
+        return false;
+    }
+    entry.uri = words[2];
+    if (entry.uri[0] != '/') {
+        error = "route URI must start with /";
+        return false;
+    }
+    entry.handler = GetRouteHandler(words[3]);
+    if (entry.handler == INVALID_HANDLER) {
+        error = "unknown handler " + words[3];
+        return false;
+    }
+
+    // Target is required for everything but metrics
+    entry.target = "";
+    if (i < words.size() && words[i].find('=') == string::npos) {
+        entry.target = words[i];
+        i++;
+    }
+    if (entry.target.empty() && entry.handler != METRICS_HANDLER) {
+        error = words[3] + " route needs a target";
+        return false;
+    }
+
+    // Policy options
+    entry.cache = true;
+    entry.gzip = true;
+    entry.maxage = -1;
+    entry.microcache = 0;
+    entry.stale = 0;
+    for (; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        string name = words[i].substr(0, equals);
+        string value = equals == string::npos ? "" : words[i].substr(equals + 1);
+        int* number = NULL;
+
+        if (words[i].compare("cache=on") == 0 || words[i].compare("cache=off") == 0) {
+            entry.cache = words[i].compare("cache=on") == 0;
+        } else if (words[i].compare("gzip=on") == 0 || words[i].compare("gzip=off") == 0) {
+            entry.gzip = words[i].compare("gzip=on") == 0;
+        } else if (name.compare("maxage") == 0) {
+            number = &entry.maxage;
+        } else if (name.compare("microcache") == 0) {
+            number = &entry.microcache;
+        } else if (name.compare("stale") == 0) {
+            number = &entry.stale;
+        } else {
+            error = "unknown route option " + words[i];
+            return false;
+        }
+        if (number != NULL && !parseCount(value, *number)) {
+            error = name + " must be a number of seconds";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ServerConfig::ParseLimit(const vector<string>& words, string& error) {
+    // limit [connections=n] [rate=n] [burst=n] [inflight=n], 0 turns a limit off
+    for (size_t i = 1; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        string name = words[i].substr(0, equals);
+        string value = equals == string::npos ? "" : words[i].substr(equals + 1);
+        int count = 0;
+        bool valid;
+
+        if (name.compare("connections") == 0) {
+            valid = parseCount(value, count);
+            limits.connections = count;
+        } else if (name.compare("rate") == 0) {
+            valid = parseRate(value, limits.rate);
+        } else if (name.compare("burst") == 0) {
+            valid = parseRate(value, limits.burst);
+        } else if (name.compare("inflight") == 0) {
+            valid = parseCount(value, count);
+            limits.inflight = count;
+        } else {
+            error = "unknown limit " + words[i];
+            return false;
+        }
+        if (!valid) {
+            error = name + " must be a number";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ServerConfig::ParseClient(const vector<string>& words, string& error) {
+    // client [name=value ...], minrate=0 turns the rate check off
+    for (size_t i = 1; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        string name = words[i].substr(0, equals);
+        string value = equals == string::npos ? "" : words[i].substr(equals + 1);
+
+        int* number = NULL;
+
+        if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+            error = name + " must be a number";
+            return false;
+        }
+        if (name.compare("header") == 0) {
+            number = &clients.header;
+        } else if (name.compare("body") == 0) {
+            number = &clients.body;
+        } else if (name.compare("minrate") == 0) {
+            number = &clients.minrate;
+        } else if (name.compare("maxheader") == 0) {
+            clients.maxheader = strtoul(value.c_str(), NULL, 10);
+        } else if (name.compare("maxbody") == 0) {
+            clients.maxbody = strtoul(value.c_str(), NULL, 10);
+        } else {
+            error = "unknown client option " + name;
+            return false;
+        }
+        if (number != NULL && !parseCount(value, *number)) {
+            error = name + " is too large";
+            return false;
+        }
+    }
+    if (clients.header < 1 || clients.body < 1) {
+        error = "header and body timeouts must be at least a second";
+        return false;
+    }
+    if (clients.maxheader < 64) {
+        error = "maxheader must be at least 64 bytes";
+        return false;
+    }
+    return true;
+}
+
+bool ServerConfig::ParseSocket(const vector<string>& words, string& error) {
+    // socket [name=value ...], sizes and times of 0 keep the kernel default
+    for (size_t i = 1; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        string name = words[i].substr(0, equals);
+        string value = equals == string::npos ? "" : words[i].substr(equals + 1);
+        bool* flag = NULL;
+        int* number = NULL;
+
+        if (name.compare("ipv6") == 0) {
+            flag = &sockets.ipv6;
+        } else if (name.compare("nodelay") == 0) {
+            flag = &sockets.nodelay;
+        } else if (name.compare("cork") == 0) {
+            flag = &sockets.cork;
+        } else if (name.compare("port") == 0) {
+            number = &sockets.port;
+        } else if (name.compare("backlog") == 0) {
+            number = &sockets.backlog;
+        } else if (name.compare("deferaccept") == 0) {
+            number = &sockets.deferaccept;
+        } else if (name.compare("fastopen") == 0) {
+            number = &sockets.fastopen;
+        } else if (name.compare("rcvbuf") == 0) {
+            number = &sockets.rcvbuf;
+        } else if (name.compare("sndbuf") == 0) {
+            number = &sockets.sndbuf;
+        } else if (name.compare("busypoll") == 0) {
+            number = &sockets.busypoll;
+        } else {
+            error = "unknown socket option " + name;
+            return false;
+        }
+
+        if (flag != NULL) {
+            if (value.compare("on") != 0 && value.compare("off") != 0) {
+                error = name + " must be on or off";
+                return false;
+            }
+            *flag = value.compare("on") == 0;
+        } else {
+            if (!parseCount(value, *number)) {
+                error = name + " must be a number";
+                return false;
+            }
+        }
+    }
+    if (sockets.port < 1 || sockets.port > 65535) {
+        error = "port must be between 1 and 65535";
+        return false;
+    }
+    if (sockets.backlog == 0) {
+        sockets.backlog = BACKLOG;
+    }
+    return true;
+}
+
+bool ServerConfig::ParseMemory(const vector<string>& words, string& error) {
+    // memory [name=value ...], budget=0 turns shedding off
+    for (size_t i = 1; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        string name = words[i].substr(0, equals);
+        string value = equals == string::npos ? "" : words[i].substr(equals + 1);
+
+        if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+            error = name + " must be a number";
+            return false;
+        }
+        if (name.compare("budget") == 0) {
+            memory.budget = strtoull(value.c_str(), NULL, 10);
+        } else if (name.compare("pool") == 0) {
+            memory.pool = strtoull(value.c_str(), NULL, 10);
+        } else {
+            error = "unknown memory option " + name;
+            return false;
+        }
+    }
+    if (memory.budget > 0 && memory.pool > memory.budget / 2) {
+        error = "pool must be at most half the budget";
+        return false;
+    }
+    return true;
+}
+
+// End of file
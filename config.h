@@ -0,0 +1,51 @@
+#pragma once
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+#include "admission.h"
+#include "bufpool.h"
+#include "deadline.h"
+#include "router.h"
+#include "sockopt.h"
+
+using std::string;
+using std::vector;
+
+// Server configuration, read once at startup from a line based file:
+//
+//   # comment
+//   route <exact|prefix> <uri> <static|php|redirect|proxy|metrics> [target] [cache=on|off] [gzip=on|off] [maxage=seconds]
+//         [microcache=seconds] [stale=seconds]
+//   limit [connections=n] [rate=n] [burst=n] [inflight=n]
+//   client [header=seconds] [body=seconds] [minrate=bytes] [maxheader=bytes] [maxbody=bytes]
+//   socket [port=n] [backlog=n] [ipv6=on|off] [nodelay=on|off] [cork=on|off] [deferaccept=seconds]
+//          [fastopen=n] [rcvbuf=bytes] [sndbuf=bytes] [busypoll=microseconds]
+//   memory [budget=bytes] [pool=bytes]
+//
+// Without a config file everything is served from DIRECTORY.
+class ServerConfig {
+public:
+    vector<route> routes;
+    admission_limits limits;
+    client_limits clients;
+    socket_options sockets;
+    memory_limits memory;
+
+    // Constructor sets up the default route table
+    ServerConfig();
+
+    // Parses the file, printing file:line for the first error
+    bool Load(const char* filename);
+private:
+    bool ParseRoute(const vector<string>& words, route& entry, string& error);
+    bool ParseLimit(const vector<string>& words, string& error);
+    bool ParseClient(const vector<string>& words, string& error);
+    bool ParseSocket(const vector<string>& words, string& error);
+    bool ParseMemory(const vector<string>& words, string& error);
+};
+
+#endif
+
+// End of header
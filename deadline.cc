@@ -0,0 +1,174 @@
+#include <strings.h>
+#include <ctime>
+#include "deadline.h"
+
+client_limits DefaultClientLimits() {
+    client_limits limits;
+    limits.header = HEADER_TIMEOUT;
+    limits.body = BODY_TIMEOUT;
+    limits.minrate = MIN_RECEIVE_RATE;
+    limits.maxheader = HEADER_MAX_LENGTH;
+    limits.maxbody = BODY_MAX_LENGTH;
+    return limits;
+}
+
+long long MonotonicMs() {
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    return (long long) clock.tv_sec * 1000 + clock.tv_nsec / 1000000;
+}
+
+void TrackRead(read_deadline& reading, read_phase_t phase, size_t buffered, const client_limits& limits, long long now) {
+    reading.received = buffered;
+    if (reading.phase == phase) {
+        return;
+    }
+    reading.phase = phase;
+    reading.start = now;
+    reading.armed = 0;
+    if (phase == READ_HEAD) {
+        reading.expires = now + (long long) limits.header * 1000;
+    } else if (phase == READ_BODY) {
+        reading.expires = now + (long long) limits.body * 1000;
+    } else {
+        reading.expires = 0;
+    }
+}
+
+bool ReadExpired(const read_deadline& reading, const client_limits& limits, long long now) {
+    long long elapsed = now - reading.start;
+
+    if (reading.phase == READ_IDLE) {
+        return false;
+    }
+    if (now >= reading.expires) {
+        return true;
+    }
+
+    // Averaged over the whole phase, so a burst up front can't buy a long trickle after it
+    return limits.minrate > 0 && elapsed >= RATE_GRACE && (long long) reading.received * 1000 < (long long) limits.minrate * elapsed;
+}
+
+long long NextCheck(const read_deadline& reading, const client_limits& limits, long long now) {
+    long long when = reading.expires;
+
+    if (reading.phase == READ_IDLE) {
+        return -1;
+    }
+
+    // The moment the bytes so far stop covering minrate, unless more arrive first
+    if (limits.minrate > 0) {
+        long long starved = reading.start + (long long) reading.received * 1000 / limits.minrate + 1;
+        if (starved < reading.start + RATE_GRACE) {
+            starved = reading.start + RATE_GRACE;
+        }
+        if (starved < when) {
+            when = starved;
+        }
+    }
+    return when < now ? now : when;
+}
+
+frame_t FrameRequest(const string& input, const client_limits& limits, size_t& head, size_t& total) {
+    size_t end = input.find("\r\n\r\n");
+    size_t length = 0;
+    bool sized = false;
+
+    head = 0;
+    total = 0;
+    if (end == string::npos) {
+        return input.length() > limits.maxheader ? FRAME_HEADER_TOO_LARGE : FRAME_PARTIAL;
+    }
+    if (end + 4 > limits.maxheader) {
+        return FRAME_HEADER_TOO_LARGE;
+    }
+    head = end + 4;
+
+    // Only the headers that size the body matter here, matched at the start of a line
+    for (size_t line = input.find("\r\n"); line < end; line = input.find("\r\n", line + 2)) {
+        const char* text = input.c_str() + line + 2;
+        if (strncasecmp(text, "transfer-encoding:", 18) == 0) {
+            return FRAME_UNSUPPORTED;
+        }
+        if (strncasecmp(text, "content-length:", 15) != 0) {
+            continue;
+        }
+        size_t i = 15;
+        while (text[i] == ' ' || text[i] == '\t') {
+            i++;
+        }
+        if (text[i] < '0' || text[i] > '9') {
+            return FRAME_MALFORMED;
+        }
+
+        // Stop counting once past the limit, a huge value must not overflow
+        size_t value = 0;
+        while (text[i] >= '0' && text[i] <= '9' && value <= limits.maxbody) {
+            value = value * 10 + (text[i] - '0');
+            i++;
+        }
+        if (value > limits.maxbody) {
+            return FRAME_BODY_TOO_LARGE;
+        }
+
+        // Nothing but whitespace may follow, and repeats have to agree or the body's end is ambiguous
+        while (text[i] == ' ' || text[i] == '\t') {
+            i++;
+        }
+        if (text[i] != '\r' || (sized && value != length)) {
+            return FRAME_MALFORMED;
+        }
+        length = value;
+        sized = true;
+    }
+    total = head + length;
+    return input.length() < total ? FRAME_PARTIAL : FRAME_REQUEST;
+}
+
+////////////////////////////////////////////////
+//              TimerWheel                    //
+////////////////////////////////////////////////
+
+TimerWheel::TimerWheel() {
+    current = MonotonicMs() / TIMER_TICK;
+    count = 0;
+}
+
+void TimerWheel::Schedule(int fd, unsigned serial, long long when) {
+    timer_entry entry = { fd, serial, when };
+    long long tick = when / TIMER_TICK;
+
+    // Anything already due goes in the slot expired next
+    if (tick < current) {
+        tick = current;
+    }
+    slots[tick & (TIMER_SLOTS - 1)].push_back(entry);
+    count++;
+}
+
+void TimerWheel::Expire(long long now, vector<timer_entry>& due) {
+    long long last = now / TIMER_TICK;
+
+    // After a stall longer than a turn every slot is looked at once, not once per missed tick
+    if (last - current >= TIMER_SLOTS) {
+        current = last - TIMER_SLOTS + 1;
+    }
+
+    // The current slot is looked at again next time, entries may still land in it
+    for (long long tick = current; tick <= last; tick++) {
+        vector<timer_entry>& slot = slots[tick & (TIMER_SLOTS - 1)];
+        size_t kept = 0;
+        for (size_t i = 0; i < slot.size(); i++) {
+            if (slot[i].when <= now) {
+                due.push_back(slot[i]);
+                count--;
+            } else {
+                slot[kept++] = slot[i];
+            }
+        }
+        slot.resize(kept);
+    }
+    current = last;
+}
+
+// End of file
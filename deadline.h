@@ -0,0 +1,99 @@
+#pragma once
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#define HEADER_TIMEOUT     10      // seconds to receive a whole request head
+#define BODY_TIMEOUT       30      // seconds to receive a declared body
+#define MIN_RECEIVE_RATE   256     // bytes per second while a request is arriving, 0 turns it off
+#define RATE_GRACE         1000    // milliseconds into a head or body before the rate is checked
+#define HEADER_MAX_LENGTH  8192    // request line and headers, 431 beyond it
+#define BODY_MAX_LENGTH    1048576 // Content-Length, 413 beyond it
+#define TIMER_SLOTS        256     // timer wheel slots, a power of two
+#define TIMER_TICK         100     // milliseconds per wheel slot
+
+using std::string;
+using std::vector;
+
+// Per connection limits on how a request arrives, set with the config's client directive
+struct client_limits {
+    int header;             // seconds for the head, from its first byte
+    int body;               // seconds for the body, from the end of the head
+    int minrate;            // bytes per second over the whole head or body
+    size_t maxheader;
+    size_t maxbody;
+};
+
+client_limits DefaultClientLimits();
+
+enum read_phase_t {
+    READ_IDLE = 0, READ_HEAD, READ_BODY,
+};
+
+// Where the request at the front of a connection's input stands
+enum frame_t {
+    FRAME_PARTIAL = 0, FRAME_REQUEST, FRAME_HEADER_TOO_LARGE, FRAME_BODY_TOO_LARGE, FRAME_MALFORMED,
+    FRAME_UNSUPPORTED, FRAME_TIMEOUT, FRAME_CLOSED,
+};
+
+// The read in progress on one connection. Idle keep-alive connections have no deadline here,
+// the loops close them after TIME_OUT.
+struct read_deadline {
+    read_phase_t phase;
+    long long start;        // monotonic milliseconds, when the phase began
+    long long expires;      // monotonic milliseconds, the phase's hard deadline
+    long long armed;        // check time last put on a timer wheel, older entries are stale
+    size_t received;        // bytes since the phase began
+};
+
+long long MonotonicMs();
+
+// Moves to phase with buffered of its bytes arrived so far, the clock restarts when the phase
+// changes and the connection's timer entry goes stale
+void TrackRead(read_deadline& reading, read_phase_t phase, size_t buffered, const client_limits& limits, long long now);
+
+// True once the phase is past its deadline or the client is sending slower than minrate
+bool ReadExpired(const read_deadline& reading, const client_limits& limits, long long now);
+
+// When ReadExpired should be asked next, -1 while idle
+long long NextCheck(const read_deadline& reading, const client_limits& limits, long long now);
+
+// Finds one request at the front of input: head is the length up to and including the blank
+// line, total adds the Content-Length body. FRAME_PARTIAL until all of it has arrived, head
+// stays 0 until the head has. Request bodies with a Transfer-Encoding can't be framed.
+frame_t FrameRequest(const string& input, const client_limits& limits, size_t& head, size_t& total);
+
+struct timer_entry {
+    int fd;
+    unsigned serial;        // connection serial, a reused descriptor never matches
+    long long when;
+};
+
+// Hashed timer wheel for connection deadlines. Scheduling is O(1) and nothing is ever
+// cancelled: the loop checks what fires against the connection and drops stale entries.
+// Entries further out than one turn stay in their slot until their turn comes round.
+class TimerWheel {
+private:
+    vector<timer_entry> slots[TIMER_SLOTS];
+    long long current;      // next tick to expire
+    size_t count;
+public:
+    // Constructor
+    TimerWheel();
+
+    void Schedule(int fd, unsigned serial, long long when);
+
+    // Appends every entry due by now
+    void Expire(long long now, vector<timer_entry>& due);
+
+    // Wait for a poll loop, no longer than one tick while anything is scheduled
+    int NextTimeout(int fallback) { return count > 0 && fallback > TIMER_TICK ? TIMER_TICK : fallback; }
+    size_t size() { return count; }
+};
+
+#endif
+
+// End of header
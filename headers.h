@@ -0,0 +1,97 @@
+#pragma once
+#ifndef HEADERS_H
+#define HEADERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <strings.h>
+
+#define HEADER_SLOTS     64     // perfect hash table size, a power of two
+#define HEADER_OVERFLOW  16     // unknown headers kept per request, later ones are only in the copy
+
+// Headers the server looks at or that show up in most requests. Each has a fixed slot in
+// HttpRequest, found by a perfect hash on length, first and last character.
+enum header_id_t {
+    HEADER_UNKNOWN = -1,
+    HEADER_HOST, HEADER_CONNECTION, HEADER_CONTENT_LENGTH, HEADER_CONTENT_TYPE, HEADER_TRANSFER_ENCODING,
+    HEADER_ACCEPT, HEADER_ACCEPT_ENCODING, HEADER_ACCEPT_LANGUAGE, HEADER_IF_NONE_MATCH, HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE, HEADER_IF_RANGE, HEADER_UPGRADE, HEADER_HTTP2_SETTINGS, HEADER_USER_AGENT,
+    HEADER_COOKIE, HEADER_AUTHORIZATION, HEADER_REFERER, HEADER_CACHE_CONTROL, HEADER_EXPECT,
+    HEADER_KEEP_ALIVE, HEADER_TE, HEADER_X_FORWARDED_FOR, HEADER_ORIGIN, HEADER_PRAGMA,
+    KNOWN_HEADERS,
+};
+
+// Lowercase, in header_id_t order
+constexpr const char* known_headers[KNOWN_HEADERS] = {
+    "host", "connection", "content-length", "content-type", "transfer-encoding",
+    "accept", "accept-encoding", "accept-language", "if-none-match", "if-modified-since",
+    "range", "if-range", "upgrade", "http2-settings", "user-agent",
+    "cookie", "authorization", "referer", "cache-control", "expect",
+    "keep-alive", "te", "x-forwarded-for", "origin", "pragma",
+};
+
+constexpr unsigned char HeaderLower(char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+constexpr size_t HeaderLength(const char* name) {
+    size_t length = 0;
+    while (name[length] != '\0') {
+        length++;
+    }
+    return length;
+}
+
+// Collision free for the names above, checked at compile time below
+constexpr unsigned HeaderHash(const char* name, size_t length) {
+    return (length + 12 * HeaderLower(name[0]) + 29 * HeaderLower(name[length - 1])) & (HEADER_SLOTS - 1);
+}
+
+// Slot -> header id + 1, 0 for an empty slot
+struct header_table {
+    unsigned char slots[HEADER_SLOTS];
+    unsigned char lengths[KNOWN_HEADERS];
+    bool perfect;
+};
+
+constexpr header_table BuildHeaderTable() {
+    header_table table = {};
+    table.perfect = true;
+    for (int id = 0; id < KNOWN_HEADERS; id++) {
+        table.lengths[id] = HeaderLength(known_headers[id]);
+        unsigned slot = HeaderHash(known_headers[id], table.lengths[id]);
+        if (table.slots[slot] != 0) {
+            table.perfect = false;
+        }
+        table.slots[slot] = id + 1;
+    }
+    return table;
+}
+
+constexpr header_table header_slots = BuildHeaderTable();
+static_assert(header_slots.perfect, "known header names collide, change HeaderHash or HEADER_SLOTS");
+
+// Case-insensitive, HEADER_UNKNOWN for anything not in the table
+inline header_id_t LookupHeader(const char* name, size_t length) {
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+    int id = header_slots.slots[HeaderHash(name, length)] - 1;
+    if (id < 0 || header_slots.lengths[id] != length || strncasecmp(name, known_headers[id], length) != 0) {
+        return HEADER_UNKNOWN;
+    }
+    return (header_id_t) id;
+}
+
+// Where a header sits in the request copy. name == 0 marks an absent header, no header
+// can start at offset 0 where the request line is.
+struct header_span {
+    uint32_t name;
+    uint32_t namelength;
+    uint32_t value;
+    uint32_t valuelength;
+};
+
+#endif
+
+// End of header
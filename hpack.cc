@@ -0,0 +1,397 @@
+#include <cstring>
+#include "hpack.h"
+
+////////////////////////////////////////////////
+//              Static Tables                 //
+////////////////////////////////////////////////
+
+// RFC 7541 Appendix A, index 1 first
+static const hpack_field statictable[] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+    {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""},
+    {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""}, {"retry-after", ""},
+    {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+    {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""},
+};
+static const size_t staticcount = sizeof(statictable) / sizeof(statictable[0]);
+
+// RFC 7541 Appendix B, symbol 256 is EOS
+static const uint32_t huffmancodes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t huffmanlengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+////////////////////////////////////////////////
+//              Primitives                    //
+////////////////////////////////////////////////
+
+// Binary decoding tree over the Huffman codes, built once
+struct huffman_tree {
+    int16_t children[513][2];
+    int16_t symbols[513];
+    int count;
+
+    huffman_tree() {
+        memset(children, 0, sizeof(children));
+        memset(symbols, -1, sizeof(symbols));
+        count = 1;
+        for (int symbol = 0; symbol < 257; symbol++) {
+            int node = 0;
+            for (int bit = huffmanlengths[symbol] - 1; bit >= 0; bit--) {
+                int branch = (huffmancodes[symbol] >> bit) & 1;
+                if (children[node][branch] == 0) {
+                    children[node][branch] = count++;
+                }
+                node = children[node][branch];
+            }
+            symbols[node] = symbol;
+        }
+    }
+};
+
+static bool huffmanDecode(const uint8_t* data, size_t length, string& out) {
+    static const huffman_tree tree;
+    int node = 0;
+    int depth = 0;
+    bool ones = true;
+
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int branch = (data[i] >> bit) & 1;
+            node = tree.children[node][branch];
+            depth++;
+            ones = ones && branch == 1;
+            if (node == 0) {
+                return false;
+            }
+            if (tree.symbols[node] >= 0) {
+                // EOS inside a string is a decoding error
+                if (tree.symbols[node] == 256) {
+                    return false;
+                }
+                out += (char) tree.symbols[node];
+                node = 0;
+                depth = 0;
+                ones = true;
+            }
+        }
+    }
+
+    // Padding is the most significant bits of EOS, at most 7 bits
+    return depth < 8 && ones;
+}
+
+static void encodeInteger(uint64_t value, int prefix, uint8_t flags, string& out) {
+    uint64_t limit = (1 << prefix) - 1;
+    if (value < limit) {
+        out += (char) (flags | value);
+        return;
+    }
+    out += (char) (flags | limit);
+    value -= limit;
+    while (value >= 128) {
+        out += (char) ((value & 127) | 128);
+        value >>= 7;
+    }
+    out += (char) value;
+}
+
+static bool decodeInteger(const uint8_t*& data, const uint8_t* end, int prefix, uint64_t& value) {
+    uint64_t limit = (1 << prefix) - 1;
+    int shift = 0;
+
+    if (data >= end) {
+        return false;
+    }
+    value = *data++ & limit;
+    if (value < limit) {
+        return true;
+    }
+
+    // Continuation bytes, anything beyond 28 bits is rejected as hostile
+    while (data < end) {
+        uint8_t byte = *data++;
+        value += (uint64_t) (byte & 127) << shift;
+        shift += 7;
+        if (!(byte & 128)) {
+            return true;
+        }
+        if (shift > 28) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool decodeString(const uint8_t*& data, const uint8_t* end, string& out) {
+    uint64_t length;
+    bool huffman;
+
+    if (data >= end) {
+        return false;
+    }
+    huffman = (*data & 128) != 0;
+    if (!decodeInteger(data, end, 7, length) || length > (uint64_t) (end - data)) {
+        return false;
+    }
+    out = "";
+    if (huffman) {
+        if (!huffmanDecode(data, length, out)) {
+            return false;
+        }
+    } else {
+        out.assign((const char*) data, length);
+    }
+    data += length;
+    return true;
+}
+
+static void encodeString(const string& value, string& out) {
+    // Raw literals, Huffman is optional for encoders
+    encodeInteger(value.length(), 7, 0, out);
+    out += value;
+}
+
+////////////////////////////////////////////////
+//              HpackTable                    //
+////////////////////////////////////////////////
+HpackTable::HpackTable() {
+    size = 0;
+    maxsize = HPACK_TABLE_SIZE;
+}
+
+const hpack_field* HpackTable::Get(size_t index) const {
+    if (index == 0) {
+        return NULL;
+    } else if (index <= staticcount) {
+        return &statictable[index - 1];
+    } else if (index - staticcount - 1 < entries.size()) {
+        return &entries[index - staticcount - 1];
+    }
+    return NULL;
+}
+
+void HpackTable::Add(const string& name, const string& value) {
+    size_t entrysize = name.length() + value.length() + HPACK_ENTRY_EXTRA;
+
+    // Evict oldest first, an entry larger than the table just empties it
+    while (!entries.empty() && size + entrysize > maxsize) {
+        size -= entries.back().name.length() + entries.back().value.length() + HPACK_ENTRY_EXTRA;
+        entries.pop_back();
+    }
+    if (entrysize <= maxsize) {
+        hpack_field field;
+        field.name = name;
+        field.value = value;
+        entries.push_front(field);
+        size += entrysize;
+    }
+}
+
+void HpackTable::Resize(size_t maxsize) {
+    this->maxsize = maxsize;
+    while (!entries.empty() && size > maxsize) {
+        size -= entries.back().name.length() + entries.back().value.length() + HPACK_ENTRY_EXTRA;
+        entries.pop_back();
+    }
+}
+
+size_t HpackTable::Find(const string& name, const string& value, bool& exact) const {
+    size_t named = 0;
+
+    exact = false;
+    for (size_t i = 0; i < staticcount; i++) {
+        if (name.compare(statictable[i].name) == 0) {
+            if (value.compare(statictable[i].value) == 0) {
+                exact = true;
+                return i + 1;
+            }
+            if (named == 0) {
+                named = i + 1;
+            }
+        }
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (name.compare(entries[i].name) == 0) {
+            if (value.compare(entries[i].value) == 0) {
+                exact = true;
+                return staticcount + i + 1;
+            }
+            if (named == 0) {
+                named = staticcount + i + 1;
+            }
+        }
+    }
+    return named;
+}
+
+////////////////////////////////////////////////
+//              HpackDecoder                  //
+////////////////////////////////////////////////
+bool HpackDecoder::Decode(const uint8_t* data, size_t length, vector<hpack_field>& fields) {
+    const uint8_t* end = data + length;
+    size_t listsize = 0;
+    uint64_t index;
+
+    fields.clear();
+    while (data < end) {
+        uint8_t byte = *data;
+        hpack_field field;
+
+        if (byte & 128) {
+            // Indexed field
+            if (!decodeInteger(data, end, 7, index) || table.Get(index) == NULL) {
+                return false;
+            }
+            field = *table.Get(index);
+        } else if ((byte & 224) == 32) {
+            // Dynamic table size update, bounded by the size we advertise
+            if (!decodeInteger(data, end, 5, index) || index > HPACK_TABLE_SIZE) {
+                return false;
+            }
+            table.Resize(index);
+            continue;
+        } else {
+            // Literal with incremental indexing (6 bit prefix), without indexing or never indexed (4 bit prefix)
+            bool indexing = (byte & 192) == 64;
+            if (!decodeInteger(data, end, indexing ? 6 : 4, index)) {
+                return false;
+            }
+            if (index == 0) {
+                if (!decodeString(data, end, field.name)) {
+                    return false;
+                }
+            } else if (table.Get(index) != NULL) {
+                field.name = table.Get(index)->name;
+            } else {
+                return false;
+            }
+            if (!decodeString(data, end, field.value)) {
+                return false;
+            }
+            if (indexing) {
+                table.Add(field.name, field.value);
+            }
+        }
+
+        listsize += field.name.length() + field.value.length() + HPACK_ENTRY_EXTRA;
+        if (listsize > HPACK_LIST_LENGTH) {
+            return false;
+        }
+        fields.push_back(field);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////
+//              HpackEncoder                  //
+////////////////////////////////////////////////
+HpackEncoder::HpackEncoder() {
+    limit = HPACK_TABLE_SIZE;
+    resized = false;
+}
+
+void HpackEncoder::set_limit(size_t limit) {
+    if (limit > HPACK_TABLE_SIZE) {
+        limit = HPACK_TABLE_SIZE;
+    }
+    if (limit != this->limit) {
+        this->limit = limit;
+        resized = true;
+    }
+}
+
+void HpackEncoder::Encode(const vector<hpack_field>& fields, string& out) {
+    bool exact;
+
+    // A table size change is signalled at the start of the next block
+    if (resized) {
+        table.Resize(limit);
+        encodeInteger(limit, 5, 32, out);
+        resized = false;
+    }
+
+    for (size_t i = 0; i < fields.size(); i++) {
+        const hpack_field& field = fields[i];
+        size_t index = table.Find(field.name, field.value, exact);
+        if (exact) {
+            encodeInteger(index, 7, 128, out);
+            continue;
+        }
+
+        // Values that change per response would only churn the table
+        const string& name = field.name;
+        if (name.compare("content-length") == 0 || name.compare("date") == 0 || name.compare("etag") == 0 ||
+            name.compare("last-modified") == 0 || name.compare("location") == 0 || name.compare("set-cookie") == 0) {
+            encodeInteger(index, 4, 0, out);
+        } else {
+            encodeInteger(index, 6, 64, out);
+            table.Add(field.name, field.value);
+        }
+        if (index == 0) {
+            encodeString(field.name, out);
+        }
+        encodeString(field.value, out);
+    }
+}
+
+// End of file
@@ -0,0 +1,69 @@
+#pragma once
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define HPACK_TABLE_SIZE  4096
+#define HPACK_ENTRY_EXTRA 32
+#define HPACK_LIST_LENGTH 65536
+
+using std::deque;
+using std::string;
+using std::vector;
+
+struct hpack_field {
+    string name;
+    string value;
+};
+
+// Dynamic table of RFC 7541, newest entry first. Entry sizes count the
+// 32 bytes of overhead the RFC charges per entry.
+class HpackTable {
+private:
+    deque<hpack_field> entries;
+    size_t size;
+    size_t maxsize;
+public:
+    HpackTable();
+
+    // Indices continue after the 61 static entries
+    const hpack_field* Get(size_t index) const;
+    void Add(const string& name, const string& value);
+    void Resize(size_t maxsize);
+
+    // Returns the combined index of an exact match, or of a name match when exact is false
+    size_t Find(const string& name, const string& value, bool& exact) const;
+    size_t get_maxsize() const { return maxsize; }
+};
+
+class HpackDecoder {
+private:
+    HpackTable table;
+public:
+    // Decodes a complete header block, false on a compression error
+    bool Decode(const uint8_t* data, size_t length, vector<hpack_field>& fields);
+};
+
+class HpackEncoder {
+private:
+    HpackTable table;
+    size_t limit;
+    bool resized;
+public:
+    HpackEncoder();
+
+    // Follows the peer's SETTINGS_HEADER_TABLE_SIZE, capped at our own table size
+    void set_limit(size_t limit);
+
+    // Appends a header block. Volatile fields are sent without indexing so they don't evict useful entries.
+    void Encode(const vector<hpack_field>& fields, string& out);
+};
+
+#endif
+
+// End of header
@@ -3,12 +3,14 @@
 #define HTTP_H
 
 #include <iostream>
+#include <string_view>
 #include <vector>
+#include "headers.h"
+#include "router.h"
 
 #define CRLF      "\r\n"
 #define SPACE     " "
 #define DIRECTORY "test"
-#define PREVDIR   "/.."
 #define CSS       "text/css"
 #define HTML      "text/html"
 #define PLAINTEXT "text/plain"
@@ -23,6 +25,7 @@
 #define BUFFER_LENGTH  8191
 #define URI_MAX_LENGTH 4095
 #define PORT           8000
+#define TLS_PORT       8443
 #define SLEEP_MSEC     1000
 #define TIME_OUT       1.0
 
@@ -39,7 +42,8 @@ enum http_version_t {
 };
 
 enum http_status_t {
-    CONTINUE = 0, OK, BAD_REQUEST, NOT_FOUND, REQUEST_ENTITY_TOO_LARGE, REQUEST_URI_TOO_LARGE, NOT_IMPLEMENTED,
+    CONTINUE = 0, OK, MOVED_PERMANENTLY, NOT_MODIFIED, BAD_REQUEST, NOT_FOUND, REQUEST_ENTITY_TOO_LARGE, REQUEST_URI_TOO_LARGE, NOT_IMPLEMENTED, BAD_GATEWAY, GATEWAY_TIMEOUT,
+    TOO_MANY_REQUESTS, SERVICE_UNAVAILABLE, REQUEST_TIMEOUT, REQUEST_HEADER_FIELDS_TOO_LARGE, INTERNAL_SERVER_ERROR,
 };
 
 const string versions[] = {
@@ -47,32 +51,54 @@ const string versions[] = {
 };
 
 const string statuses[] = {
-    "100 Continue", "200 OK", "400 Bad Request", "404 Not Found", "413 Request Entity Too Large", "414 Request URI Too Large", "501 Not Implemented",
+    "100 Continue", "200 OK", "301 Moved Permanently", "304 Not Modified", "400 Bad Request", "404 Not Found", "413 Request Entity Too Large", "414 Request URI Too Large", "501 Not Implemented", "502 Bad Gateway", "504 Gateway Timeout",
+    "429 Too Many Requests", "503 Service Unavailable", "408 Request Timeout", "431 Request Header Fields Too Large",
+    "500 Internal Server Error",
 };
 
-class Header {
-public:
-    // Request headers, e.g. name="Content-Length", value="10"
-    string name;
-    string value;
-    
-    // Constructor 
-    Header(string name, string value) {
-        this->name = name;
-        this->value = value;
+// Maps a file extension to its MIME type, shared by the server and mkpack
+inline string MimeType(const string& extension) {
+    if (extension.compare("txt") == 0) {
+        return "text/plain";
+    } else if (extension.compare("html") == 0) {
+        return "text/html";
+    } else if (extension.compare("js") == 0) {
+        return "application/js";
+    } else if (extension.compare("php") == 0) {
+        return "application/php";
+    } else if (extension.compare("css") == 0) {
+        return "text/css";
+    } else if (extension.compare("png") == 0) {
+        return "image/png";
+    } else if (extension.compare("jpg") == 0) {
+        return "image/jpeg";
+    } else if (extension.compare("gif") == 0) {
+        return "image/gif";
+    } else {
+        return "unknown";
     }
-};
+}
 
 class HttpRequest {
 private:
-    vector<const Header*> headers;
+    // Offsets into copy, so copies of a request (handlers take them by value) stay valid
+    header_span known[KNOWN_HEADERS];
+    header_span overflow[HEADER_OVERFLOW];
+    int overflowcount;
     http_method_t method;
     http_version_t version;
     string copy;
+    string uri;
     string path;
     string query;
     string type;
+    const route* matched;
     bool toolong;
+    bool malformed;
+
+    // Client descriptor the request came in on, -1 when unknown. Tracing only, it survives
+    // Initialize so every request of a connection carries it.
+    int connection;
 public:
     HttpRequest(http_method_t method, http_version_t version, string copy, string path, string query, string type);
     HttpRequest();
@@ -86,28 +112,39 @@ public:
     // Initialization and reset method
     void Initialize(http_method_t method, http_version_t version, string copy, string path, string query, string type);
     void Reset();
+    void ClearHeaders();
 
-    // Header parsing 
-    void ParseHeaders(const char* buffer, int index);
+    // Header lines of the copy from index on, known headers into their slots. Lookups are
+    // case-insensitive, "" when absent, and views into the copy: nothing is allocated.
+    void ParseHeaders(int index);
+    std::string_view GetHeader(header_id_t id);
+    std::string_view GetHeader(const char* name);
 
     // Getters
-    vector<const Header*> get_headers() { return headers; }
     http_method_t get_method() { return method; }
     http_version_t get_version() { return version; }
     string get_copy() { return copy; }
+    string get_uri() { return uri; }
     string get_path() { return path; }
     string get_query() { return query; }
     string get_content_type() { return type; }
+    const route* get_route() { return matched; }
     bool get_flag() { return toolong; }
+    bool get_malformed() { return malformed; }
+    int get_connection() { return connection; }
 
     // Setters
     void set_method(http_method_t method) { this->method = method; }
     void set_version(http_version_t version) { this->version = version; }
-    void set_copy(string copy) { this->copy = copy; }
+    void set_copy(string copy) { this->copy = copy; ClearHeaders(); }
     void set_content_type(string type) { this->type = type; }
+    void set_uri(string uri) { this->uri = uri; }
     void set_path(string path) { this->path = path; }
     void set_query(string query) { this->query = query; }
+    void set_route(const route* matched) { this->matched = matched; }
     void set_flag(bool value) { toolong = value; }
+    void set_malformed(bool value) { malformed = value; }
+    void set_connection(int connection) { this->connection = connection; }
 };
 
 #endif
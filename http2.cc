@@ -0,0 +1,601 @@
+#include <cctype>
+#include <cstring>
+#include <utility>
+#include "http2.h"
+
+using std::make_pair;
+
+////////////////////////////////////////////////
+//              Helpers                       //
+////////////////////////////////////////////////
+static uint32_t readUint32(const uint8_t* data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+}
+
+// tchar of RFC 9110, without uppercase letters when lower is set
+static bool isToken(const string& text, size_t start, bool lower) {
+    if (start >= text.length()) {
+        return false;
+    }
+    for (size_t i = start; i < text.length(); i++) {
+        unsigned char c = text[i];
+        if (c == '\0' || (lower && isupper(c)) || (!isalnum(c) && strchr("!#$%&'*+-.^_`|~", c) == NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Field names and values that can be pasted into an HTTP/1 request, RFC 9113 section 8.2.1
+static bool isValidField(const hpack_field& field) {
+    if (!isToken(field.name, field.name[0] == ':' ? 1 : 0, true)) {
+        return false;
+    }
+    if (field.value.find_first_of(string("\r\n\0", 3)) != string::npos) {
+        return false;
+    }
+    if (field.name.compare(":method") == 0) {
+        return isToken(field.value, 0, false);
+    }
+    if (field.name.compare(":path") == 0) {
+        return field.value[0] == '/' && field.value.find(' ') == string::npos;
+    }
+    return true;
+}
+
+// HTTP2-Settings carries a SETTINGS payload in base64url without padding
+static bool base64UrlDecode(const string& text, string& out) {
+    unsigned value = 0;
+    int bits = 0;
+
+    out = "";
+    for (size_t i = 0; i < text.length(); i++) {
+        char c = text[i];
+        int digit;
+        if (c >= 'A' && c <= 'Z') {
+            digit = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            digit = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            digit = c - '0' + 52;
+        } else if (c == '-') {
+            digit = 62;
+        } else if (c == '_') {
+            digit = 63;
+        } else if (c == '=') {
+            break;
+        } else {
+            return false;
+        }
+        value = (value << 6) | digit;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += (char) ((value >> bits) & 255);
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////
+//              Http2Session                  //
+////////////////////////////////////////////////
+Http2Session::Http2Session() {
+    uint8_t settings[6];
+
+    continuation = 0;
+    blockendstream = false;
+    preface = false;
+    settled = false;
+    failed = false;
+    peergoaway = false;
+    lastid = 0;
+    window = HTTP2_WINDOW_SIZE;
+    initialwindow = HTTP2_WINDOW_SIZE;
+    maxframe = HTTP2_FRAME_SIZE;
+
+    // Server preface: our SETTINGS, only the stream limit differs from the defaults
+    settings[0] = 0;
+    settings[1] = MAX_CONCURRENT_STREAMS;
+    settings[2] = 0;
+    settings[3] = 0;
+    settings[4] = 0;
+    settings[5] = HTTP2_MAX_STREAMS;
+    WriteFrame(SETTINGS_FRAME, 0, 0, (const char*) settings, sizeof(settings));
+}
+
+bool Http2Session::Upgrade(const string& settings) {
+    string payload;
+    http2_stream stream;
+
+    // The header stands in for the client's first SETTINGS frame, which needs no ACK
+    if (!base64UrlDecode(settings, payload) || payload.length() % 6 != 0 ||
+        !ApplySettings((const uint8_t*) payload.data(), payload.length())) {
+        return false;
+    }
+    stream.remoteclosed = true;
+    stream.responded = false;
+    stream.window = initialwindow;
+    stream.mapped = NULL;
+    stream.length = 0;
+    stream.offset = 0;
+    streams[1] = stream;
+    lastid = 1;
+    return true;
+}
+
+void Http2Session::WriteFrame(uint8_t type, uint8_t flags, uint32_t stream, const char* payload, size_t length) {
+    char header[HTTP2_FRAME_HEADER];
+    header[0] = (length >> 16) & 255;
+    header[1] = (length >> 8) & 255;
+    header[2] = length & 255;
+    header[3] = type;
+    header[4] = flags;
+    header[5] = (stream >> 24) & 127;
+    header[6] = (stream >> 16) & 255;
+    header[7] = (stream >> 8) & 255;
+    header[8] = stream & 255;
+    output.append(header, sizeof(header));
+    output.append(payload, length);
+}
+
+void Http2Session::WriteWindowUpdate(uint32_t stream, uint32_t increment) {
+    char payload[4];
+    payload[0] = (increment >> 24) & 127;
+    payload[1] = (increment >> 16) & 255;
+    payload[2] = (increment >> 8) & 255;
+    payload[3] = increment & 255;
+    WriteFrame(WINDOW_UPDATE_FRAME, 0, stream, payload, sizeof(payload));
+}
+
+bool Http2Session::Fail(http2_error_t error) {
+    char payload[8];
+
+    // Connection error: GOAWAY with the last stream we processed, then stop reading
+    if (!failed) {
+        payload[0] = (lastid >> 24) & 127;
+        payload[1] = (lastid >> 16) & 255;
+        payload[2] = (lastid >> 8) & 255;
+        payload[3] = lastid & 255;
+        payload[4] = 0;
+        payload[5] = 0;
+        payload[6] = 0;
+        payload[7] = error;
+        WriteFrame(GOAWAY_FRAME, 0, 0, payload, sizeof(payload));
+        failed = true;
+    }
+    return false;
+}
+
+void Http2Session::Reset(uint32_t stream, http2_error_t error) {
+    char payload[4] = {0, 0, 0, (char) error};
+    WriteFrame(RST_STREAM_FRAME, 0, stream, payload, sizeof(payload));
+    streams.erase(stream);
+}
+
+bool Http2Session::Consume(string& inbuf) {
+    size_t position = 0;
+
+    if (failed) {
+        inbuf.clear();
+        return false;
+    }
+
+    // Client connection preface
+    if (!preface) {
+        if (inbuf.length() < HTTP2_PREFACE_LENGTH) {
+            return true;
+        }
+        if (inbuf.compare(0, HTTP2_PREFACE_LENGTH, HTTP2_PREFACE) != 0) {
+            inbuf.clear();
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        preface = true;
+        position = HTTP2_PREFACE_LENGTH;
+    }
+
+    // Every complete frame, a partial one waits for more input
+    while (inbuf.length() - position >= HTTP2_FRAME_HEADER) {
+        const uint8_t* frame = (const uint8_t*) inbuf.data() + position;
+        size_t length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+        uint32_t stream = readUint32(frame + 5) & HTTP2_MAX_WINDOW;
+        if (length > HTTP2_FRAME_SIZE) {
+            inbuf.clear();
+            return Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (inbuf.length() - position < HTTP2_FRAME_HEADER + length) {
+            break;
+        }
+        if (!HandleFrame(frame[3], frame[4], stream, frame + HTTP2_FRAME_HEADER, length)) {
+            inbuf.clear();
+            return false;
+        }
+        position += HTTP2_FRAME_HEADER + length;
+    }
+    inbuf.erase(0, position);
+    return true;
+}
+
+bool Http2Session::HandleFrame(uint8_t type, uint8_t flags, uint32_t stream, const uint8_t* payload, size_t length) {
+    // The first frame is SETTINGS, and a header block may not be interleaved with anything
+    if (!settled && type != SETTINGS_FRAME) {
+        return Fail(HTTP2_PROTOCOL_ERROR);
+    }
+    if (continuation != 0 && (type != CONTINUATION_FRAME || stream != continuation)) {
+        return Fail(HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (type == DATA_FRAME) {
+        if (stream == 0) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        if ((flags & HTTP2_FLAG_PADDED) && (length == 0 || payload[0] >= length)) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+
+        // Request bodies are discarded, so the whole frame is credited back at once
+        if (length > 0) {
+            WriteWindowUpdate(0, length);
+        }
+        auto found = streams.find(stream);
+        if (found == streams.end() || found->second.remoteclosed) {
+            if (stream > lastid) {
+                return Fail(HTTP2_PROTOCOL_ERROR);
+            }
+            Reset(stream, HTTP2_STREAM_CLOSED);
+            return true;
+        }
+        if (flags & HTTP2_FLAG_END_STREAM) {
+            found->second.remoteclosed = true;
+            requests.push_back(make_pair(stream, found->second.headers));
+        } else if (length > 0) {
+            WriteWindowUpdate(stream, length);
+        }
+    } else if (type == HEADERS_FRAME) {
+        return HandleHeaders(flags, stream, payload, length);
+    } else if (type == CONTINUATION_FRAME) {
+        if (continuation == 0) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        headerblock.append((const char*) payload, length);
+        if (headerblock.length() > HPACK_LIST_LENGTH) {
+            return Fail(HTTP2_ENHANCE_YOUR_CALM);
+        }
+        if (flags & HTTP2_FLAG_END_HEADERS) {
+            continuation = 0;
+            return EndHeaders(stream);
+        }
+    } else if (type == PRIORITY_FRAME) {
+        // Accepted but not acted on, responses go out in stream order
+        if (stream == 0) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        if (length != 5) {
+            Reset(stream, HTTP2_FRAME_SIZE_ERROR);
+        }
+    } else if (type == RST_STREAM_FRAME) {
+        if (length != 4) {
+            return Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (stream == 0 || stream > lastid) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        streams.erase(stream);
+    } else if (type == SETTINGS_FRAME) {
+        if (stream != 0) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        if (flags & HTTP2_FLAG_ACK) {
+            return length == 0 ? true : Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (length % 6 != 0) {
+            return Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (!ApplySettings(payload, length)) {
+            return false;
+        }
+        WriteFrame(SETTINGS_FRAME, HTTP2_FLAG_ACK, 0, "", 0);
+        settled = true;
+    } else if (type == PUSH_PROMISE_FRAME) {
+        // Clients never push
+        return Fail(HTTP2_PROTOCOL_ERROR);
+    } else if (type == PING_FRAME) {
+        if (length != 8) {
+            return Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (stream != 0) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        if (!(flags & HTTP2_FLAG_ACK)) {
+            WriteFrame(PING_FRAME, HTTP2_FLAG_ACK, 0, (const char*) payload, length);
+        }
+    } else if (type == GOAWAY_FRAME) {
+        if (stream != 0) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        if (length < 8) {
+            return Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        peergoaway = true;
+    } else if (type == WINDOW_UPDATE_FRAME) {
+        if (length != 4) {
+            return Fail(HTTP2_FRAME_SIZE_ERROR);
+        }
+        uint32_t increment = readUint32(payload) & HTTP2_MAX_WINDOW;
+        if (stream == 0) {
+            if (increment == 0) {
+                return Fail(HTTP2_PROTOCOL_ERROR);
+            }
+            window += increment;
+            if (window > HTTP2_MAX_WINDOW) {
+                return Fail(HTTP2_FLOW_CONTROL_ERROR);
+            }
+            return true;
+        }
+        auto found = streams.find(stream);
+        if (found == streams.end()) {
+            // Updates may race with a stream we already finished
+            return stream > lastid ? Fail(HTTP2_PROTOCOL_ERROR) : true;
+        }
+        if (increment == 0) {
+            Reset(stream, HTTP2_PROTOCOL_ERROR);
+            return true;
+        }
+        found->second.window += increment;
+        if (found->second.window > HTTP2_MAX_WINDOW) {
+            Reset(stream, HTTP2_FLOW_CONTROL_ERROR);
+        }
+    }
+
+    // Unknown frame types are ignored
+    return true;
+}
+
+bool Http2Session::HandleHeaders(uint8_t flags, uint32_t stream, const uint8_t* payload, size_t length) {
+    size_t start = 0;
+    size_t padding = 0;
+
+    // Client streams are odd and only ever increase
+    if (stream == 0 || stream % 2 == 0) {
+        return Fail(HTTP2_PROTOCOL_ERROR);
+    }
+    if (stream <= lastid) {
+        auto found = streams.find(stream);
+        if (found == streams.end() || found->second.remoteclosed) {
+            return Fail(HTTP2_STREAM_CLOSED);
+        }
+    } else {
+        lastid = stream;
+    }
+
+    // Strip padding and the priority fields
+    if (flags & HTTP2_FLAG_PADDED) {
+        if (length < 1) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        }
+        padding = payload[0];
+        start = 1;
+    }
+    if (flags & HTTP2_FLAG_PRIORITY) {
+        start += 5;
+    }
+    if (start + padding > length) {
+        return Fail(HTTP2_PROTOCOL_ERROR);
+    }
+
+    headerblock.assign((const char*) payload + start, length - start - padding);
+    blockendstream = (flags & HTTP2_FLAG_END_STREAM) != 0;
+    if (!(flags & HTTP2_FLAG_END_HEADERS)) {
+        continuation = stream;
+        return true;
+    }
+    return EndHeaders(stream);
+}
+
+bool Http2Session::EndHeaders(uint32_t stream) {
+    vector<hpack_field> fields;
+    bool method = false;
+    bool path = false;
+
+    // Always decode, the HPACK state is shared by every stream even when the stream is refused
+    if (!decoder.Decode((const uint8_t*) headerblock.data(), headerblock.length(), fields)) {
+        return Fail(HTTP2_COMPRESSION_ERROR);
+    }
+    headerblock = "";
+
+    // Names are lowercase tokens, values hold no line breaks, the request line parts no spaces
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (!isValidField(fields[i])) {
+            Reset(stream, HTTP2_PROTOCOL_ERROR);
+            return true;
+        }
+    }
+
+    // Trailers end an open stream, they add nothing the handlers use
+    auto found = streams.find(stream);
+    if (found != streams.end()) {
+        if (!blockendstream) {
+            Reset(stream, HTTP2_PROTOCOL_ERROR);
+            return true;
+        }
+        found->second.remoteclosed = true;
+        requests.push_back(make_pair(stream, found->second.headers));
+        return true;
+    }
+
+    // Requests need :method and :path
+    for (size_t i = 0; i < fields.size(); i++) {
+        const string& name = fields[i].name;
+        method = method || name.compare(":method") == 0;
+        path = path || name.compare(":path") == 0;
+    }
+    if (!method || !path) {
+        Reset(stream, HTTP2_PROTOCOL_ERROR);
+        return true;
+    }
+    if (streams.size() >= HTTP2_MAX_STREAMS || peergoaway) {
+        Reset(stream, HTTP2_REFUSED_STREAM);
+        return true;
+    }
+
+    http2_stream& created = streams[stream];
+    created.headers = fields;
+    created.remoteclosed = blockendstream;
+    created.responded = false;
+    created.window = initialwindow;
+    created.mapped = NULL;
+    created.length = 0;
+    created.offset = 0;
+    if (blockendstream) {
+        requests.push_back(make_pair(stream, fields));
+    }
+    return true;
+}
+
+bool Http2Session::ApplySettings(const uint8_t* payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        uint16_t id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = readUint32(payload + i + 2);
+        if (id == HEADER_TABLE_SIZE) {
+            encoder.set_limit(value);
+        } else if (id == ENABLE_PUSH && value > 1) {
+            return Fail(HTTP2_PROTOCOL_ERROR);
+        } else if (id == INITIAL_WINDOW_SIZE) {
+            // Applies retroactively to every open stream
+            if (value > HTTP2_MAX_WINDOW) {
+                return Fail(HTTP2_FLOW_CONTROL_ERROR);
+            }
+            int64_t delta = (int64_t) value - initialwindow;
+            for (auto item = streams.begin(); item != streams.end(); item++) {
+                item->second.window += delta;
+                if (item->second.window > HTTP2_MAX_WINDOW) {
+                    return Fail(HTTP2_FLOW_CONTROL_ERROR);
+                }
+            }
+            initialwindow = value;
+        } else if (id == MAX_FRAME_SIZE) {
+            if (value < HTTP2_FRAME_SIZE || value > HTTP2_MAX_FRAME_SIZE) {
+                return Fail(HTTP2_PROTOCOL_ERROR);
+            }
+            maxframe = value;
+        }
+    }
+    return true;
+}
+
+bool Http2Session::NextRequest(uint32_t& stream, vector<hpack_field>& headers) {
+    if (requests.empty()) {
+        return false;
+    }
+    stream = requests.front().first;
+    headers.swap(requests.front().second);
+    requests.pop_front();
+    return true;
+}
+
+void Http2Session::Respond(uint32_t stream, const string& head, const string& body, const char* mapped, size_t length) {
+    vector<hpack_field> fields;
+    hpack_field field;
+    string block = "";
+    size_t start = head.find('\n') + 1;
+    size_t end;
+
+    // The stream may have been reset while the response was produced
+    auto found = streams.find(stream);
+    if (found == streams.end() || failed) {
+        return;
+    }
+
+    // Status code from "HTTP/1.1 200 OK"
+    field.name = ":status";
+    field.value = head.substr(head.find(' ') + 1, 3);
+    fields.push_back(field);
+
+    // Header lines, lowercased, without connection-specific fields
+    while ((end = head.find('\n', start)) != string::npos) {
+        size_t colon = head.find(':', start);
+        if (colon != string::npos && colon < end) {
+            field.name = head.substr(start, colon - start);
+            for (size_t i = 0; i < field.name.length(); i++) {
+                field.name[i] = tolower(field.name[i]);
+            }
+            size_t value = head.find_first_not_of(' ', colon + 1);
+            size_t last = end;
+            while (last > value && (head[last - 1] == '\r' || head[last - 1] == ' ')) {
+                last--;
+            }
+            field.value = head.substr(value, last - value);
+            if (field.name.compare("connection") != 0 && field.name.compare("keep-alive") != 0 &&
+                field.name.compare("proxy-connection") != 0 && field.name.compare("transfer-encoding") != 0 &&
+                field.name.compare("upgrade") != 0) {
+                fields.push_back(field);
+            }
+        }
+        start = end + 1;
+    }
+    encoder.Encode(fields, block);
+
+    // HEADERS, then CONTINUATION for blocks beyond the peer's frame size
+    http2_stream& current = found->second;
+    current.body = body;
+    current.mapped = mapped;
+    current.length = mapped != NULL ? length : body.length();
+    current.offset = 0;
+    current.responded = true;
+    for (size_t offset = 0; offset < block.length() || offset == 0; offset += maxframe) {
+        size_t chunk = block.length() - offset < maxframe ? block.length() - offset : maxframe;
+        uint8_t flags = offset + chunk == block.length() ? HTTP2_FLAG_END_HEADERS : 0;
+        if (offset == 0 && current.length == 0) {
+            flags |= HTTP2_FLAG_END_STREAM;
+        }
+        WriteFrame(offset == 0 ? HEADERS_FRAME : CONTINUATION_FRAME, flags, stream, block.data() + offset, chunk);
+    }
+    if (current.length == 0) {
+        streams.erase(found);
+    }
+}
+
+void Http2Session::Pump() {
+    bool progress = true;
+
+    // Round robin, one DATA frame per stream per pass, until the windows or the output limit stop us
+    while (progress && window > 0 && output.length() < HTTP2_OUTPUT_LENGTH) {
+        progress = false;
+        for (auto item = streams.begin(); item != streams.end() && window > 0;) {
+            http2_stream& stream = item->second;
+            if (!stream.responded || stream.window <= 0) {
+                item++;
+                continue;
+            }
+            size_t chunk = stream.length - stream.offset;
+            if (chunk > maxframe) {
+                chunk = maxframe;
+            }
+            if ((int64_t) chunk > stream.window) {
+                chunk = stream.window;
+            }
+            if ((int64_t) chunk > window) {
+                chunk = window;
+            }
+            const char* data = (stream.mapped != NULL ? stream.mapped : stream.body.data()) + stream.offset;
+            bool last = stream.offset + chunk == stream.length;
+            WriteFrame(DATA_FRAME, last ? HTTP2_FLAG_END_STREAM : 0, item->first, data, chunk);
+            stream.offset += chunk;
+            stream.window -= chunk;
+            window -= chunk;
+            progress = true;
+            if (last) {
+                item = streams.erase(item);
+            } else {
+                item++;
+            }
+        }
+    }
+}
+
+bool Http2Session::is_finished() const {
+    // After a connection error, or once the peer went away and every stream is done
+    return output.empty() && (failed || (peergoaway && streams.empty()));
+}
+
+// End of file
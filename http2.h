@@ -0,0 +1,119 @@
+#pragma once
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "hpack.h"
+
+#define HTTP2_PREFACE        "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH 24
+#define HTTP2_FRAME_HEADER   9
+#define HTTP2_FRAME_SIZE     16384
+#define HTTP2_MAX_FRAME_SIZE 16777215
+#define HTTP2_WINDOW_SIZE    65535
+#define HTTP2_MAX_WINDOW     2147483647
+#define HTTP2_MAX_STREAMS    128
+#define HTTP2_OUTPUT_LENGTH  262144
+
+// Frame flags, END_STREAM and ACK share a bit on different frame types
+#define HTTP2_FLAG_END_STREAM  0x1
+#define HTTP2_FLAG_ACK         0x1
+#define HTTP2_FLAG_END_HEADERS 0x4
+#define HTTP2_FLAG_PADDED      0x8
+#define HTTP2_FLAG_PRIORITY    0x20
+
+using std::deque;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+enum http2_frame_t {
+    DATA_FRAME = 0, HEADERS_FRAME, PRIORITY_FRAME, RST_STREAM_FRAME, SETTINGS_FRAME, PUSH_PROMISE_FRAME, PING_FRAME,
+    GOAWAY_FRAME, WINDOW_UPDATE_FRAME, CONTINUATION_FRAME,
+};
+
+enum http2_setting_t {
+    HEADER_TABLE_SIZE = 1, ENABLE_PUSH, MAX_CONCURRENT_STREAMS, INITIAL_WINDOW_SIZE, MAX_FRAME_SIZE, MAX_HEADER_LIST_SIZE,
+};
+
+enum http2_error_t {
+    HTTP2_NO_ERROR = 0, HTTP2_PROTOCOL_ERROR, HTTP2_INTERNAL_ERROR, HTTP2_FLOW_CONTROL_ERROR, HTTP2_SETTINGS_TIMEOUT,
+    HTTP2_STREAM_CLOSED, HTTP2_FRAME_SIZE_ERROR, HTTP2_REFUSED_STREAM, HTTP2_CANCEL, HTTP2_COMPRESSION_ERROR,
+    HTTP2_CONNECT_ERROR, HTTP2_ENHANCE_YOUR_CALM,
+};
+
+struct http2_stream {
+    vector<hpack_field> headers;
+    bool remoteclosed;
+    bool responded;
+    int64_t window;
+
+    // Response body still to be sent, owned or borrowed from the asset pack
+    string body;
+    const char* mapped;
+    size_t length;
+    size_t offset;
+};
+
+// One HTTP/2 connection without any I/O: bytes go in through Consume, complete
+// requests come out of NextRequest, and frames to send collect in the output.
+class Http2Session {
+private:
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    map<uint32_t, http2_stream> streams;
+    deque<pair<uint32_t, vector<hpack_field> > > requests;
+    string output;
+
+    // Header block being reassembled from HEADERS and CONTINUATION frames
+    string headerblock;
+    uint32_t continuation;
+    bool blockendstream;
+
+    // Connection state
+    bool preface;
+    bool settled;
+    bool failed;
+    bool peergoaway;
+    uint32_t lastid;
+    int64_t window;
+    int64_t initialwindow;
+    uint32_t maxframe;
+
+    void WriteFrame(uint8_t type, uint8_t flags, uint32_t stream, const char* payload, size_t length);
+    void WriteWindowUpdate(uint32_t stream, uint32_t increment);
+    bool Fail(http2_error_t error);
+    void Reset(uint32_t stream, http2_error_t error);
+    bool HandleFrame(uint8_t type, uint8_t flags, uint32_t stream, const uint8_t* payload, size_t length);
+    bool HandleHeaders(uint8_t flags, uint32_t stream, const uint8_t* payload, size_t length);
+    bool ApplySettings(const uint8_t* payload, size_t length);
+    bool EndHeaders(uint32_t stream);
+public:
+    // Constructor queues the server preface
+    Http2Session();
+
+    // After a 101 for Upgrade: h2c, stream 1 carries the upgraded request
+    bool Upgrade(const string& settings);
+
+    // Parses every complete frame, false after a connection error (a GOAWAY is queued)
+    bool Consume(string& inbuf);
+    bool NextRequest(uint32_t& stream, vector<hpack_field>& headers);
+
+    // Sends the status and headers of an HTTP/1 style response head, then the body
+    void Respond(uint32_t stream, const string& head, const string& body, const char* mapped, size_t length);
+
+    // Produces DATA frames as far as flow control and the output limit allow
+    void Pump();
+
+    string& get_output() { return output; }
+    bool is_finished() const;
+};
+
+#endif
+
+// End of header
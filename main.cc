@@ -1,3 +1,4 @@
+#include <cstring>
 #include <iostream>
 #include "server.h"
 #include "http.h"
@@ -9,6 +10,15 @@ int main(int argc, char* argv[]) {
     // Config stuff will go here
     server_type type = MPROCESS;
     bool verbose = true;
+    const char* packfile = NULL;
+    const char* capturefile = NULL;
+    const char* certificate = NULL;
+    const char* key = NULL;
+    int tlsport = TLS_PORT;
+    const char* cpus = NULL;
+    bool numa = false;
+    bool steer = false;
+    ServerConfig config;
     if (argc > 1) {
         for (int i = 1; i < argc; i++) {
             if (strcmp(argv[i], "--mprocess") == 0) {
@@ -17,18 +27,49 @@ int main(int argc, char* argv[]) {
                 type = MTHREADED;
             } else if (strcmp(argv[i], "--evented") == 0) {
                 type = EVENTED;
+            } else if (strcmp(argv[i], "--io-uring") == 0) {
+                type = IO_URING;
             } else if (strcmp(argv[i], "--silent") == 0 || strcmp(argv[i], "-s") == 0) {
                 verbose = false;
+            } else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+                if (!config.Load(argv[++i])) {
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+                packfile = argv[++i];
+            } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+                capturefile = argv[++i];
+            } else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) {
+                certificate = argv[++i];
+            } else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc) {
+                key = argv[++i];
+            } else if (strcmp(argv[i], "--tls-port") == 0 && i + 1 < argc) {
+                tlsport = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+                cpus = argv[++i];
+            } else if (strcmp(argv[i], "--numa") == 0) {
+                numa = true;
+            } else if (strcmp(argv[i], "--steer") == 0) {
+                steer = true;
             } else if (strcmp(argv[i], "--help") == 0) {
                 cout << "Usage: http [flags]\n";
                 cout << "By default, http runs in multiprocessed mode.\n";
                 cout << "   flags:\n";
                 cout << "           --mprocess: server runs in multiprocessed mode\n";
                 cout << "           --mthreaded: server runs in multithreaded mode\n";
-                cout << "           --evented: server runs in evented mode\n";
-                cout << "           --config /path/to/options.conf: specifies the path to the configuration file you want to read.\n";
-                cout << "                                           the default path is $PWD/test/http.conf.\n";
+                cout << "           --evented: server runs in evented mode, also serving h2c\n";
+                cout << "           --io-uring: server runs in evented mode on io_uring, falling back to epoll, also serving h2c\n";
+                cout << "           --config /path/to/http.conf: specifies the path to the configuration file you want to read.\n";
+                cout << "                                        without one, everything is served from test.\n";
                 cout << "           --www /path/to/localhost: specifies the path to the localhost folder. the default path is test/home.\n";
+                cout << "           --pack /path/to/site.pack: serves static files from a pack built with mkpack.\n";
+                cout << "           --capture /path/to/traffic.cap: records what clients send, for bench/replay.\n";
+                cout << "                                           captures hold credentials and cookies as sent, the file is created 0600.\n";
+                cout << "           --tls-cert /path/to/cert.pem --tls-key /path/to/key.pem: also serves HTTPS (h2 via ALPN) in evented mode.\n";
+                cout << "           --tls-port port: port of the HTTPS listener, 8443 by default.\n";
+                cout << "           --cpus 0-3,8: pins workers to these CPUs, one worker process per CPU in evented modes.\n";
+                cout << "           --numa: with --cpus, pinned workers prefer memory from their CPU's NUMA node.\n";
+                cout << "           --steer: with --cpus, connections go to the worker on the CPU that received them.\n";
                 cout << "           -s/--silent: silences any HTTP requests and responses, which are usually written to stdout.\n";
                 exit(EXIT_SUCCESS);
             } else {
@@ -37,6 +78,33 @@ int main(int argc, char* argv[]) {
         }
     }
     HttpServer server;
+    if (!server.Configure(config)) {
+        exit(EXIT_FAILURE);
+    }
+    if (packfile != NULL && !server.LoadPack(packfile)) {
+        exit(EXIT_FAILURE);
+    }
+    if (capturefile != NULL && !server.EnableCapture(capturefile)) {
+        exit(EXIT_FAILURE);
+    }
+    if ((certificate == NULL) != (key == NULL)) {
+        cout << "--tls-cert and --tls-key go together\n";
+        exit(EXIT_FAILURE);
+    }
+    if (certificate != NULL && type != EVENTED && type != IO_URING) {
+        cout << "TLS needs --evented or --io-uring, the blocking modes don't handshake\n";
+        exit(EXIT_FAILURE);
+    }
+    if (certificate != NULL && !server.EnableTls(certificate, key, tlsport)) {
+        exit(EXIT_FAILURE);
+    }
+    if ((numa || steer) && cpus == NULL) {
+        cout << "--numa and --steer need --cpus\n";
+        exit(EXIT_FAILURE);
+    }
+    if (cpus != NULL && !server.SetPlacement(cpus, numa, steer)) {
+        exit(EXIT_FAILURE);
+    }
     server.Run(type, verbose);
     return 0;
 }
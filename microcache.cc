@@ -0,0 +1,194 @@
+#include <sys/mman.h>
+#include <strings.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include "microcache.h"
+#include "pack.h"
+
+////////////////////////////////////////////////
+//              MicroCache                    //
+////////////////////////////////////////////////
+
+static long long now() {
+    struct timespec clock;
+    clock_gettime(CLOCK_MONOTONIC, &clock);
+    return (long long) clock.tv_sec * 1000 + clock.tv_nsec / 1000000;
+}
+
+MicroCache::MicroCache() {
+    // Shared anonymous mapping survives fork, body pages are only backed once written
+    mapped = sizeof(microcache_state) + (size_t) MICROCACHE_ENTRIES * MICROCACHE_BODY_LENGTH;
+    state = (microcache_state*) mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(state, 0, sizeof(microcache_state));
+    bodies = (char*) state + sizeof(microcache_state);
+}
+
+MicroCache::~MicroCache() {
+    munmap(state, mapped);
+}
+
+microcache_result_t MicroCache::Begin(const string& key, string& body, bool block) {
+    uint64_t hash = PackHash(key.c_str(), key.length()) | 1;
+
+    if (key.length() > MICROCACHE_KEY_LENGTH) {
+        return MICROCACHE_PASS;
+    }
+    while (true) {
+        long long current = now();
+        Lock();
+        microcache_entry* entry = Find(hash, key);
+
+        // First request for the key leads, unless its probe window is full of live entries
+        if (entry == NULL) {
+            entry = Claim(hash, key, current);
+            if (entry == NULL) {
+                Unlock();
+                return MICROCACHE_PASS;
+            }
+            entry->fresh = 0;
+            entry->stale = 0;
+            entry->length = 0;
+            entry->pass = false;
+            entry->flying = current;
+            Unlock();
+            return MICROCACHE_LEAD;
+        }
+        if (current < entry->fresh) {
+            if (entry->pass) {
+                Unlock();
+                return MICROCACHE_PASS;
+            }
+            body.assign(Body(entry), entry->length);
+            Unlock();
+            return MICROCACHE_FRESH;
+        }
+
+        // Expired: one caller refreshes, the others get the stale copy while it lasts. A flight
+        // that never landed lost its worker and is taken over.
+        if (entry->flying == 0 || current - entry->flying > MICROCACHE_FLIGHT) {
+            entry->flying = current;
+            Unlock();
+            return MICROCACHE_LEAD;
+        }
+        if (!entry->pass && current < entry->stale) {
+            body.assign(Body(entry), entry->length);
+            Unlock();
+            return MICROCACHE_STALE;
+        }
+        Unlock();
+        if (!block) {
+            return MICROCACHE_WAIT;
+        }
+        usleep(MICROCACHE_POLL * 1000);
+    }
+}
+
+void MicroCache::Finish(const string& key, const string& body, int ttl, int stale, bool store) {
+    uint64_t hash = PackHash(key.c_str(), key.length()) | 1;
+    long long current = now();
+
+    Lock();
+    microcache_entry* entry = Find(hash, key);
+    if (entry == NULL) {
+        Unlock();
+        return;
+    }
+    entry->flying = 0;
+    entry->fresh = current + (long long) ttl * 1000;
+    if (store && body.length() <= MICROCACHE_BODY_LENGTH) {
+        memcpy(Body(entry), body.c_str(), body.length());
+        entry->length = body.length();
+        entry->stale = entry->fresh + (long long) stale * 1000;
+        entry->pass = false;
+    } else {
+        entry->length = 0;
+        entry->stale = entry->fresh;
+        entry->pass = true;
+    }
+    Unlock();
+}
+
+microcache_entry* MicroCache::Find(uint64_t hash, const string& key) {
+    uint32_t home = hash & (MICROCACHE_ENTRIES - 1);
+
+    // Called with the lock held
+    for (uint32_t i = 0; i < MICROCACHE_PROBES; i++) {
+        microcache_entry* entry = &state->entries[(home + i) & (MICROCACHE_ENTRIES - 1)];
+        if (entry->hash == hash && entry->keylength == key.length() && memcmp(entry->key, key.c_str(), key.length()) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+microcache_entry* MicroCache::Claim(uint64_t hash, const string& key, long long current) {
+    uint32_t home = hash & (MICROCACHE_ENTRIES - 1);
+    microcache_entry* chosen = NULL;
+
+    // Called with the lock held: a free entry, else one past its stale window. A flight in
+    // progress always keeps its entry.
+    for (uint32_t i = 0; i < MICROCACHE_PROBES && (chosen == NULL || chosen->hash != 0); i++) {
+        microcache_entry* entry = &state->entries[(home + i) & (MICROCACHE_ENTRIES - 1)];
+        if (entry->hash == 0 || (chosen == NULL && entry->flying == 0 && entry->stale <= current)) {
+            chosen = entry;
+        }
+    }
+    if (chosen == NULL) {
+        return NULL;
+    }
+    chosen->hash = hash;
+    chosen->keylength = key.length();
+    memcpy(chosen->key, key.c_str(), key.length());
+    return chosen;
+}
+
+void MicroCache::Lock() {
+    // Held for one body copy at most, spinning beats sleeping
+    while (__sync_lock_test_and_set(&state->lock, 1)) {
+        while (state->lock) {
+        }
+    }
+}
+
+bool ParseCacheControl(const string& value, int& ttl, int& stale) {
+    size_t start = 0;
+    int shared = -1;
+
+    // Comma separated directives, names are case insensitive
+    while (start < value.length()) {
+        size_t end = value.find(',', start);
+        if (end == string::npos) {
+            end = value.length();
+        }
+        while (start < end && (value[start] == ' ' || value[start] == '\t')) {
+            start++;
+        }
+        const char* directive = value.c_str() + start;
+        if (strncasecmp(directive, "no-store", 8) == 0 || strncasecmp(directive, "no-cache", 8) == 0 ||
+            strncasecmp(directive, "private", 7) == 0) {
+            return false;
+        } else if (strncasecmp(directive, "s-maxage=", 9) == 0) {
+            shared = atoi(directive + 9);
+        } else if (strncasecmp(directive, "max-age=", 8) == 0) {
+            ttl = atoi(directive + 8);
+        } else if (strncasecmp(directive, "stale-while-revalidate=", 23) == 0) {
+            stale = atoi(directive + 23);
+        }
+        start = end + 1;
+    }
+
+    // s-maxage is meant for shared caches like this one and overrides max-age
+    if (shared >= 0) {
+        ttl = shared;
+    }
+    return true;
+}
+
+// End of file
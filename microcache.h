@@ -0,0 +1,76 @@
+#pragma once
+#ifndef MICROCACHE_H
+#define MICROCACHE_H
+
+#include <stdint.h>
+#include <string>
+
+#define MICROCACHE_ENTRIES      1024        // a power of two
+#define MICROCACHE_PROBES       8           // entries a key may sit in, from its home entry on
+#define MICROCACHE_KEY_LENGTH   1024        // longer path and query pairs are never cached
+#define MICROCACHE_BODY_LENGTH  65536       // larger output is passed, not stored
+#define MICROCACHE_POLL         2           // milliseconds between looks at a flight in progress
+#define MICROCACHE_FLIGHT       30000       // milliseconds after which a flight counts as abandoned
+
+using std::string;
+
+enum microcache_result_t {
+    MICROCACHE_FRESH = 0,   // body is a stored response within its TTL
+    MICROCACHE_STALE,       // body is past its TTL, another caller is already refreshing it
+    MICROCACHE_LEAD,        // caller executes and must call Finish
+    MICROCACHE_PASS,        // caller executes and stores nothing
+    MICROCACHE_WAIT,        // another caller is executing, only returned when not blocking
+};
+
+// Entry in the shared mapping, the key is kept inline and the body in the entry's own slot
+struct microcache_entry {
+    uint64_t hash;              // 0 marks a free entry
+    int64_t fresh;              // monotonic milliseconds: served as is until then
+    int64_t stale;              // served while a refresh runs until then
+    int64_t flying;             // when the leader executing right now began, 0 while none is
+    uint32_t keylength;
+    uint32_t length;
+    bool pass;                  // the script said not to store, everyone executes until fresh
+    char key[MICROCACHE_KEY_LENGTH];
+};
+
+struct microcache_state {
+    volatile int lock;
+    microcache_entry entries[MICROCACHE_ENTRIES];
+};
+
+// Single-flight micro-cache for PHP output, keyed by path and query. Entries live in one shared
+// anonymous mapping created before any fork, like the response cache, so concurrent misses for
+// one key wait on a single execution across every worker process and thread. Stored output is
+// served for its TTL and, past it, for the stale window while one caller refreshes. A leader in
+// another process cannot wake anyone, waiters look at the entry again every MICROCACHE_POLL.
+class MicroCache {
+private:
+    microcache_state* state;
+    char* bodies;
+    size_t mapped;
+
+    microcache_entry* Find(uint64_t hash, const string& key);
+    microcache_entry* Claim(uint64_t hash, const string& key, long long current);
+    char* Body(microcache_entry* entry) { return bodies + (size_t) (entry - state->entries) * MICROCACHE_BODY_LENGTH; }
+    void Lock();
+    void Unlock() { __sync_lock_release(&state->lock); }
+public:
+    // Constructor/Destructor
+    MicroCache();
+    ~MicroCache();
+
+    // Threads poll a flight in progress, the evented loop must not and gets MICROCACHE_WAIT
+    microcache_result_t Begin(const string& key, string& body, bool block);
+
+    // Ends a MICROCACHE_LEAD. ttl and stale are seconds; store false marks the key pass for ttl.
+    void Finish(const string& key, const string& body, int ttl, int stale, bool store);
+};
+
+// Reads a script's Cache-Control: max-age or s-maxage into ttl, stale-while-revalidate into
+// stale. False for no-store, no-cache and private, which a shared cache must not store.
+bool ParseCacheControl(const string& value, int& ttl, int& stale);
+
+#endif
+
+// End of header
@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <ftw.h>
+#include <zlib.h>
+#include "http.h"
+#include "pack.h"
+
+using std::cout;
+using std::endl;
+using std::ofstream;
+using std::string;
+using std::stringstream;
+using std::vector;
+
+// mkpack compiles a document root into a single pack file for `http --pack`.
+// PHP scripts are skipped since they are executed per request.
+
+struct pack_file {
+    string path;
+    string data;
+    string gzip;
+    string mime;
+};
+
+static vector<pack_file> files;
+static size_t rootlength = 0;
+
+static bool compressible(const string& mime) {
+    return mime.compare(0, 5, "text/") == 0 || mime.compare("application/js") == 0;
+}
+
+// Gzip the body, keeping the variant only when it saves at least 10%
+static string gzipBody(const string& data) {
+    z_stream stream;
+    string out;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return "";
+    }
+    out.resize(deflateBound(&stream, data.length()) + 32);
+    stream.next_in = (Bytef*) data.data();
+    stream.avail_in = data.length();
+    stream.next_out = (Bytef*) &out[0];
+    stream.avail_out = out.length();
+    int error = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (error != Z_STREAM_END || out.length() * 10 > data.length() * 9) {
+        return "";
+    }
+    return out;
+}
+
+static int addFile(const char* filename, const struct stat* info, int flag, struct FTW* ftw) {
+    if (flag != FTW_F) {
+        return 0;
+    }
+    pack_file file;
+    const char* dot = strrchr(filename, '.');
+    string extension = dot == NULL ? "" : dot + 1;
+    if (extension.compare("php") == 0) {
+        return 0;
+    }
+
+    // Read the whole file
+    std::ifstream input(filename, std::ios::in | std::ios::binary);
+    stringstream contents;
+    contents << input.rdbuf();
+    file.data = contents.str();
+
+    // URI path relative to the document root, always starting with '/'
+    file.path = filename + rootlength;
+    if (file.path.empty() || file.path[0] != '/') {
+        file.path = "/" + file.path;
+    }
+    file.mime = MimeType(extension);
+    if (compressible(file.mime)) {
+        file.gzip = gzipBody(file.data);
+    }
+    files.push_back(file);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        cout << "Usage: mkpack /path/to/docroot output.pack\n";
+        return EXIT_FAILURE;
+    }
+
+    // Collect every regular file under the root
+    string root = argv[1];
+    while (root.length() > 1 && root[root.length() - 1] == '/') {
+        root.erase(root.length() - 1);
+    }
+    rootlength = root.length();
+    if (nftw(root.c_str(), addFile, 16, FTW_PHYS) != 0) {
+        perror("nftw");
+        return EXIT_FAILURE;
+    }
+
+    // Size the bucket table to at most half full
+    uint32_t bucketcount = 16;
+    while (bucketcount < files.size() * 2) {
+        bucketcount *= 2;
+    }
+    vector<uint32_t> buckets(bucketcount, 0);
+    vector<pack_entry> entries(files.size());
+
+    // Lay out paths after the entries, then file data
+    pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.count = files.size();
+    header.bucketcount = bucketcount;
+    header.entriesoffset = sizeof(pack_header) + bucketcount * sizeof(uint32_t);
+    uint64_t offset = header.entriesoffset + files.size() * sizeof(pack_entry);
+
+    for (size_t i = 0; i < files.size(); i++) {
+        memset(&entries[i], 0, sizeof(pack_entry));
+        entries[i].hash = PackHash(files[i].path.data(), files[i].path.length());
+        entries[i].pathoffset = offset;
+        entries[i].pathlength = files[i].path.length();
+        offset += files[i].path.length();
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        // Page-align bodies so zero-copy sends start on a page boundary
+        offset = (offset + 4095) & ~4095ULL;
+        entries[i].offset = offset;
+        entries[i].length = files[i].data.length();
+        offset += files[i].data.length();
+        if (!files[i].gzip.empty()) {
+            entries[i].gzipoffset = offset;
+            entries[i].gziplength = files[i].gzip.length();
+            offset += files[i].gzip.length();
+        }
+        strncpy(entries[i].mime, files[i].mime.c_str(), PACK_MIME_LENGTH - 1);
+        snprintf(entries[i].etag, PACK_ETAG_LENGTH, "\"%016llx\"", (unsigned long long) PackHash(files[i].data.data(), files[i].data.length()));
+
+        // Insert into the bucket table
+        uint32_t mask = bucketcount - 1;
+        uint32_t bucket = entries[i].hash & mask;
+        while (buckets[bucket] != 0) {
+            bucket = (bucket + 1) & mask;
+        }
+        buckets[bucket] = i + 1;
+    }
+
+    // Write everything out in layout order
+    ofstream output(argv[2], std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!output.good()) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+    output.write((const char*) &header, sizeof(header));
+    output.write((const char*) &buckets[0], bucketcount * sizeof(uint32_t));
+    if (!entries.empty()) {
+        output.write((const char*) &entries[0], entries.size() * sizeof(pack_entry));
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        output.write(files[i].path.data(), files[i].path.length());
+    }
+    for (size_t i = 0; i < files.size(); i++) {
+        while ((uint64_t) output.tellp() < entries[i].offset) {
+            output.put('\0');
+        }
+        output.write(files[i].data.data(), files[i].data.length());
+        output.write(files[i].gzip.data(), files[i].gzip.length());
+        cout << files[i].path << " " << files[i].mime << " " << files[i].data.length() << " bytes";
+        if (!files[i].gzip.empty()) {
+            cout << ", gzip " << files[i].gzip.length() << " bytes";
+        }
+        cout << endl;
+    }
+    output.close();
+    if (!output.good()) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+    cout << "Packed " << files.size() << " files into " << argv[2] << endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,103 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "pack.h"
+
+////////////////////////////////////////////////
+//              AssetPack                     //
+////////////////////////////////////////////////
+AssetPack::AssetPack() {
+    base = NULL;
+    size = 0;
+    header = NULL;
+    buckets = NULL;
+    entries = NULL;
+}
+
+AssetPack::~AssetPack() {
+    if (base != NULL) {
+        munmap((void*) base, size);
+    }
+}
+
+bool AssetPack::Open(const char* filename) {
+    struct stat info;
+    void* mapping;
+
+    int file = open(filename, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        perror("open");
+        return false;
+    }
+    if (fstat(file, &info) < 0 || (size_t) info.st_size < sizeof(pack_header)) {
+        fprintf(stderr, "%s: not a pack file\n", filename);
+        close(file);
+        return false;
+    }
+
+    // Shared read-only mapping, every worker process uses the same page cache copy
+    mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, file, 0);
+    close(file);
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    // Validate header and table bounds before trusting any offsets
+    header = (const pack_header*) mapping;
+    size = info.st_size;
+    if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 || header->version != PACK_VERSION ||
+        header->bucketcount == 0 || (header->bucketcount & (header->bucketcount - 1)) != 0 || header->count >= header->bucketcount ||
+        !InMapping(sizeof(pack_header), (uint64_t) header->bucketcount * sizeof(uint32_t)) ||
+        !InMapping(header->entriesoffset, (uint64_t) header->count * sizeof(pack_entry))) {
+        fprintf(stderr, "%s: corrupt or unsupported pack file\n", filename);
+        munmap(mapping, size);
+        header = NULL;
+        size = 0;
+        return false;
+    }
+    base = (const char*) mapping;
+    buckets = (const uint32_t*) (base + sizeof(pack_header));
+    entries = (const pack_entry*) (base + header->entriesoffset);
+
+    // Every path and body must lie inside the mapping, and the strings must be terminated
+    for (uint32_t i = 0; i < header->count; i++) {
+        const pack_entry* entry = &entries[i];
+        if (!InMapping(entry->pathoffset, entry->pathlength) || !InMapping(entry->offset, entry->length) ||
+            !InMapping(entry->gzipoffset, entry->gziplength) || memchr(entry->mime, '\0', PACK_MIME_LENGTH) == NULL ||
+            memchr(entry->etag, '\0', PACK_ETAG_LENGTH) == NULL || entry->etag[0] != '"' ||
+            entry->etag[strlen(entry->etag) - 1] != '"') {
+            fprintf(stderr, "%s: corrupt entry %u\n", filename, i);
+            munmap(mapping, size);
+            base = NULL;
+            header = NULL;
+            size = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+const pack_entry* AssetPack::Lookup(const char* path, size_t length) {
+    if (base == NULL) {
+        return NULL;
+    }
+
+    // Probe from the hash bucket until an empty slot, comparing hash then bytes. A corrupt table
+    // without empty slots is walked once at most.
+    uint64_t hash = PackHash(path, length);
+    uint32_t mask = header->bucketcount - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t probe = 0; probe < header->bucketcount && buckets[i] != 0 && buckets[i] <= header->count; probe++, i = (i + 1) & mask) {
+        const pack_entry* entry = &entries[buckets[i] - 1];
+        if (entry->hash == hash && entry->pathlength == length && memcmp(base + entry->pathoffset, path, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// End of file
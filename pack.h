@@ -0,0 +1,79 @@
+#pragma once
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+#include <string>
+
+#define PACK_MAGIC        "HTTPPACK"
+#define PACK_VERSION      1
+#define PACK_MIME_LENGTH  32
+#define PACK_ETAG_LENGTH  24
+
+using std::string;
+
+// On-disk layout, all offsets are from the start of the file:
+//   pack_header | uint32 buckets[bucketcount] | pack_entry entries[count] | paths | file data
+// A bucket holds an entry index + 1, 0 marks an empty bucket (open addressing, linear probing).
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t bucketcount;
+    uint32_t reserved;
+    uint64_t entriesoffset;
+};
+
+struct pack_entry {
+    uint64_t hash;
+    uint64_t pathoffset;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t gzipoffset;
+    uint64_t gziplength;
+    uint32_t pathlength;
+    char mime[PACK_MIME_LENGTH];
+    char etag[PACK_ETAG_LENGTH];
+};
+
+class AssetPack {
+private:
+    // Read-only shared mapping of the whole pack file
+    const char* base;
+    size_t size;
+    const pack_header* header;
+    const uint32_t* buckets;
+    const pack_entry* entries;
+
+    // Overflow safe: offset + length within the mapping
+    bool InMapping(uint64_t offset, uint64_t length) { return offset <= size && length <= size - offset; }
+public:
+    // Constructor/Destructor
+    AssetPack();
+    ~AssetPack();
+
+    // Maps the pack, returns false when missing or malformed
+    bool Open(const char* filename);
+    bool IsOpen() { return base != NULL; }
+
+    // Lookup by URI path, e.g. "/hello.html"
+    const pack_entry* Lookup(const char* path, size_t length);
+
+    // Entry contents inside the mapping
+    const char* get_data(const pack_entry* entry) { return base + entry->offset; }
+    const char* get_gzip(const pack_entry* entry) { return base + entry->gzipoffset; }
+};
+
+// FNV-1a, shared by mkpack and the server lookup
+inline uint64_t PackHash(const char* data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif
+
+// End of header
@@ -0,0 +1,437 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "proxy.h"
+
+using std::stringstream;
+
+#define PROXY_BODY_LENGTH 16777216
+
+////////////////////////////////////////////////
+//              UpstreamPool                  //
+////////////////////////////////////////////////
+UpstreamPool::UpstreamPool() {
+    pthread_mutex_init(&lock, NULL);
+}
+
+UpstreamPool::~UpstreamPool() {
+    // Close every pooled connection
+    for (size_t i = 0; i < upstreams.size(); i++) {
+        while (!upstreams[i].idle.empty()) {
+            close(upstreams[i].idle.back());
+            upstreams[i].idle.pop_back();
+        }
+    }
+    pthread_mutex_destroy(&lock);
+}
+
+bool UpstreamPool::Parse(const string& targets) {
+    stringstream stream(targets);
+    string target;
+
+    while (getline(stream, target, ',')) {
+        upstream entry;
+        size_t colon = target.rfind(':');
+        if (colon == string::npos) {
+            fprintf(stderr, "proxy: upstream %s needs host:port\n", target.c_str());
+            return false;
+        }
+
+        // Resolve once at startup
+        struct addrinfo hints;
+        struct addrinfo* result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(target.substr(0, colon).c_str(), target.substr(colon + 1).c_str(), &hints, &result) != 0) {
+            fprintf(stderr, "proxy: cannot resolve %s\n", target.c_str());
+            return false;
+        }
+        memcpy(&entry.address, result->ai_addr, sizeof(entry.address));
+        freeaddrinfo(result);
+
+        entry.name = target;
+        entry.active = 0;
+        entry.healthy = true;
+        entry.checked = 0;
+        entry.connects = 0;
+        entry.reuses = 0;
+        entry.failures = 0;
+        upstreams.push_back(entry);
+    }
+    return !upstreams.empty();
+}
+
+int UpstreamPool::Open(upstream& target, bool nonblocking) {
+    struct timeval timeout;
+    int nodelay = 1;
+    int connection = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (connection < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Bound every upstream read and write so a stuck upstream costs at most PROXY_TIMEOUT
+    timeout.tv_sec = PROXY_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Requests go out in a single write, never hold them back
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (connect(connection, (struct sockaddr*) &target.address, sizeof(target.address)) < 0 && (!nonblocking || errno != EINPROGRESS)) {
+        close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+int UpstreamPool::Acquire(upstream*& chosen, bool& reused, bool nonblocking) {
+    int connection = -1;
+    time_t now = time(NULL);
+
+    // Least active requests among healthy upstreams, retrying unhealthy ones once their interval passed
+    pthread_mutex_lock(&lock);
+    chosen = NULL;
+    for (size_t i = 0; i < upstreams.size(); i++) {
+        upstream& candidate = upstreams[i];
+        if (!candidate.healthy && difftime(now, candidate.checked) < PROXY_HEALTH_INTERVAL) {
+            continue;
+        }
+        if (chosen == NULL || candidate.active < chosen->active) {
+            chosen = &candidate;
+        }
+    }
+    if (chosen == NULL) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    chosen->active++;
+    if (!chosen->idle.empty()) {
+        connection = chosen->idle.back();
+        chosen->idle.pop_back();
+        chosen->reuses++;
+        reused = true;
+    }
+    pthread_mutex_unlock(&lock);
+    if (connection >= 0) {
+        return connection;
+    }
+
+    // Connect outside the lock
+    reused = false;
+    connection = Open(*chosen, nonblocking);
+    pthread_mutex_lock(&lock);
+    chosen->checked = now;
+    if (connection < 0) {
+        chosen->healthy = false;
+        chosen->failures++;
+        chosen->active--;
+    } else {
+        chosen->healthy = true;
+        chosen->connects++;
+    }
+    pthread_mutex_unlock(&lock);
+    return connection;
+}
+
+void UpstreamPool::Release(upstream* chosen, int connection, bool reusable) {
+    // Keep the connection for the next request unless the pool is full
+    pthread_mutex_lock(&lock);
+    chosen->active--;
+    if (reusable && chosen->idle.size() < PROXY_MAX_IDLE) {
+        chosen->idle.push_back(connection);
+        connection = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    if (connection >= 0) {
+        close(connection);
+    }
+}
+
+void UpstreamPool::Fail(upstream* chosen) {
+    // The connect Acquire counted as a success was refused after all
+    pthread_mutex_lock(&lock);
+    chosen->healthy = false;
+    chosen->failures++;
+    pthread_mutex_unlock(&lock);
+}
+
+void UpstreamPool::CheckHealth() {
+    char probe;
+    time_t now = time(NULL);
+
+    for (size_t i = 0; i < upstreams.size(); i++) {
+        pthread_mutex_lock(&lock);
+        upstream& target = upstreams[i];
+
+        // Idle connections that are readable or at EOF were closed or poisoned by the upstream
+        for (size_t j = 0; j < target.idle.size();) {
+            ssize_t count = recv(target.idle[j], &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (count == 0 || count > 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                close(target.idle[j]);
+                target.idle.erase(target.idle.begin() + j);
+            } else {
+                j++;
+            }
+        }
+        bool probing = !target.healthy && difftime(now, target.checked) >= PROXY_HEALTH_INTERVAL;
+        pthread_mutex_unlock(&lock);
+
+        // A TCP connect is the health probe, the connection is pooled on success
+        if (probing) {
+            int connection = Open(target, false);
+            pthread_mutex_lock(&lock);
+            target.checked = now;
+            target.healthy = connection >= 0;
+            if (connection >= 0 && target.idle.size() < PROXY_MAX_IDLE) {
+                target.connects++;
+                target.idle.push_back(connection);
+            } else if (connection >= 0) {
+                close(connection);
+            }
+            pthread_mutex_unlock(&lock);
+        }
+    }
+}
+
+string UpstreamPool::FormatStats() {
+    stringstream stats;
+
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < upstreams.size(); i++) {
+        upstream& target = upstreams[i];
+        stats << "upstream " << target.name << " healthy " << target.healthy << " active " << target.active << " idle " << target.idle.size();
+        stats << " connects " << target.connects << " reuses " << target.reuses << " failures " << target.failures << "\n";
+    }
+    pthread_mutex_unlock(&lock);
+    return stats.str();
+}
+
+////////////////////////////////////////////////
+//              Response Helpers              //
+////////////////////////////////////////////////
+
+// Appends whatever the upstream sends next, false on EOF, error or timeout
+static bool fill(int connection, string& buffer) {
+    char chunk[PROXY_CHUNK_LENGTH];
+    ssize_t count = recv(connection, chunk, sizeof(chunk), 0);
+    if (count <= 0) {
+        return false;
+    }
+    buffer.append(chunk, count);
+    return true;
+}
+
+bool ReadUpstreamHead(int connection, string& head, string& rest) {
+    string buffer = "";
+    int done = 0;
+
+    // Read until the blank line, whatever follows belongs to the body
+    while (done == 0) {
+        if (!fill(connection, buffer)) {
+            return false;
+        }
+        done = SplitUpstreamHead(buffer, head, rest);
+    }
+    return done > 0;
+}
+
+int SplitUpstreamHead(const string& buffer, string& head, string& rest) {
+    size_t end = buffer.find("\r\n\r\n");
+    if (end == string::npos) {
+        return buffer.length() > PROXY_HEAD_LENGTH ? -1 : 0;
+    }
+    head = buffer.substr(0, end + 4);
+    rest = buffer.substr(end + 4);
+    return 1;
+}
+
+bool ParseUpstreamHead(const string& head, upstream_response& response) {
+    stringstream stream(head);
+    string line;
+    bool sized = false;
+
+    // Status line, e.g. "HTTP/1.1 200 OK"
+    if (!getline(stream, line) || line.compare(0, 5, "HTTP/") != 0 || line.length() < 12) {
+        return false;
+    }
+    response.status = atoi(line.c_str() + 9);
+    response.contentlength = -1;
+    response.chunked = false;
+    response.close = line.compare(0, 8, "HTTP/1.0") == 0;
+
+    // Framing headers
+    while (getline(stream, line)) {
+        size_t colon = line.find(':');
+        if (colon == string::npos) {
+            continue;
+        }
+        string name = line.substr(0, colon);
+        string value = line.substr(colon + 1);
+        if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+            // Digits only, and repeats have to agree, or the end of the body is ambiguous
+            size_t start = value.find_first_not_of(" \t");
+            size_t end = value.find_last_not_of(" \t\r");
+            if (start == string::npos || end - start >= 18 ||
+                value.find_first_not_of("0123456789", start) <= end) {
+                return false;
+            }
+            long length = atol(value.c_str() + start);
+            if (sized && length != response.contentlength) {
+                return false;
+            }
+            response.contentlength = length;
+            sized = true;
+        } else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0) {
+            response.chunked = strcasestr(value.c_str(), "chunked") != NULL;
+        } else if (strcasecmp(name.c_str(), "Connection") == 0) {
+            if (strcasestr(value.c_str(), "close") != NULL) {
+                response.close = true;
+            } else if (strcasestr(value.c_str(), "keep-alive") != NULL) {
+                response.close = false;
+            }
+        }
+    }
+
+    // Chunking wins over a Content-Length sent along with it (RFC 9112 section 6.3). Such a
+    // response may be an attempt to desync, the connection is not pooled again.
+    if (response.chunked && response.contentlength >= 0) {
+        response.contentlength = -1;
+        response.close = true;
+    }
+
+    // Interim, No Content and Not Modified responses never have a body, whatever their
+    // framing headers say (a 304 repeats the Content-Length of the full response)
+    if (response.status < 200 || response.status == 204 || response.status == 304) {
+        response.contentlength = 0;
+        response.chunked = false;
+    }
+
+    // Without a length or chunking the body runs until the upstream closes
+    if (response.contentlength < 0 && !response.chunked) {
+        response.close = true;
+    }
+    return response.contentlength <= PROXY_BODY_LENGTH;
+}
+
+bool ReadUpstreamBody(int connection, const upstream_response& response, string& body, bool& reusable) {
+    upstream_decoder decoder;
+
+    // Whatever came along with the head is decoded first
+    decoder.raw = body;
+    decoder.trailers = false;
+    decoder.excess = false;
+    body = "";
+    int done = DecodeUpstreamBody(response, decoder, body, false);
+    while (done == 0) {
+        bool more = fill(connection, decoder.raw);
+        done = DecodeUpstreamBody(response, decoder, body, !more);
+    }
+    reusable = done > 0 && !decoder.excess;
+    return done > 0;
+}
+
+int DecodeUpstreamBody(const upstream_response& response, upstream_decoder& decoder, string& body, bool eof) {
+    // Fixed length
+    if (response.contentlength >= 0) {
+        body.append(decoder.raw);
+        decoder.raw.clear();
+        if ((long) body.length() >= response.contentlength) {
+            decoder.excess = (long) body.length() > response.contentlength;
+            body.resize(response.contentlength);
+            return 1;
+        }
+        return eof ? -1 : 0;
+    }
+
+    // Until EOF
+    if (!response.chunked) {
+        body.append(decoder.raw);
+        decoder.raw.clear();
+        if (body.length() > PROXY_BODY_LENGTH) {
+            return -1;
+        }
+        return eof ? 1 : 0;
+    }
+
+    // Chunked, decoded so the client gets a plain Content-Length body. Complete chunks
+    // move to the body, a partial one waits in raw for the rest.
+    string& raw = decoder.raw;
+    size_t position = 0;
+    size_t eol;
+    while ((eol = raw.find("\r\n", position)) != string::npos) {
+        if (decoder.trailers) {
+            // Skip trailers up to the final blank line
+            if (eol == position) {
+                raw.erase(0, eol + 2);
+                decoder.excess = !raw.empty();
+                return 1;
+            }
+            position = eol + 2;
+            continue;
+        }
+        // Hex digits, optionally followed by chunk extensions. Anything else, or a size that
+        // overflows, leaves no way to find the next chunk.
+        char* end;
+        errno = 0;
+        long size = strtol(raw.c_str() + position, &end, 16);
+        if (!isxdigit((unsigned char) raw[position]) || errno == ERANGE ||
+            (end != raw.c_str() + eol && *end != ';' && *end != ' ' && *end != '\t') ||
+            (unsigned long) size > PROXY_BODY_LENGTH - body.length()) {
+            return -1;
+        }
+        if (size == 0) {
+            decoder.trailers = true;
+            position = eol + 2;
+            continue;
+        }
+        if (raw.length() < eol + 2 + size + 2) {
+            break;
+        }
+        if (raw.compare(eol + 2 + size, 2, "\r\n") != 0) {
+            return -1;
+        }
+        body.append(raw, eol + 2, size);
+        position = eol + 2 + size + 2;
+    }
+    raw.erase(0, position);
+    return eof ? -1 : 0;
+}
+
+string RewriteUpstreamHead(const string& head, const string& version, long contentlength) {
+    stringstream stream(head);
+    string line;
+    string rewritten = "";
+
+    // Status line keeps the upstream status but speaks the client's version
+    getline(stream, line);
+    rewritten += version + line.substr(line.find(' '));
+    rewritten += "\n";
+
+    // Drop hop-by-hop and framing headers, the length is set by us
+    while (getline(stream, line) && line.compare("\r") != 0) {
+        size_t colon = line.find(':');
+        string name = colon == string::npos ? line : line.substr(0, colon);
+        if (strcasecmp(name.c_str(), "Connection") == 0 || strcasecmp(name.c_str(), "Keep-Alive") == 0 ||
+            strcasecmp(name.c_str(), "Transfer-Encoding") == 0 || strcasecmp(name.c_str(), "Content-Length") == 0 ||
+            strcasecmp(name.c_str(), "Proxy-Connection") == 0 || strcasecmp(name.c_str(), "Trailer") == 0 ||
+            strcasecmp(name.c_str(), "Upgrade") == 0 || strcasecmp(name.c_str(), "TE") == 0) {
+            continue;
+        }
+        rewritten += line + "\n";
+    }
+    rewritten += "Content-Length: " + std::to_string(contentlength) + "\r\n\r\n";
+    return rewritten;
+}
+
+// End of file
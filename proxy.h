@@ -0,0 +1,90 @@
+#pragma once
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#define PROXY_TIMEOUT         5
+#define PROXY_HEALTH_INTERVAL 5
+#define PROXY_MAX_IDLE        32
+#define PROXY_HEAD_LENGTH     16384
+#define PROXY_CHUNK_LENGTH    16384
+
+using std::string;
+using std::vector;
+
+struct upstream {
+    string name;
+    struct sockaddr_in address;
+
+    // Least-connections input and the keep-alive pool
+    int active;
+    vector<int> idle;
+
+    // Health, unhealthy upstreams are skipped until a probe succeeds
+    bool healthy;
+    time_t checked;
+
+    // Counters for measuring connection reuse
+    unsigned long connects;
+    unsigned long reuses;
+    unsigned long failures;
+};
+
+// Parsed status line and framing of an upstream response
+struct upstream_response {
+    int status;
+    long contentlength;
+    bool chunked;
+    bool close;
+};
+
+// Body bytes received but not decoded yet, and whether a chunked body reached its trailers
+struct upstream_decoder {
+    string raw;
+    bool trailers;
+    bool excess;            // bytes arrived past the body, the connection can't be reused
+};
+
+// Upstreams of one proxy route. Shared by all threads of a process, so one
+// pool exists per worker process.
+class UpstreamPool {
+private:
+    vector<upstream> upstreams;
+    pthread_mutex_t lock;
+    int Open(upstream& target, bool nonblocking);
+public:
+    // Constructor/Destructor
+    UpstreamPool();
+    ~UpstreamPool();
+
+    // Parses "host:port[,host:port...]"
+    bool Parse(const string& targets);
+
+    // Least-connections choice among healthy upstreams, reusing an idle connection when one is pooled.
+    // A non-blocking acquire may return a connect still in progress, Fail reports it refused.
+    int Acquire(upstream*& chosen, bool& reused, bool nonblocking = false);
+    void Release(upstream* chosen, int connection, bool reusable);
+    void Fail(upstream* chosen);
+
+    // Probes unhealthy upstreams and drops pooled connections the upstream has closed
+    void CheckHealth();
+    string FormatStats();
+};
+
+// Upstream response helpers. The Split/Decode pair frames bytes however they were received,
+// 1 when done, 0 when more are needed, -1 on a malformed or oversized response.
+bool ReadUpstreamHead(int connection, string& head, string& rest);
+int SplitUpstreamHead(const string& buffer, string& head, string& rest);
+bool ParseUpstreamHead(const string& head, upstream_response& response);
+bool ReadUpstreamBody(int connection, const upstream_response& response, string& body, bool& reusable);
+int DecodeUpstreamBody(const upstream_response& response, upstream_decoder& decoder, string& body, bool eof);
+string RewriteUpstreamHead(const string& head, const string& version, long contentlength);
+
+#endif
+
+// End of header
@@ -0,0 +1,330 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "reactor.h"
+
+// Monotonic milliseconds, timers never move with the wall clock
+static long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+////////////////////////////////////////////////
+//              Awaitables                    //
+////////////////////////////////////////////////
+
+bool fd_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    // Not pollable or already gone: carry on, the caller's next call reports the error
+    ready = !reactor->Wait(fd, events, timeout, handle, &ready);
+    return !ready;
+}
+
+void sleep_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    reactor->After(timeout, handle);
+}
+
+bool file_awaiter::await_ready() {
+    struct iovec iov;
+
+    // RWF_NOWAIT reads only what the page cache holds and fails instead of going to disk
+    done = 0;
+    job.out->resize(job.length);
+    iov.iov_base = &(*job.out)[0];
+    iov.iov_len = job.length;
+    ssize_t count = preadv2(job.file, &iov, 1, job.offset, RWF_NOWAIT);
+    if (count == 0 || (count > 0 && (size_t) count == job.length)) {
+        job.out->resize(count);
+        job.result = count;
+        return true;
+    }
+
+    // A short read may just be the cached part, the file threads read the rest
+    if (count > 0) {
+        done = count;
+    }
+    return false;
+}
+
+void file_awaiter::await_suspend(std::coroutine_handle<> handle) {
+    job.handle = handle;
+    job.offset += done;
+    job.length -= done;
+    job.position = done;
+    reactor->Submit(&job);
+}
+
+ssize_t file_awaiter::await_resume() {
+    if (job.result < 0) {
+        return -1;
+    }
+    job.out->resize(done + job.result);
+    return done + job.result;
+}
+
+////////////////////////////////////////////////
+//              Reactor                       //
+////////////////////////////////////////////////
+
+Reactor::Reactor() {
+    epoll = -1;
+    notify = -1;
+    sequence = 0;
+    started = 0;
+    stopping = false;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wake, NULL);
+}
+
+Reactor::~Reactor() {
+    Detach();
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&wake);
+}
+
+bool Reactor::Attach(int epoll) {
+    struct epoll_event event;
+
+    // File threads are started here rather than in the constructor, after any fork
+    notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify < 0) {
+        perror("eventfd");
+        return false;
+    }
+    event.events = EPOLLIN;
+    event.data.fd = notify;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, notify, &event) < 0) {
+        perror("epoll_ctl");
+        close(notify);
+        notify = -1;
+        return false;
+    }
+    stopping = false;
+    for (started = 0; started < REACTOR_FILE_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, Reactor::ReadFiles, this) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    this->epoll = epoll;
+    return true;
+}
+
+void Reactor::Detach() {
+    // Coroutines still suspended are abandoned along with the loop
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    started = 0;
+    if (notify >= 0) {
+        close(notify);
+        notify = -1;
+    }
+    epoll = -1;
+}
+
+void* Reactor::ReadFiles(void* arg) {
+    Reactor* reactor = (Reactor*) arg;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&reactor->lock);
+    while (true) {
+        while (reactor->queued.empty() && !reactor->stopping) {
+            pthread_cond_wait(&reactor->wake, &reactor->lock);
+        }
+        if (reactor->stopping) {
+            break;
+        }
+        file_read* job = reactor->queued.front();
+        reactor->queued.pop_front();
+        pthread_mutex_unlock(&reactor->lock);
+
+        // The buffer belongs to the suspended coroutine, nobody else touches it meanwhile
+        size_t total = 0;
+        ssize_t count = 1;
+        while (total < job->length && count > 0) {
+            count = pread(job->file, &(*job->out)[job->position + total], job->length - total, job->offset + total);
+            if (count < 0 && errno == EINTR) {
+                count = 1;
+                continue;
+            }
+            if (count > 0) {
+                total += count;
+            }
+        }
+        job->result = count < 0 ? -1 : (ssize_t) total;
+
+        pthread_mutex_lock(&reactor->lock);
+        reactor->completed.push_back(job);
+        if (write(reactor->notify, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+    }
+    pthread_mutex_unlock(&reactor->lock);
+    return NULL;
+}
+
+bool Reactor::Dispatch(int fd) {
+    uint64_t count;
+
+    // Finished file reads, resumed on the loop thread
+    if (fd == notify && notify >= 0) {
+        vector<file_read*> finished;
+        if (read(notify, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            perror("read");
+        }
+        pthread_mutex_lock(&lock);
+        finished.swap(completed);
+        pthread_mutex_unlock(&lock);
+        for (size_t i = 0; i < finished.size(); i++) {
+            finished[i]->handle.resume();
+        }
+        return true;
+    }
+
+    // Ready descriptor, its timeout entry goes stale and is skipped by Expire
+    auto item = waiters.find(fd);
+    if (item == waiters.end()) {
+        return false;
+    }
+    reactor_waiter waiter = item->second;
+    waiters.erase(item);
+    epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+    *waiter.ready = true;
+    waiter.handle.resume();
+    return true;
+}
+
+int Reactor::NextTimeout(int fallback) {
+    if (timers.empty()) {
+        return fallback;
+    }
+    long long wait = timers.top().deadline - now();
+    if (wait < 0) {
+        return 0;
+    }
+    return wait < fallback ? (int) wait : fallback;
+}
+
+void Reactor::Expire() {
+    long long current = now();
+
+    while (!timers.empty() && timers.top().deadline <= current) {
+        reactor_timer timer = timers.top();
+        timers.pop();
+        if (timer.sequence == 0) {
+            timer.handle.resume();
+            continue;
+        }
+
+        // A descriptor wait that is still pending timed out
+        auto item = waiters.find(timer.fd);
+        if (item == waiters.end() || item->second.sequence != timer.sequence) {
+            continue;
+        }
+        waiters.erase(item);
+        epoll_ctl(epoll, EPOLL_CTL_DEL, timer.fd, NULL);
+        timer.handle.resume();
+    }
+}
+
+fd_awaiter Reactor::Readable(int fd, int timeout) {
+    fd_awaiter awaiter = { this, fd, EPOLLIN, timeout, false };
+    return awaiter;
+}
+
+fd_awaiter Reactor::Writable(int fd, int timeout) {
+    fd_awaiter awaiter = { this, fd, EPOLLOUT, timeout, false };
+    return awaiter;
+}
+
+sleep_awaiter Reactor::Sleep(int timeout) {
+    sleep_awaiter awaiter = { this, timeout };
+    return awaiter;
+}
+
+file_awaiter Reactor::ReadFile(int file, off_t offset, size_t length, string& out) {
+    file_awaiter awaiter;
+    awaiter.reactor = this;
+    awaiter.job.file = file;
+    awaiter.job.offset = offset;
+    awaiter.job.length = length;
+    awaiter.job.out = &out;
+    awaiter.job.position = 0;
+    awaiter.job.result = 0;
+    awaiter.done = 0;
+    return awaiter;
+}
+
+Task<ssize_t> Reactor::Recv(int fd, char* buffer, size_t length, int timeout) {
+    while (true) {
+        ssize_t count = recv(fd, buffer, length, MSG_DONTWAIT);
+        if (count >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            co_return count;
+        }
+        if (!co_await Readable(fd, timeout)) {
+            errno = ETIMEDOUT;
+            co_return -1;
+        }
+    }
+}
+
+Task<bool> Reactor::Send(int fd, const char* buffer, size_t length, int timeout) {
+    while (length > 0) {
+        ssize_t count = send(fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (count > 0) {
+            buffer += count;
+            length -= count;
+        } else if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return false;
+        } else if (!co_await Writable(fd, timeout)) {
+            errno = ETIMEDOUT;
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+bool Reactor::Wait(int fd, unsigned events, int timeout, std::coroutine_handle<> handle, bool* ready) {
+    struct epoll_event event;
+    reactor_waiter waiter;
+
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        return false;
+    }
+    waiter.handle = handle;
+    waiter.ready = ready;
+    waiter.sequence = ++sequence;
+    waiters[fd] = waiter;
+    if (timeout >= 0) {
+        reactor_timer timer = { now() + timeout, waiter.sequence, fd, handle };
+        timers.push(timer);
+    }
+    return true;
+}
+
+void Reactor::After(int timeout, std::coroutine_handle<> handle) {
+    reactor_timer timer = { now() + timeout, 0, -1, handle };
+    timers.push(timer);
+}
+
+void Reactor::Submit(file_read* job) {
+    pthread_mutex_lock(&lock);
+    queued.push_back(job);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+// End of file
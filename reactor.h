@@ -0,0 +1,237 @@
+#pragma once
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define REACTOR_FILE_THREADS 2
+
+using std::deque;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+////////////////////////////////////////////////
+//              Task                          //
+////////////////////////////////////////////////
+
+template <typename T> class Task;
+
+// Resumes whoever awaited the task. A detached task has nobody to resume and frees its own frame.
+struct task_final {
+    bool await_ready() noexcept { return false; }
+    template <typename P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> done) noexcept {
+        std::coroutine_handle<> continuation = done.promise().continuation;
+        if (continuation) {
+            return continuation;
+        }
+        if (done.promise().detached) {
+            done.destroy();
+        }
+        return std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+struct task_promise_base {
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    // Lazy: the body starts when the task is awaited or detached
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    task_final final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T> struct task_promise : task_promise_base {
+    T value;
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+};
+
+template <> struct task_promise<void> : task_promise_base {
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+// Coroutine handler result. co_await runs the task and yields what it co_returns; the frame
+// goes away with the Task, or on completion for a task that was detached.
+template <typename T = void> class Task {
+public:
+    typedef task_promise<T> promise_type;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    // Awaiting starts the task and resumes the awaiter once it finishes
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() {
+        if constexpr (!std::is_void<T>::value) {
+            return std::move(handle.promise().value);
+        }
+    }
+
+    // Starts a task nobody awaits, it runs until its first suspension right away
+    void Detach() {
+        std::coroutine_handle<promise_type> started = handle;
+        handle = nullptr;
+        started.promise().detached = true;
+        started.resume();
+    }
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T> Task<T> task_promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<task_promise<T> >::from_promise(*this));
+}
+
+inline Task<void> task_promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<task_promise<void> >::from_promise(*this));
+}
+
+////////////////////////////////////////////////
+//              Reactor                       //
+////////////////////////////////////////////////
+
+class Reactor;
+
+// co_await reactor.Readable(fd, ms): true once the descriptor is ready, false on timeout
+struct fd_awaiter {
+    Reactor* reactor;
+    int fd;
+    unsigned events;
+    int timeout;
+    bool ready;
+
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() { return ready; }
+};
+
+// co_await reactor.Sleep(ms)
+struct sleep_awaiter {
+    Reactor* reactor;
+    int timeout;
+
+    bool await_ready() { return timeout <= 0; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() {}
+};
+
+// A pread handed to the reactor's file threads
+struct file_read {
+    int file;
+    off_t offset;
+    size_t length;
+    string* out;
+    size_t position;        // where in out the bytes go
+    ssize_t result;
+    std::coroutine_handle<> handle;
+};
+
+// co_await reactor.ReadFile(...): bytes read into out, -1 on error. Data already in the page
+// cache is read in place, anything else by a file thread so a cold disk never stalls the loop.
+struct file_awaiter {
+    Reactor* reactor;
+    file_read job;
+    size_t done;
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> handle);
+    ssize_t await_resume();
+};
+
+struct reactor_waiter {
+    std::coroutine_handle<> handle;
+    bool* ready;
+    unsigned long sequence;
+};
+
+struct reactor_timer {
+    long long deadline;         // monotonic milliseconds
+    unsigned long sequence;     // of the descriptor wait it bounds, 0 for a plain sleep
+    int fd;
+    std::coroutine_handle<> handle;
+
+    bool operator>(const reactor_timer& other) const { return deadline > other.deadline; }
+};
+
+// Drives coroutines from an evented loop's epoll set. The loop hands every event to Dispatch
+// first, sleeps no longer than NextTimeout, and calls Expire once per iteration. Descriptors
+// waited on here must not be registered by the loop itself.
+class Reactor {
+private:
+    int epoll;
+    int notify;
+    unsigned long sequence;
+    unordered_map<int, reactor_waiter> waiters;
+    std::priority_queue<reactor_timer, vector<reactor_timer>, std::greater<reactor_timer> > timers;
+
+    // File threads, woken by a condition and reporting back through the notify eventfd
+    pthread_t threads[REACTOR_FILE_THREADS];
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    deque<file_read*> queued;
+    vector<file_read*> completed;
+    bool stopping;
+
+    static void* ReadFiles(void* arg);
+public:
+    // Constructor/Destructor
+    Reactor();
+    ~Reactor();
+
+    // Joins a loop's epoll set, false leaves the reactor detached and callers on their blocking paths
+    bool Attach(int epoll);
+    void Detach();
+    bool is_attached() const { return epoll >= 0; }
+
+    // Loop side: resumes the coroutine waiting on fd, false when fd isn't the reactor's
+    bool Dispatch(int fd);
+    int NextTimeout(int fallback);
+    void Expire();
+
+    // Awaitables
+    fd_awaiter Readable(int fd, int timeout);
+    fd_awaiter Writable(int fd, int timeout);
+    sleep_awaiter Sleep(int timeout);
+    file_awaiter ReadFile(int file, off_t offset, size_t length, string& out);
+
+    // Socket I/O that never blocks the loop, whatever the socket's own mode. Recv returns like
+    // recv (-1 with ETIMEDOUT on timeout), Send writes everything or fails.
+    Task<ssize_t> Recv(int fd, char* buffer, size_t length, int timeout);
+    Task<bool> Send(int fd, const char* buffer, size_t length, int timeout);
+
+    // Used by the awaitables, Wait returns false when fd can't be polled
+    bool Wait(int fd, unsigned events, int timeout, std::coroutine_handle<> handle, bool* ready);
+    void After(int timeout, std::coroutine_handle<> handle);
+    void Submit(file_read* job);
+};
+
+#endif
+
+// End of header
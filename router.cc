@@ -0,0 +1,161 @@
+#include <cstring>
+#include <map>
+#include "router.h"
+
+using std::map;
+
+////////////////////////////////////////////////
+//              Trie Construction             //
+////////////////////////////////////////////////
+
+// Pointer-based trie only used while building, then flattened
+struct build_node {
+    string label;
+    map<char, build_node*> children;
+    int exact;
+    int prefix;
+
+    build_node(string label) {
+        this->label = label;
+        exact = -1;
+        prefix = -1;
+    }
+    ~build_node() {
+        for (auto child = children.begin(); child != children.end(); child++) {
+            delete child->second;
+        }
+    }
+};
+
+static void insertRoute(build_node* node, const string& uri, size_t index, int routeindex, bool exact) {
+    // Walk down, splitting edges where the URI diverges from a label
+    while (index < uri.length()) {
+        auto found = node->children.find(uri[index]);
+        if (found == node->children.end()) {
+            build_node* leaf = new build_node(uri.substr(index));
+            node->children[uri[index]] = leaf;
+            node = leaf;
+            index = uri.length();
+            break;
+        }
+        build_node* child = found->second;
+        size_t common = 0;
+        while (common < child->label.length() && index + common < uri.length() && child->label[common] == uri[index + common]) {
+            common++;
+        }
+        if (common < child->label.length()) {
+            // Split the edge at the divergence point
+            build_node* split = new build_node(child->label.substr(0, common));
+            child->label = child->label.substr(common);
+            split->children[child->label[0]] = child;
+            node->children[uri[index]] = split;
+            child = split;
+        }
+        node = child;
+        index += common;
+    }
+    if (exact) {
+        node->exact = routeindex;
+    } else {
+        node->prefix = routeindex;
+    }
+}
+
+////////////////////////////////////////////////
+//              RouteTable                    //
+////////////////////////////////////////////////
+bool RouteTable::Build(const vector<route>& table) {
+    build_node root("");
+    vector<build_node*> queue;
+
+    for (size_t i = 0; i < table.size(); i++) {
+        if (table[i].uri.empty() || table[i].uri[0] != '/' || table[i].handler == INVALID_HANDLER) {
+            return false;
+        }
+        insertRoute(&root, table[i].uri, 0, i, table[i].exact);
+    }
+
+    // Flatten breadth first so every node's children are contiguous
+    nodes.clear();
+    childlist.clear();
+    firstbytes.clear();
+    labels = "";
+    routes = table;
+    queue.push_back(&root);
+    for (size_t head = 0; head < queue.size(); head++) {
+        build_node* node = queue[head];
+        trie_node flat;
+        flat.label = labels.length();
+        flat.labellength = node->label.length();
+        flat.childcount = node->children.size();
+        flat.children = childlist.size();
+        flat.exact = node->exact;
+        flat.prefix = node->prefix;
+        labels += node->label;
+        for (auto child = node->children.begin(); child != node->children.end(); child++) {
+            childlist.push_back(queue.size());
+            firstbytes.push_back(child->first);
+            queue.push_back(child->second);
+        }
+        nodes.push_back(flat);
+    }
+    return true;
+}
+
+const route* RouteTable::Lookup(const char* uri, size_t length) const {
+    const route* best = NULL;
+    size_t index = 0;
+    uint32_t current = 0;
+
+    if (nodes.empty()) {
+        return NULL;
+    }
+
+    // Each URI byte is compared at most once
+    while (true) {
+        const trie_node& node = nodes[current];
+        if (node.prefix >= 0) {
+            best = &routes[node.prefix];
+        }
+        if (index == length) {
+            return node.exact >= 0 ? &routes[node.exact] : best;
+        }
+
+        // Pick the child edge starting with the next byte
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < node.childcount; i++) {
+            if (firstbytes[node.children + i] == uri[index]) {
+                next = childlist[node.children + i];
+                break;
+            }
+        }
+        if (next == 0) {
+            return best;
+        }
+
+        // Routes end on node boundaries, a partial edge match falls back to the best prefix
+        const trie_node& child = nodes[next];
+        if (length - index < child.labellength || memcmp(labels.data() + child.label, uri + index, child.labellength) != 0) {
+            return best;
+        }
+        index += child.labellength;
+        current = next;
+    }
+}
+
+route_handler_t GetRouteHandler(const string& name) {
+    if (name.compare("static") == 0) {
+        return STATIC_HANDLER;
+    } else if (name.compare("php") == 0) {
+        return PHP_HANDLER;
+    } else if (name.compare("redirect") == 0) {
+        return REDIRECT_HANDLER;
+    } else if (name.compare("proxy") == 0) {
+        return PROXY_HANDLER;
+    } else if (name.compare("metrics") == 0) {
+        return METRICS_HANDLER;
+    }
+    return INVALID_HANDLER;
+}
+
+// End of file
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+enum route_handler_t {
+    INVALID_HANDLER = -1, STATIC_HANDLER, PHP_HANDLER, REDIRECT_HANDLER, PROXY_HANDLER, METRICS_HANDLER,
+};
+
+struct route {
+    // Matched URI, either exactly or as a prefix
+    string uri;
+    bool exact;
+
+    // Handler and its argument: document root, redirect location or upstream list
+    route_handler_t handler;
+    string target;
+
+    // Per-route policy
+    bool cache;
+    bool gzip;
+    int maxage;
+
+    // PHP output micro-cache, seconds fresh and then served stale while one request refreshes
+    int microcache;
+    int stale;
+};
+
+// Compiled radix trie. Nodes, child links and edge labels live in three flat
+// arrays, so a lookup walks the URI once and never allocates.
+class RouteTable {
+private:
+    struct trie_node {
+        uint32_t label;       // offset of the edge label in labels
+        uint16_t labellength;
+        uint16_t childcount;
+        uint32_t children;    // index of the first child in childlist
+        int32_t exact;        // route index, -1 for none
+        int32_t prefix;       // route index, -1 for none
+    };
+    vector<trie_node> nodes;
+    vector<uint32_t> childlist;
+    vector<char> firstbytes;
+    string labels;
+    vector<route> routes;
+public:
+    // Compiles the table, later routes for the same URI replace earlier ones
+    bool Build(const vector<route>& table);
+
+    // Longest match: an exact route for the full URI wins over any prefix route
+    const route* Lookup(const char* uri, size_t length) const;
+    size_t size() const { return routes.size(); }
+    const route* at(size_t index) const { return &routes[index]; }
+};
+
+route_handler_t GetRouteHandler(const string& name);
+
+#endif
+
+// End of header
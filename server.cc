@@ -6,10 +6,20 @@
 #include <ctime>
 #include <iostream>
 #include <sstream>
+#include <csignal>
 #include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include "PH7/ph7.h"
 #include "http.h"
 #include "server.h"
+#include "uri.h"
 
 using std::cerr;
 using std::cout;
@@ -40,136 +50,246 @@ void handleSigchld(int signum) {
     while (waitpid(-1, &status, WNOHANG) == 0);
 }
 
-////////////////////////////////////////////////
-//              Misc Helpers                  //
-////////////////////////////////////////////////
-
-// Hex to ASCII helper, used for parsing URIs
-char hexToAscii(string hex) {
-    int ascii = 0;
-    int num;
-    if (isalpha(hex[0])) {
-        num = 16 * (hex[0] - 55);
-    } else {
-        num = 16 * (hex[0] - 48);
-    }
-    ascii += num;
-
-    if (isalpha(hex[1])) {
-        num = hex[1] - 55;
-    } else {
-        num = hex[1] - 48;
-    }
-    ascii += num;
-    return (char) ascii;
-}
-
 ////////////////////////////////////////////////
 //              SocketServer                  //
 ////////////////////////////////////////////////
 
 SocketServer::SocketServer() {
-    int error = 0;
-    int flags = 0;
-
     // Zero initialize buffers and socket addresses
     memset(recvbuf, (char) NULL, sizeof(recvbuf));
     memset(peername, (char) NULL, sizeof(peername));
-    memset(&serveraddr, (char) NULL, sizeof(serveraddr));
     memset(&clientaddr, (char) NULL, sizeof(clientaddr));
 
+    // Sockets are bound by ListenHttp/ListenTls, so a server can exist without owning a port
+    listening = -1;
+    tlslistening = -1;
+    options = DefaultSocketOptions();
+}
+
+int SocketServer::Listen(int port, bool shared) {
+    struct sockaddr_in serveraddr;
+    struct sockaddr_in6 serveraddr6;
+    int error = 0;
+    int flags = 0;
+
     // Create a socket and bind to our host address
-    listening = socket(AF_INET, SOCK_STREAM, 0);
-    if (listening < 0) {
+    int fd = socket(options.ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
         perror("socket");
-        close(listening);
+        close(fd);
         exit(EXIT_FAILURE);
     }
 
-    // Set socket reuse and non-blocking options
-    setsockopt(listening, SOL_SOCKET, SO_REUSEADDR, NULL, 0);
-    flags = fcntl(listening, F_GETFL, 0);
-    fcntl(listening, F_SETFL, flags | O_NONBLOCK);
-
-    // Server socket information
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serveraddr.sin_port = htons(PORT);
-
-    // Bind socket to a local address
-    error = bind(listening, (const struct sockaddr *) &serveraddr, sizeof(serveraddr));
+    // Set socket reuse, tuning and non-blocking options
+    if (!TuneListener(fd, options)) {
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+    if (shared) {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    }
+    flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    // Bind socket to the wildcard address, [::] also takes IPv4 when dual-stack
+    if (options.ipv6) {
+        memset(&serveraddr6, 0, sizeof(serveraddr6));
+        serveraddr6.sin6_family = AF_INET6;
+        serveraddr6.sin6_addr = in6addr_any;
+        serveraddr6.sin6_port = htons(port);
+        error = bind(fd, (const struct sockaddr *) &serveraddr6, sizeof(serveraddr6));
+    } else {
+        memset(&serveraddr, 0, sizeof(serveraddr));
+        serveraddr.sin_family = AF_INET;
+        serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        serveraddr.sin_port = htons(port);
+        error = bind(fd, (const struct sockaddr *) &serveraddr, sizeof(serveraddr));
+    }
     if (error < 0) {
         perror("bind");
-        close(listening);
+        close(fd);
         exit(EXIT_FAILURE);
     }
 
     // Listen for connections
-    error = listen(listening, BACKLOG);
+    error = listen(fd, options.backlog);
     if (error < 0) {
         perror("listen");
-        close(listening);
+        close(fd);
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
+
+void SocketServer::ListenHttp(int port) {
+    listening = Listen(port);
+}
+
+void SocketServer::ListenTls(int port) {
+    tlslistening = Listen(port);
 }
 
 SocketServer::~SocketServer() {
-    // Close listening socket 
-    close(listening);
+    // Close listening sockets
+    if (listening >= 0) {
+        close(listening);
+    }
+    if (tlslistening >= 0) {
+        close(tlslistening);
+    }
 }
 
-std::pair<int, string> SocketServer::Connect() {
+std::pair<int, string> SocketServer::Connect(int flags, bool tls) {
     // Accept any incoming connections
-    socklen_t length = sizeof(clientaddr);
-    int error = 0;
-    int connection = accept(listening, NULL, NULL);
+    int connection = accept4(tls ? tlslistening : listening, NULL, NULL, flags);
     string peer = "";
 
     if (connection > 0) {
-        // Get connecting client's network info
-        error = getpeername(connection, (struct sockaddr *)&clientaddr, &length);
-        if (error < 0) {
-            perror("getpeername");
-            memset(peername, (char) NULL, sizeof(peername));
+        Tune(connection);
+        peer = PeerName(connection);
+    }
+    return make_pair(connection, peer);
+}
+
+string SocketServer::PeerName(int connection) {
+    // Get connecting client's network info
+    socklen_t length = sizeof(clientaddr);
+    int error = getpeername(connection, (struct sockaddr *)&clientaddr, &length);
+    if (error < 0) {
+        perror("getpeername");
+        memset(peername, (char) NULL, sizeof(peername));
+        return "";
+    }
+
+    // Mapped IPv4 addresses from a dual-stack listener read as plain IPv4
+    if (clientaddr.ss_family == AF_INET6) {
+        struct sockaddr_in6* address = (struct sockaddr_in6*) &clientaddr;
+        if (IN6_IS_ADDR_V4MAPPED(&address->sin6_addr)) {
+            inet_ntop(AF_INET, &address->sin6_addr.s6_addr[12], peername, sizeof(peername));
         } else {
-            inet_ntop(AF_INET, &(clientaddr.sin_addr), peername, length);
-            peer = string(peername);
+            inet_ntop(AF_INET6, &address->sin6_addr, peername, sizeof(peername));
         }
+    } else {
+        inet_ntop(AF_INET, &((struct sockaddr_in*) &clientaddr)->sin_addr, peername, sizeof(peername));
     }
-    return make_pair(connection, peer);
+    return string(peername);
 }
 
-bool SocketServer::Receive(bool verbose, pair<int, string> client) {
+void SocketServer::Cork(int connection, bool cork) {
+    if (options.cork) {
+        CorkConnection(connection, cork);
+    }
+}
+
+int SocketServer::Receive(bool verbose, pair<int, string> client, string& input, int timeout) {
+    struct pollfd wait = { client.first, POLLIN, 0 };
+    char buffer[BUFFER_LENGTH];
+
+    // Wait no longer than the caller's deadline allows, -1 with ETIMEDOUT when it passes
+    int ready = poll(&wait, 1, timeout);
+    if (ready == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    } else if (ready < 0) {
+        return -1;
+    }
+
+    // Receive bytes from client connection onto whatever is already buffered
+    int count = recv(client.first, buffer, sizeof(buffer), 0);
+    if (count <= 0) {
+        return count;
+    }
+    input.append(buffer, count);
+    if (verbose) {
+        cout << "Received " << count << " bytes from " << client.second << ":\n";
+        cout << string(buffer, count) << endl;
+    }
+    return count;
+}
+
+int SocketServer::ReceiveNonBlocking(bool verbose, pair<int, string> client) {
     int connection = client.first;
     string peer = client.second;
 
-    // Receive bytes from client connection
+    // Receive whatever is available, -1 with EAGAIN means drained
     int count = recv(connection, recvbuf, BUFFER_LENGTH, 0);
     if (count <= 0) {
-        return false;
+        return count;
     }
-    
+
     // Logging and NULL termination
     recvbuf[count] = (char) NULL;
     if (verbose) {
         cout << "Received " << count << " bytes from " << peer << ":\n";
         cout << recvbuf << endl;
     }
-    return true;
+    return count;
+}
+
+int SocketServer::ReceiveTls(bool verbose, pair<int, string> client, SSL* ssl) {
+    string peer = client.second;
+
+    // Decrypted bytes, -1 with EAGAIN once OpenSSL needs more from the socket
+    int count = TlsRead(ssl, recvbuf, BUFFER_LENGTH);
+    if (count <= 0) {
+        return count;
+    }
+
+    // Logging and NULL termination
+    recvbuf[count] = (char) NULL;
+    if (verbose) {
+        cout << "Received " << count << " bytes over TLS from " << peer << ":\n";
+        cout << recvbuf << endl;
+    }
+    return count;
 }
 
 bool SocketServer::SendResponse(string buffer, int connection) {
     // Send buffer over socket, no need for NULL termination
-    int count = send(connection, buffer.c_str(), buffer.length() - 1, 0);
+    int count = send(connection, buffer.c_str(), buffer.length(), 0);
     if (count < 0) {
         perror("send");
         return false;
     }
+    TRACE_RESPONSE_SENT(connection, TraceStatus(buffer.c_str(), buffer.length()), buffer.length());
+    return true;
+}
+
+bool SocketServer::SendResponse(string header, const char* body, size_t length, int connection) {
+    struct iovec iov[2];
+    ssize_t count;
+
+    // Header and body leave in a single writev, the body is never copied
+    iov[0].iov_base = (void*) header.c_str();
+    iov[0].iov_len = header.length();
+    iov[1].iov_base = (void*) body;
+    iov[1].iov_len = length;
+
+    // Corked, a body too large for one writev doesn't end each call in a short segment
+    Cork(connection, true);
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        count = writev(connection, iov, 2);
+        if (count < 0) {
+            perror("writev");
+            Cork(connection, false);
+            return false;
+        }
+        for (int i = 0; i < 2; i++) {
+            size_t step = (size_t) count < iov[i].iov_len ? count : iov[i].iov_len;
+            iov[i].iov_base = (char*) iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            count -= step;
+        }
+    }
+    Cork(connection, false);
+    TRACE_RESPONSE_SENT(connection, TraceStatus(header.c_str(), header.length()), header.length() + length);
     return true;
 }
 
 bool SocketServer::Close(int connection) {
     // Close connection specified by file descriptor
+    TRACE_CLOSE(connection);
     int error = close(connection);
     if (error < 0) {
         perror("close");
@@ -181,208 +301,2169 @@ bool SocketServer::Close(int connection) {
 ////////////////////////////////////////////////
 //              HttpServer                    //
 ////////////////////////////////////////////////
-HttpServer::HttpServer() { elapsedtime = 0.0; }
+HttpServer::HttpServer() {
+    clients = DefaultClientLimits();
+    tlsport = TLS_PORT;
+    evented = NULL;
+    serials = 0;
+    lastreclaim = 0;
+
+    // Shared anonymous mapping survives fork, so children count into the parent's metrics
+    metrics = (server_metrics*) mmap(NULL, sizeof(server_metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metrics == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    memset(metrics, 0, sizeof(server_metrics));
+
+    // Default routes until Configure is called
+    Configure(ServerConfig());
+}
 
 HttpServer::~HttpServer() {
-    // Clean up allocated memory from cache
-    while (!cache.empty()) {
-        HttpRequest* request = cache.back().first;
-        delete request;
-        cache.pop_back();
+    for (auto item = upstreams.begin(); item != upstreams.end(); item++) {
+        delete item->second;
     }
+    munmap(metrics, sizeof(server_metrics));
 }
 
-void HttpServer::Run(server_type type, bool verbose) {
-    // Add signal handlers
-    signal(SIGINT, handleSigint);
-    signal(SIGCHLD, handleSigchld);
+bool HttpServer::Configure(const ServerConfig& config) {
+    // Compile routes once, lookups afterwards never allocate
+    if (!routes.Build(config.routes)) {
+        cout << "Invalid route table\n";
+        return false;
+    }
 
-    // Run with flag options
-    if (type == MPROCESS) {
-        RunMultiProcessed(verbose);
-    } else if (type == MTHREADED) {
-        RunMultiThreaded(verbose);
-    } else if (type == EVENTED) {
-        RunEvented(verbose);
+    // One upstream pool per proxy route, keyed by the compiled route
+    for (auto item = upstreams.begin(); item != upstreams.end(); item++) {
+        delete item->second;
+    }
+    upstreams.clear();
+    for (size_t i = 0; i < routes.size(); i++) {
+        const route* proxied = routes.at(i);
+        if (proxied->handler != PROXY_HANDLER) {
+            continue;
+        }
+        UpstreamPool* pool = new UpstreamPool;
+        upstreams[proxied] = pool;
+        if (!pool->Parse(proxied->target)) {
+            cout << "Invalid upstreams for " << proxied->uri << "\n";
+            return false;
+        }
     }
+    admission.Configure(config.limits);
+    clients = config.clients;
+    server.Configure(config.sockets);
+    memory = config.memory;
+    buffers.Configure(memory.pool, &metrics->poolbytes);
+    return true;
 }
 
-void HttpServer::RunMultiProcessed(bool verbose) {
-    pid_t pid;
-    pair<int, string> client;
-    int connection;
+bool HttpServer::AdmitConnection(pair<int, string> client, bool worker) {
+    HttpRequest request;
+    char discard[BUFFER_LENGTH];
+    http_status_t status;
+
+    // Every backend admits its connections here
+    TRACE_ACCEPT(client.first, client.second.c_str());
+
+    // Over the per-client cap is the client's problem (429), out of workers is ours (503)
+    if (!admission.Open(client.second)) {
+        Count(metrics->clientrejects);
+        status = TOO_MANY_REQUESTS;
+    } else if (worker && !admission.Begin()) {
+        admission.Close(client.second);
+        Count(metrics->shed);
+        status = SERVICE_UNAVAILABLE;
+    } else if (!worker && OverBudget()) {
+        admission.Close(client.second);
+        Count(metrics->memoryrejects);
+        status = SERVICE_UNAVAILABLE;
+    } else {
+        return true;
+    }
+
+    // Reading what already arrived keeps close() from resetting the connection before the answer is read
+    while (recv(client.first, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    string response = HandleOverload(request, status);
+    send(client.first, response.c_str(), response.length(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(client.first, SHUT_WR);
+    server.Close(client.first);
+    return false;
+}
+
+void HttpServer::ReleaseConnection(const string& peer, bool worker) {
+    admission.Close(peer);
+    if (worker) {
+        admission.End();
+    }
+}
+
+bool HttpServer::Throttled(HttpRequest& request, const string& peer, string& response) {
+    // One token per request, an empty bucket answers 429 without touching the handler
+    if (admission.Allow(peer)) {
+        return false;
+    }
+    Count(metrics->ratelimited);
+    response = HandleOverload(request, TOO_MANY_REQUESTS);
+    return true;
+}
+
+bool HttpServer::ShedEvented(HttpRequest& request, evented_connection& conn, string& response) {
+    if (Throttled(request, conn.client.second, response)) {
+        return true;
+    }
+
+    // A connection with responses still queued already holds its in-flight slot
+    if (!conn.busy) {
+        if (!admission.Begin()) {
+            Count(metrics->shed);
+            response = HandleOverload(request, SERVICE_UNAVAILABLE);
+            return true;
+        }
+        conn.busy = true;
+    }
+    return false;
+}
+
+void HttpServer::SettleEvented(evented_connection& conn) {
+    // The slot is returned once everything queued has been written and no stream is still being answered
+    if (conn.busy && conn.pending.empty() && conn.streams == 0) {
+        admission.End();
+        conn.busy = false;
+    }
+}
+
+string HttpServer::HandleOverload(HttpRequest& request, http_status_t status) {
+    string extra = RETRY_AFTER;
+    extra += std::to_string(RETRY_AFTER_SECONDS);
+    extra += CRLF;
+    return CreateResponseString(request, "", "", status, extra);
+}
+
+frame_t HttpServer::ReceiveRequest(bool verbose, pair<int, string> client, uint32_t captured, string& input, read_deadline& reading, long long idleuntil, size_t& head, size_t& total) {
+    long long now;
+    long long wait;
+    int count;
+
+    while (true) {
+        frame_t frame = FrameRequest(input, clients, head, total);
+        if (frame != FRAME_PARTIAL) {
+            return frame;
+        }
+
+        // Between requests only the keep-alive window counts, once bytes arrive the request's deadline does
+        now = MonotonicMs();
+        TrackRead(reading, input.empty() ? READ_IDLE : head == 0 ? READ_HEAD : READ_BODY, input.length() - head, clients, now);
+        if (reading.phase == READ_IDLE) {
+            wait = idleuntil - now;
+            if (wait <= 0) {
+                return FRAME_CLOSED;
+            }
+        } else if (ReadExpired(reading, clients, now)) {
+            return FRAME_TIMEOUT;
+        } else {
+            wait = NextCheck(reading, clients, now) - now;
+        }
+
+        count = server.Receive(verbose, client, input, (int) wait);
+        if (count == 0 || (count < 0 && errno != ETIMEDOUT && errno != EINTR)) {
+            return FRAME_CLOSED;
+        }
+        if (count > 0) {
+            capture.Record(captured, input.c_str() + input.length() - count, count);
+        }
+    }
+}
+
+string HttpServer::RejectRequest(frame_t frame, const string& input, size_t head) {
+    HttpRequest request;
+    http_status_t status;
+    string extra = CONNECTION_CLOSE;
+    extra += CRLF;
+
+    // A complete head is parsed so the answer matches its version, the connection closes after it either way
+    if (head > 0) {
+        ParseRequest(request, false, input.substr(0, head).c_str());
+    }
+    if (frame == FRAME_BODY_TOO_LARGE) {
+        Count(metrics->oversized);
+        request.set_flag(true);
+        status = REQUEST_ENTITY_TOO_LARGE;
+    } else if (frame == FRAME_HEADER_TOO_LARGE) {
+        Count(metrics->oversized);
+        status = REQUEST_HEADER_FIELDS_TOO_LARGE;
+    } else if (frame == FRAME_TIMEOUT) {
+        Count(metrics->readtimeouts);
+        status = REQUEST_TIMEOUT;
+    } else if (frame == FRAME_UNSUPPORTED) {
+        status = NOT_IMPLEMENTED;
+    } else {
+        status = BAD_REQUEST;
+    }
+    return CreateResponseString(request, "", "", status, extra);
+}
+
+void HttpServer::RejectEvented(evented_connection& conn, frame_t frame, size_t head) {
+    response_segment segment;
+
+    // Queued behind any earlier responses, whatever else the client sent is dropped
+    segment.data = RejectRequest(frame, conn.inbuf, head);
+    segment.file = -1;
+    segment.mapped = NULL;
+    segment.ticket = 0;
+    conn.pending.push_back(segment);
+    conn.inbuf.clear();
+    conn.draining = true;
+    TrackRead(conn.reading, READ_IDLE, 0, clients, 0);
+}
+
+void HttpServer::ArmEvented(evented_connection& conn) {
+    // One live wheel entry per connection, a phase change leaves the old one stale
+    if (conn.reading.phase == READ_IDLE || conn.reading.armed != 0) {
+        return;
+    }
+    conn.reading.armed = NextCheck(conn.reading, clients, MonotonicMs());
+    deadlines.Schedule(conn.client.first, conn.serial, conn.reading.armed);
+}
+
+void HttpServer::ExpireEvented(unordered_map<int, evented_connection>& connections, vector<int>& expired) {
+    vector<timer_entry> due;
+    long long now = MonotonicMs();
+    size_t head;
+    size_t total;
+
+    deadlines.Expire(now, due);
+    for (size_t i = 0; i < due.size(); i++) {
+        auto item = connections.find(due[i].fd);
+        if (item == connections.end() || item->second.serial != due[i].serial || item->second.reading.armed != due[i].when ||
+            item->second.h2 != NULL) {
+            continue;
+        }
+
+        // Checked early for the rate, a client that kept up gets the entry back
+        evented_connection& conn = item->second;
+        conn.reading.armed = 0;
+        if (ReadExpired(conn.reading, clients, now)) {
+            FrameRequest(conn.inbuf, clients, head, total);
+            RejectEvented(conn, FRAME_TIMEOUT, head);
+            expired.push_back(due[i].fd);
+        } else {
+            ArmEvented(conn);
+        }
+    }
+}
+
+void HttpServer::ChargeEvented(evented_connection& conn) {
+    size_t bytes = sizeof(evented_connection) + QUEUE_BYTES + HeapBytes(conn.client.second) + HeapBytes(conn.inbuf) + HeapBytes(conn.chunk);
+
+    // Queued responses, and a rough size for protocol state kept outside the connection
+    for (auto item = conn.pending.begin(); item != conn.pending.end(); item++) {
+        bytes += sizeof(response_segment) + HeapBytes(item->data);
+    }
+    if (conn.h2 != NULL) {
+        bytes += sizeof(Http2Session) + 2 * HPACK_TABLE_SIZE;
+    }
+    if (conn.tls != NULL) {
+        bytes += TLS_SESSION_BYTES;
+    }
+
+    // Deltas keep the shared gauges right however workers interleave
+    if (conn.charged == 0) {
+        __sync_add_and_fetch(&metrics->memoryconnections, 1);
+    }
+    __sync_add_and_fetch(&metrics->memorybytes, bytes);
+    __sync_sub_and_fetch(&metrics->memorybytes, conn.charged);
+    conn.charged = bytes;
+}
+
+void HttpServer::IdleEvented(evented_connection& conn) {
+    // Between requests the read buffer goes back to the pool, the file chunk once no file is being sent
+    buffers.Release(conn.inbuf);
+    if (!conn.sending && (conn.pending.empty() || conn.pending.front().file < 0)) {
+        conn.chunk.clear();
+        buffers.Release(conn.chunk);
+    }
+    ChargeEvented(conn);
+}
+
+bool HttpServer::OverBudget() {
+    if (memory.budget == 0) {
+        return false;
+    }
+
+    // A new connection costs its bookkeeping and a read buffer, free buffers of this worker go first
+    size_t needed = sizeof(evented_connection) + QUEUE_BYTES + BUFFER_LENGTH + 1;
+    if (metrics->memorybytes + metrics->poolbytes + needed > memory.budget) {
+        buffers.Trim(0);
+    }
+    return metrics->memorybytes + metrics->poolbytes + needed > memory.budget;
+}
+
+bool HttpServer::ReclaimEvented(unordered_map<int, evented_connection>& connections, vector<int>& victims, time_t now) {
+    vector<pair<time_t, int> > idle;
+
+    if (difftime(now, lastreclaim) < 1) {
+        return false;
+    }
+    lastreclaim = now;
+
+    // Keep-alive connections waiting for a request, least recently active first, until the
+    // footprint would drop under the low mark
+    for (auto item = connections.begin(); item != connections.end(); item++) {
+        evented_connection& conn = item->second;
+        if (conn.pending.empty() && conn.inbuf.empty() && conn.reading.phase == READ_IDLE && !conn.busy &&
+            !conn.handshaking && !conn.sending && !conn.closing && !conn.draining) {
+            idle.push_back(make_pair(conn.lastactive, item->first));
+        }
+    }
+    sort(idle.begin(), idle.end());
+
+    size_t used = metrics->memorybytes + metrics->poolbytes;
+    size_t low = memory.budget * MEMORY_LOW_MARK;
+    for (size_t i = 0; i < idle.size() && used > low; i++) {
+        used -= std::min(used, connections[idle[i].second].charged);
+        victims.push_back(idle[i].second);
+        Count(metrics->memoryshed);
+    }
+    return !victims.empty();
+}
+
+void HttpServer::ResolveRoute(HttpRequest& request) {
+    string uri = request.get_path();
+    const route* matched = routes.Lookup(uri.c_str(), uri.length());
+    request.set_uri(uri);
+    request.set_route(matched);
+
+    // Static and PHP routes map the URI onto their document root
+    if (matched != NULL && (matched->handler == STATIC_HANDLER || matched->handler == PHP_HANDLER)) {
+        request.set_path(matched->target + uri);
+        if (matched->handler == PHP_HANDLER) {
+            request.set_content_type(APP_PHP);
+        }
+    }
+}
+
+bool HttpServer::LoadPack(const char* filename) {
+    // Map the pack before any fork so every worker shares it
+    return pack.Open(filename);
+}
+
+bool HttpServer::EnableTls(const char* certificate, const char* key, int port) {
+    // Bound in Run, like the plain listener
+    if (!tls.Initialize(certificate, key)) {
+        return false;
+    }
+    tlsport = port;
+    return true;
+}
+
+bool HttpServer::EnableCapture(const char* filename) {
+    // Opened before any fork, so every worker appends to the same file
+    if (!capture.Start(filename)) {
+        cout << "Cannot capture to " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Everything Equals compares, responses don't vary on headers
+static string cacheKey(HttpRequest& request) {
+    return std::to_string(request.get_method()) + " " + std::to_string(request.get_version()) + " " + request.get_path() + "?" + request.get_query();
+}
+
+bool HttpServer::IsCacheable(HttpRequest& request) {
+    const route* matched = request.get_route();
+
+    // Proxied, metrics and micro-cached routes have their own freshness
+    if (matched == NULL || !matched->cache || matched->handler == PROXY_HANDLER || matched->handler == METRICS_HANDLER || matched->microcache > 0) {
+        return false;
+    }
+    return request.get_method() == GET && request.get_version() != INVALID_VERSION && !request.get_flag() && !request.get_malformed();
+}
+
+string HttpServer::HandleRequestCached(HttpRequest& request, bool verbose, const string& peer) {
+    string response = "";
+
+    if (!IsCacheable(request)) {
+        return HandleRequest(request, verbose, peer);
+    }
+
+    // Lock free, whichever worker stored the response
     if (verbose) {
-        cout << "Server starting...\n\n";
+        cout << "Searching cache...\n";
+    }
+    if (cache.Lookup(cacheKey(request), response)) {
+        Count(metrics->cachehits);
+        TRACE_CACHE_HIT(request.get_connection(), request.get_path().c_str(), response.length(), TRACE_CACHE_RESPONSE);
+        if (verbose) {
+            cout << "Serving from cache\n\n";
+            cout << endl << "Response: " << response << endl << endl;
+        }
+        return response;
     }
 
-    // Event loop
-    while (running) {
+    // Not found, create a new response
+    if (verbose) {
+        cout << "Not found in cache.\n";
+    }
+    Count(metrics->cachemisses);
+    TRACE_CACHE_MISS(request.get_connection(), request.get_path().c_str(), TRACE_CACHE_RESPONSE);
+    response = HandleRequest(request, verbose, peer);
+    CacheResponse(request, response);
+    return response;
+}
 
-        // Wait for a connection
-        client = server.Connect();
-        connection = client.first;
-        if (connection > 0) {
-            // Fork a new server process to handle client connection
-            pid = fork();
-            if (pid < 0) {
-                // Error 
-                perror("fork");
+void HttpServer::CacheResponse(HttpRequest& request, const string& response) {
+    const string& version = versions[request.get_version()];
+
+    // Successful responses only, a missing file may turn up later. Routes' maxage bounds the copy too.
+    if (!IsCacheable(request) || response.length() <= version.length() ||
+        response.compare(version.length() + 1, statuses[OK].length(), statuses[OK]) != 0) {
+        return;
+    }
+    cache.Store(cacheKey(request), response, request.get_route()->maxage >= 0 ? request.get_route()->maxage : CACHE_TTL);
+}
+
+bool HttpServer::SetPlacement(const char* cpus, bool numa, bool steer) {
+    if (!placement.Configure(cpus, numa, steer)) {
+        cout << "Invalid CPU list " << cpus << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Whether Accept-Encoding allows gzip: listed, or covered by *, with a q above 0
+static bool acceptsGzip(const string& value) {
+    int gzip = -1;
+    int any = -1;
+    size_t start = 0;
+
+    while (start < value.length()) {
+        size_t end = value.find(',', start);
+        if (end == string::npos) {
+            end = value.length();
+        }
+        string coding = value.substr(start, end - start);
+        size_t semicolon = coding.find(';');
+        string name = coding.substr(0, semicolon);
+        name.erase(0, name.find_first_not_of(" \t"));
+        name.erase(name.find_last_not_of(" \t") + 1);
+
+        // q=0 refuses a coding, any other weight accepts it
+        bool accepted = true;
+        size_t quality = semicolon == string::npos ? string::npos : coding.find("q=", semicolon);
+        if (quality == string::npos) {
+            quality = semicolon == string::npos ? string::npos : coding.find("Q=", semicolon);
+        }
+        if (quality != string::npos) {
+            accepted = strtod(coding.c_str() + quality + 2, NULL) > 0;
+        }
+        if (strcasecmp(name.c_str(), "gzip") == 0 || strcasecmp(name.c_str(), "x-gzip") == 0) {
+            gzip = accepted;
+        } else if (name.compare("*") == 0) {
+            any = accepted;
+        }
+        start = end + 1;
+    }
+    return gzip >= 0 ? gzip == 1 : any == 1;
+}
+
+// If-None-Match: * or any listed validator, compared weakly as RFC 9110 asks for
+static bool matchesEtag(const string& value, const string& etag) {
+    size_t start = 0;
+
+    while (start < value.length()) {
+        size_t end = value.find(',', start);
+        if (end == string::npos) {
+            end = value.length();
+        }
+        string candidate = value.substr(start, end - start);
+        candidate.erase(0, candidate.find_first_not_of(" \t"));
+        candidate.erase(candidate.find_last_not_of(" \t") + 1);
+        if (candidate.compare(0, 2, "W/") == 0) {
+            candidate.erase(0, 2);
+        }
+        if (candidate.compare("*") == 0 || candidate.compare(etag) == 0) {
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+bool HttpServer::LookupPacked(HttpRequest& request, string& header, const char*& body, size_t& length) {
+    string uri = request.get_uri();
+    string extra = "";
+
+    // Pack keys are URI paths, only static routes are served from it
+    if (!pack.IsOpen() || !IsStaticGet(request)) {
+        return false;
+    }
+    const pack_entry* entry = pack.Lookup(uri.c_str(), uri.length());
+    if (entry == NULL) {
+        return false;
+    }
+    Count(metrics->packhits);
+    TRACE_CACHE_HIT(request.get_connection(), uri.c_str(), (size_t) entry->length, TRACE_CACHE_PACK);
+
+    // Prefer the precompressed variant when the client accepts gzip. Each encoding gets its
+    // own validator, so one is never revalidated with the other's ETag.
+    string etag = entry->etag;
+    bool gzip = false;
+    if (entry->gziplength > 0 && request.get_route()->gzip) {
+        extra += VARY;
+        extra += "Accept-Encoding";
+        extra += CRLF;
+        gzip = acceptsGzip(string(request.GetHeader(HEADER_ACCEPT_ENCODING)));
+    }
+    if (gzip) {
+        etag.insert(etag.length() - 1, "-gz");
+    }
+    extra += ETAG;
+    extra += etag;
+    extra += CRLF;
+
+    // Conditional GET
+    if (matchesEtag(string(request.GetHeader(HEADER_IF_NONE_MATCH)), etag)) {
+        header = CreateResponseHeader(request, 0, NOT_MODIFIED, extra);
+        body = NULL;
+        length = 0;
+        return true;
+    }
+    body = gzip ? pack.get_gzip(entry) : pack.get_data(entry);
+    length = gzip ? entry->gziplength : entry->length;
+    if (gzip) {
+        extra += CONTENT_ENCODING;
+        extra += "gzip";
+        extra += CRLF;
+    }
+    request.set_content_type(entry->mime);
+    header = CreateResponseHeader(request, length, OK, extra);
+    return true;
+}
+
+string HttpServer::BuildUpstreamRequest(HttpRequest& request, const string& peer) {
+    string copy = request.get_copy();
+    string outgoing = "";
+    string line;
+    size_t end = copy.find("\r\n\r\n");
+    stringstream lines(copy.substr(0, end));
+
+    // Request line is forwarded verbatim apart from the version, upstreams always speak HTTP/1.1
+    getline(lines, line);
+    outgoing += line.substr(0, line.rfind(' ')) + " HTTP/1.1\r\n";
+
+    // Hop-by-hop headers stay on this hop
+    while (getline(lines, line)) {
+        size_t colon = line.find(':');
+        string name = colon == string::npos ? line : line.substr(0, colon);
+        if (strcasecmp(name.c_str(), "Connection") == 0 || strcasecmp(name.c_str(), "Keep-Alive") == 0 ||
+            strcasecmp(name.c_str(), "Proxy-Connection") == 0 || strcasecmp(name.c_str(), "TE") == 0 ||
+            strcasecmp(name.c_str(), "Upgrade") == 0 || strcasecmp(name.c_str(), "Transfer-Encoding") == 0 ||
+            strcasecmp(name.c_str(), "Content-Length") == 0 || colon == string::npos) {
+            continue;
+        }
+        outgoing += line;
+        if (line[line.length() - 1] != '\r') {
+            outgoing += "\r";
+        }
+        outgoing += "\n";
+    }
+    if (!peer.empty()) {
+        outgoing += X_FORWARDED_FOR + peer + CRLF;
+    }
+    outgoing += "Connection: keep-alive\r\n\r\n";
+    return outgoing;
+}
+
+bool HttpServer::ForwardProxy(HttpRequest& request, const string& peer, upstream*& chosen, int& connection, string& head, string& rest, upstream_response& response, http_status_t& status) {
+    UpstreamPool* pool = upstreams[request.get_route()];
+    string outgoing = BuildUpstreamRequest(request, peer);
+    bool reused;
+
+    // Retry a pooled connection the upstream closed meanwhile, and fail over when a connect is refused
+    for (int attempt = 0; attempt < 3; attempt++) {
+        connection = pool->Acquire(chosen, reused);
+        if (connection < 0 && chosen == NULL) {
+            break;
+        } else if (connection < 0) {
+            continue;
+        }
+        if (reused) {
+            Count(metrics->upstreamreuses);
+        } else {
+            Count(metrics->upstreamconnects);
+        }
+        errno = 0;
+        if (send(connection, outgoing.c_str(), outgoing.length(), MSG_NOSIGNAL) == (ssize_t) outgoing.length() &&
+            ReadUpstreamHead(connection, head, rest)) {
+            if (ParseUpstreamHead(head, response)) {
+                return true;
+            }
+            pool->Release(chosen, connection, false);
+            break;
+        }
+        bool timedout = errno == EAGAIN || errno == EWOULDBLOCK;
+        pool->Release(chosen, connection, false);
+        if (timedout) {
+            Count(metrics->upstreamfailures);
+            status = GATEWAY_TIMEOUT;
+            return false;
+        }
+        if (!reused) {
+            break;
+        }
+    }
+    Count(metrics->upstreamfailures);
+    status = BAD_GATEWAY;
+    return false;
+}
+
+string HttpServer::HandleProxy(HttpRequest& request, const string& peer) {
+    UpstreamPool* pool = upstreams[request.get_route()];
+    upstream_response response;
+    upstream* chosen;
+    http_status_t status;
+    string head;
+    string body;
+    int connection;
+    bool reusable;
+
+    // Buffered relay, the whole upstream response becomes one string
+    if (!ForwardProxy(request, peer, chosen, connection, head, body, response, status)) {
+        return CreateResponseString(request, "", "", status);
+    }
+    if (!ReadUpstreamBody(connection, response, body, reusable)) {
+        pool->Release(chosen, connection, false);
+        Count(metrics->upstreamfailures);
+        return CreateResponseString(request, "", "", BAD_GATEWAY);
+    }
+    pool->Release(chosen, connection, reusable && !response.close);
+    return RewriteUpstreamHead(head, versions[request.get_version()], body.length()) + body;
+}
+
+bool HttpServer::RelayProxy(HttpRequest& request, const string& peer, int client) {
+    UpstreamPool* pool;
+    upstream_response response;
+    upstream* chosen;
+    http_status_t status;
+    string head;
+    string rest;
+    int connection;
+    int pipes[2];
+    bool reusable;
+
+    // Only GET requests on proxy routes, everything else takes the regular path
+    if (request.get_route() == NULL || request.get_route()->handler != PROXY_HANDLER || request.get_method() != GET ||
+        request.get_version() == INVALID_VERSION) {
+        return false;
+    }
+    pool = upstreams[request.get_route()];
+    if (!ForwardProxy(request, peer, chosen, connection, head, rest, response, status)) {
+        server.SendResponse(CreateResponseString(request, "", "", status), client);
+        return true;
+    }
+
+    // Chunked and close-delimited bodies need decoding first, fall back to the buffered relay
+    if (response.contentlength < 0 || pipe2(pipes, O_CLOEXEC) < 0) {
+        bool complete = ReadUpstreamBody(connection, response, rest, reusable);
+        pool->Release(chosen, connection, reusable && !response.close);
+        if (!complete) {
+            Count(metrics->upstreamfailures);
+            server.SendResponse(CreateResponseString(request, "", "", BAD_GATEWAY), client);
+            return true;
+        }
+        server.SendResponse(RewriteUpstreamHead(head, versions[request.get_version()], rest.length()) + rest, client);
+        return true;
+    }
+
+    // Headers and the bytes read along with them go out first. Bytes past the declared length
+    // are dropped, and the connection they came on isn't trusted again.
+    reusable = rest.length() <= (size_t) response.contentlength;
+    if (!reusable) {
+        rest.resize(response.contentlength);
+    }
+    size_t remaining = response.contentlength - rest.length();
+    head = RewriteUpstreamHead(head, versions[request.get_version()], response.contentlength);
+    server.SendResponse(head, rest.c_str(), rest.length(), client);
+
+    // The rest of the body moves upstream -> pipe -> client without entering user space
+    while (remaining > 0) {
+        ssize_t count = splice(connection, NULL, pipes[1], NULL, remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (count <= 0) {
+            break;
+        }
+        remaining -= count;
+        while (count > 0) {
+            ssize_t moved = splice(pipes[0], NULL, client, NULL, count, SPLICE_F_MOVE | (remaining > 0 ? SPLICE_F_MORE : 0));
+            if (moved <= 0) {
+                break;
+            }
+            count -= moved;
+        }
+        if (count > 0) {
+            break;
+        }
+    }
+    close(pipes[0]);
+    close(pipes[1]);
+
+    // A partial relay leaves the upstream connection mid-response, and the client without its body
+    pool->Release(chosen, connection, remaining == 0 && reusable && !response.close);
+    if (remaining > 0) {
+        Count(metrics->upstreamfailures);
+        shutdown(client, SHUT_RDWR);
+    }
+    return true;
+}
+
+void HttpServer::CheckUpstreams() {
+    for (auto item = upstreams.begin(); item != upstreams.end(); item++) {
+        item->second->CheckHealth();
+    }
+}
+
+void HttpServer::Run(server_type type, bool verbose) {
+    // Add signal handlers
+    signal(SIGINT, handleSigint);
+    signal(SIGCHLD, handleSigchld);
+
+    // Pinned evented backends run one worker process per CPU, each with its own listeners
+    if (placement.is_enabled() && (type == EVENTED || type == IO_URING)) {
+        RunWorkers(type, verbose);
+        return;
+    }
+    server.ListenHttp(server.get_options().port);
+    if (tls.is_enabled()) {
+        server.ListenTls(tlsport);
+    }
+
+    // Run with flag options
+    if (type == MPROCESS) {
+        RunMultiProcessed(verbose);
+    } else if (type == MTHREADED) {
+        RunMultiThreaded(verbose);
+    } else if (type == EVENTED) {
+        RunEvented(verbose);
+    } else if (type == IO_URING) {
+        RunUring(verbose);
+    }
+}
+
+void HttpServer::RunWorkers(server_type type, bool verbose) {
+    vector<int> listeners;
+    vector<int> tlslisteners;
+    vector<pid_t> workers;
+
+    // Bound here in CPU order, so listener i of each SO_REUSEPORT group is worker i's
+    for (size_t i = 0; i < placement.size(); i++) {
+        listeners.push_back(server.Listen(server.get_options().port, true));
+        if (tls.is_enabled()) {
+            tlslisteners.push_back(server.Listen(tlsport, true));
+        }
+    }
+    placement.Steer(listeners[0]);
+    if (tls.is_enabled()) {
+        placement.Steer(tlslisteners[0]);
+    }
+
+    for (size_t i = 0; i < placement.size(); i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            break;
+        } else if (pid == 0) {
+            // Worker keeps its own listeners, pins itself, and only then allocates its loop state
+            for (size_t j = 0; j < listeners.size(); j++) {
+                if (j != i) {
+                    close(listeners[j]);
+                    if (tls.is_enabled()) {
+                        close(tlslisteners[j]);
+                    }
+                }
+            }
+            server.set_listening(listeners[i]);
+            if (tls.is_enabled()) {
+                server.set_tls_listening(tlslisteners[i]);
+            }
+            placement.Apply(placement.get_cpu(i));
+            if (type == IO_URING) {
+                RunUring(verbose);
+            } else {
+                RunEvented(verbose);
+            }
+            exit(EXIT_SUCCESS);
+        }
+        workers.push_back(pid);
+    }
+    if (verbose) {
+        cout << "Started " << workers.size() << " workers\n";
+    }
+
+    // The parent only supervises, the listeners are the workers' now
+    for (size_t i = 0; i < listeners.size(); i++) {
+        close(listeners[i]);
+        if (tls.is_enabled()) {
+            close(tlslisteners[i]);
+        }
+    }
+    while (running) {
+        pause();
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        kill(workers[i], SIGINT);
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        waitpid(workers[i], NULL, 0);
+    }
+}
+
+void HttpServer::RunMultiProcessed(bool verbose) {
+    pid_t pid;
+    pair<int, string> client;
+    int connection;
+    if (verbose) {
+        cout << "Server starting...\n\n";
+    }
+
+    // Event loop
+    while (running) {
+
+        // Wait for a connection
+        client = server.Connect();
+        connection = client.first;
+        if (connection > 0 && AdmitConnection(client, true)) {
+            Count(metrics->connections);
+            int cpu = placement.is_enabled() ? placement.Choose(connection) : -1;
+
+            // Fork a new server process to handle client connection
+            pid = fork();
+            if (pid < 0) {
+                // Error 
+                perror("fork");
+                ReleaseConnection(client.second, true);
+                server.Close(connection);
+                continue;
+            } else if (pid == 0) {
+                // Child process
+                DispatchRequestToChild(verbose, client, cpu);
+            } else {
+                // Parent process, the child owns the connection and traces its close
+                close(connection);
+            }
+        }
+        // Sleep if not connected
+        usleep(SLEEP_MSEC);
+    }
+    if (verbose) {
+        cout << "Server shutting down...\n";
+    }
+}
+
+void HttpServer::DispatchRequestToChild(bool verbose, pair<int, string> client, int cpu) {
+    HttpRequest request;
+    string response;
+    string input;
+    read_deadline reading = {};
+    const char* body;
+    size_t length;
+    size_t head;
+    size_t total;
+    int connection = client.first;
+
+    // Pinned before the first allocation so the connection's memory is local
+    if (cpu >= 0) {
+        placement.Apply(cpu);
+    }
+
+    // Keep-alive requests are served until the time out interval passes, a request already
+    // arriving then gets its own deadline
+    long long idleuntil = MonotonicMs() + (long long) (TIME_OUT * 1000);
+    uint32_t captured = capture.Connect();
+    request.set_connection(connection);
+    frame_t frame = ReceiveRequest(verbose, client, captured, input, reading, idleuntil, head, total);
+    while (frame == FRAME_REQUEST) {
+        // Handle request and send response, straight from the pack when possible
+        ParseRequest(request, verbose, input.substr(0, head).c_str());
+        input.erase(0, total);
+        if (Throttled(request, client.second, response)) {
+            server.SendResponse(response, connection);
+        } else if (LookupPacked(request, response, body, length)) {
+            server.SendResponse(response, body, length, connection);
+        } else if (!RelayProxy(request, client.second, connection)) {
+            response = HandleRequestCached(request, verbose, client.second);
+            server.SendResponse(response, connection);
+        }
+        frame = ReceiveRequest(verbose, client, captured, input, reading, idleuntil, head, total);
+    }
+    if (frame != FRAME_CLOSED) {
+        server.SendResponse(RejectRequest(frame, input, head), connection);
+        shutdown(connection, SHUT_WR);
+    }
+
+    // Close connection and exit
+    capture.Disconnect(captured);
+    ReleaseConnection(client.second, true);
+    server.Close(connection);
+    exit(EXIT_SUCCESS);
+}
+
+void HttpServer::RunMultiThreaded(bool verbose) {
+    vector<pthread_t> threadlist;
+    pthread_t newthread;
+    mthreaded_request_args args;
+    pair<int, string> client;
+    int connection;
+    int error;
+
+    // Initialize thread attributes and mutex
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    if (verbose) {
+        cout << "Server starting...\n\n";
+    }
+
+    // Event loop waits for any new connections
+    while (running) {
+        client = server.Connect();
+        connection = client.first;
+        if (connection > 0 && AdmitConnection(client, true)) {
+            Count(metrics->connections);
+
+            // Create a new thread and dispatch thread
+            args.verbose = verbose;
+            args.client = client;
+            args.ptr = this;
+            args.cpu = placement.is_enabled() ? placement.Choose(connection) : -1;
+
+            // Add new thread to threadlist
+            error = pthread_create(&newthread, &attr, HttpServer::CallDispatchRequestToThread, &args);
+            if (error != 0) {
+                errno = error;
+                perror("pthread_create");
+                ReleaseConnection(client.second, true);
+                server.Close(connection);
+            } else {
+                threadlist.push_back(newthread);
+            }
+        }
+        // Sleep if no connections
+        usleep(SLEEP_MSEC);
+    }
+
+    if (verbose) {
+        cout << "Server shutting down...\n";
+    }
+
+    // Join all finished threads
+    while (!threadlist.empty()) {
+        error = pthread_join(threadlist.back(), NULL);
+        if (error < 0) {
+            perror("pthread_join");
+        }
+        threadlist.pop_back();
+    }
+
+    // Clean up attributes
+    pthread_attr_destroy(&attr);
+
+    // Allow main thread to exit while waiting for any threads to finish
+    pthread_exit(NULL);
+}
+
+void* HttpServer::DispatchRequestToThread(bool verbose, pair<int, string> client, int cpu) {
+    HttpRequest request;
+    string response;
+    string input;
+    read_deadline reading = {};
+    const char* body;
+    size_t length;
+    size_t head;
+    size_t total;
+    int connection = client.first;
+
+    // Pin before the first allocation so the connection's memory is local
+    if (cpu >= 0) {
+        placement.Apply(cpu);
+    }
+
+    // Keep-alive requests are served until the time out interval passes, a request already
+    // arriving then gets its own deadline
+    long long idleuntil = MonotonicMs() + (long long) (TIME_OUT * 1000);
+    uint32_t captured = capture.Connect();
+    request.set_connection(connection);
+    frame_t frame = ReceiveRequest(verbose, client, captured, input, reading, idleuntil, head, total);
+    while (frame == FRAME_REQUEST) {
+        // Handle request and send response
+        ParseRequest(request, verbose, input.substr(0, head).c_str());
+        input.erase(0, total);
+        if (Throttled(request, client.second, response)) {
+            server.SendResponse(response, connection);
+        } else if (LookupPacked(request, response, body, length)) {
+            server.SendResponse(response, body, length, connection);
+        } else if (!RelayProxy(request, client.second, connection)) {
+            response = HandleRequestCached(request, verbose, client.second);
+            server.SendResponse(response, connection);
+        }
+        frame = ReceiveRequest(verbose, client, captured, input, reading, idleuntil, head, total);
+    }
+    if (frame != FRAME_CLOSED) {
+        server.SendResponse(RejectRequest(frame, input, head), connection);
+        shutdown(connection, SHUT_WR);
+    }
+
+    // Close connection and exit
+    capture.Disconnect(captured);
+    ReleaseConnection(client.second, true);
+    server.Close(connection);
+    pthread_exit(NULL);
+}
+
+void* HttpServer::CallDispatchRequestToThread(void* args) {
+    // Unpack arguments and return a function pointer
+    mthreaded_request_args* arguments = (mthreaded_request_args*) args;
+    bool verbose = arguments->verbose;
+    pair<int, string> client = arguments->client;
+    void* ptr = arguments->ptr;
+    int cpu = arguments->cpu;
+    return ((HttpServer*) ptr)->DispatchRequestToThread(verbose, client, cpu); 
+}
+
+void HttpServer::RunEvented(bool verbose) {
+    unordered_map<int, evented_connection> connections;
+    vector<int> victims;
+    struct epoll_event event;
+    struct epoll_event events[BACKLOG];
+    pair<int, string> client;
+    int listening = server.get_listening();
+    int tlslistening = server.get_tls_listening();
+    int connection;
+    int count;
+    int ready;
+    time_t now;
+    time_t lastsweep;
+
+    // Register the listening socket with epoll
+    int epoll = epoll_create1(0);
+    if (epoll < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    event.events = EPOLLIN;
+    event.data.fd = listening;
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, listening, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    if (tlslistening >= 0) {
+        event.data.fd = tlslistening;
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, tlslistening, &event) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (verbose) {
+        cout << "Server starting...\n\n";
+    }
+    time(&lastsweep);
+
+    // Coroutine handlers share the epoll set, without the reactor every handler runs inline
+    reactor.Attach(epoll);
+    evented = &connections;
+
+    // Event loop
+    while (running) {
+        ready = epoll_wait(epoll, events, BACKLOG, reactor.NextTimeout(deadlines.NextTimeout(TIME_OUT * 1000)));
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        time(&now);
+
+        for (int i = 0; i < ready; i++) {
+            connection = events[i].data.fd;
+            if (reactor.Dispatch(connection)) {
+                continue;
+            }
+            if (connection == listening || connection == tlslistening) {
+                // Over the memory budget, the longest idle connections make room for new ones
+                if (OverBudget() && ReclaimEvented(connections, victims, now)) {
+                    for (size_t j = 0; j < victims.size(); j++) {
+                        ReleaseEvented(connections[victims[j]]);
+                        server.Close(victims[j]);
+                        connections.erase(victims[j]);
+                    }
+                    victims.clear();
+                }
+
+                // Accept every pending connection
+                bool secure = connection == tlslistening;
+                client = server.Connect(SOCK_NONBLOCK, secure);
+                while (client.first > 0) {
+                    if (!AdmitConnection(client, false)) {
+                        client = server.Connect(SOCK_NONBLOCK, secure);
+                        continue;
+                    }
+                    Count(metrics->connections);
+                    evented_connection& conn = connections[client.first];
+                    conn.client = client;
+                    conn.sent = 0;
+                    conn.lastactive = now;
+                    conn.reading = read_deadline();
+                    conn.draining = false;
+                    conn.written = 0;
+                    conn.tracestart = 0;
+                    conn.tracestatus = 0;
+                    conn.captured = capture.Connect();
+                    conn.charged = 0;
+                    conn.serial = ++serials;
+                    conn.tickets = 0;
+                    conn.streams = 0;
+                    conn.busy = false;
+                    conn.h2 = NULL;
+                    conn.tls = secure ? tls.Accept(client.first) : NULL;
+                    conn.handshaking = secure;
+                    conn.tlswrite = false;
+                    conn.sending = false;
+                    conn.closing = false;
+                    ChargeEvented(conn);
+                    if (secure && conn.tls == NULL) {
+                        ReleaseEvented(conn);
+                        server.Close(client.first);
+                        connections.erase(client.first);
+                    } else {
+                        event.events = EPOLLIN;
+                        event.data.fd = client.first;
+                        epoll_ctl(epoll, EPOLL_CTL_ADD, client.first, &event);
+                    }
+                    client = server.Connect(SOCK_NONBLOCK, secure);
+                }
+                continue;
+            }
+
+            auto item = connections.find(connection);
+            if (item == connections.end()) {
+                continue;
+            }
+            evented_connection& conn = item->second;
+            bool open = true;
+            bool readable = events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+            conn.lastactive = now;
+
+            // A finished handshake may leave the first request buffered inside OpenSSL, so read right away
+            if (conn.handshaking) {
+                open = HandshakeEvented(conn);
+                readable = open && !conn.handshaking;
+            }
+
+            // Drain the socket into a pooled buffer, then answer every complete request
+            if (readable) {
+                buffers.Acquire(conn.inbuf, BUFFER_LENGTH + 1);
+                if (conn.tls != NULL) {
+                    count = server.ReceiveTls(verbose, conn.client, conn.tls);
+                    while (count > 0) {
+                        conn.inbuf.append(server.get_buffer(), count);
+                        capture.Record(conn.captured, server.get_buffer(), count);
+                        count = server.ReceiveTls(verbose, conn.client, conn.tls);
+                    }
+                } else {
+                    count = server.ReceiveNonBlocking(verbose, conn.client);
+                    while (count > 0) {
+                        conn.inbuf.append(server.get_buffer(), count);
+                        capture.Record(conn.captured, server.get_buffer(), count);
+                        count = server.ReceiveNonBlocking(verbose, conn.client);
+                    }
+                }
+                if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    open = false;
+                }
+                ProcessEvented(conn, verbose);
+            }
+            if (!RearmEvented(epoll, conn, open)) {
+                connections.erase(item);
+            }
+        }
+
+        // Coroutine timeouts and slow requests, then the connections whose coroutine handlers
+        // finished or whose request timed out meanwhile
+        reactor.Expire();
+        ExpireEvented(connections, woken);
+        for (size_t i = 0; i < woken.size(); i++) {
+            auto item = connections.find(woken[i]);
+            if (item != connections.end() && !RearmEvented(epoll, item->second, true)) {
+                connections.erase(item);
+            }
+        }
+        woken.clear();
+
+        // Close keep-alive connections that have been idle too long, a request on its way has its own deadline
+        if (difftime(now, lastsweep) >= TIME_OUT) {
+            for (auto item = connections.begin(); item != connections.end();) {
+                if (item->second.pending.empty() && item->second.streams == 0 && item->second.reading.phase == READ_IDLE &&
+                    difftime(now, item->second.lastactive) >= TIME_OUT) {
+                    ReleaseEvented(item->second);
+                    server.Close(item->first);
+                    item = connections.erase(item);
+                } else {
+                    item++;
+                }
+            }
+            CheckUpstreams();
+            lastsweep = now;
+        }
+    }
+
+    if (verbose) {
+        cout << "Server shutting down...\n";
+    }
+    for (auto item = connections.begin(); item != connections.end(); item++) {
+        ReleaseEvented(item->second);
+        server.Close(item->first);
+    }
+    evented = NULL;
+    reactor.Detach();
+    close(epoll);
+}
+
+void HttpServer::RunUring(bool verbose) {
+    unordered_map<int, evented_connection> connections;
+    struct io_uring_cqe* cqe;
+    struct __kernel_timespec tick;
+    pair<int, string> client;
+    IoUring ring;
+    vector<int> expired;
+    vector<int> victims;
+    int listening = server.get_listening();
+    time_t now;
+
+    // The TLS record layer runs on epoll readiness, keep both listeners on one backend
+    if (tls.is_enabled()) {
+        cout << "TLS is served by the epoll backend\n";
+        RunEvented(verbose);
+        return;
+    }
+
+    // Fall back to epoll on kernels without io_uring or provided buffer rings
+    if (!ring.Initialize(URING_ENTRIES) || !ring.SetupBufferRing(URING_BUFFER_COUNT, BUFFER_LENGTH + 1)) {
+        cout << "io_uring unavailable, falling back to epoll\n";
+        RunEvented(verbose);
+        return;
+    }
+    if (verbose) {
+        cout << "Server starting on io_uring...\n\n";
+    }
+
+    // One multishot accept serves every incoming connection
+    ring.PrepMultishotAccept(listening, UringData(listening, URING_ACCEPT));
+    tick.tv_sec = TIME_OUT;
+    tick.tv_nsec = 0;
+    ring.PrepTimeout(&tick, UringData(0, URING_TICK));
+
+    // Event loop, a single io_uring_enter per iteration submits and reaps
+    while (running) {
+        ring.Submit(1);
+        time(&now);
+
+        while ((cqe = ring.PeekCqe()) != NULL) {
+            unsigned long long data = cqe->user_data;
+            unsigned flags = cqe->flags;
+            int result = cqe->res;
+            int fd = UringFd(data);
+            ring.SeenCqe();
+
+            if (UringOp(data) == URING_ACCEPT) {
+                // Over the memory budget, the longest idle connections are woken to close
+                if (result >= 0 && OverBudget() && ReclaimEvented(connections, victims, now)) {
+                    for (size_t i = 0; i < victims.size(); i++) {
+                        shutdown(victims[i], SHUT_RDWR);
+                    }
+                    victims.clear();
+                }
+                if (result >= 0) {
+                    server.Tune(result);
+                    client = make_pair(result, server.PeerName(result));
+                }
+                if (result >= 0 && AdmitConnection(client, false)) {
+                    Count(metrics->connections);
+                    evented_connection& conn = connections[result];
+                    conn.client = client;
+                    conn.sent = 0;
+                    conn.serial = ++serials;
+                    conn.tickets = 0;
+                    conn.streams = 0;
+                    conn.busy = false;
+                    conn.inflight = 1;
+                    conn.sending = false;
+                    conn.closing = false;
+                    conn.lastactive = now;
+                    conn.reading = read_deadline();
+                    conn.draining = false;
+                    conn.written = 0;
+                    conn.tracestart = 0;
+                    conn.tracestatus = 0;
+                    conn.captured = capture.Connect();
+                    conn.charged = 0;
+                    conn.h2 = NULL;
+                    conn.tls = NULL;
+                    conn.handshaking = false;
+                    ChargeEvented(conn);
+                    ring.PrepRecv(result, UringData(result, URING_RECV));
+                }
+                // Re-arm when the kernel terminated the multishot request
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    ring.PrepMultishotAccept(listening, UringData(listening, URING_ACCEPT));
+                }
+                continue;
+            } else if (UringOp(data) == URING_TICK) {
+                // Wake idle keep-alive connections with a shutdown, their receive then completes with 0
+                for (auto item = connections.begin(); item != connections.end(); item++) {
+                    evented_connection& conn = item->second;
+                    if (!conn.closing && !conn.sending && conn.pending.empty() && conn.reading.phase == READ_IDLE &&
+                        difftime(now, conn.lastactive) >= TIME_OUT) {
+                        shutdown(item->first, SHUT_RDWR);
+                    }
+                }
+                // Slow requests at tick resolution, their 408 goes out like any response
+                expired.clear();
+                ExpireEvented(connections, expired);
+                for (size_t i = 0; i < expired.size(); i++) {
+                    PumpUring(ring, connections[expired[i]]);
+                    IdleEvented(connections[expired[i]]);
+                }
+                CheckUpstreams();
+                ring.PrepTimeout(&tick, UringData(0, URING_TICK));
+                continue;
+            } else if (UringOp(data) == URING_CLOSE) {
+                continue;
+            }
+
+            auto item = connections.find(fd);
+            if (item == connections.end()) {
+                continue;
+            }
+            evented_connection& conn = item->second;
+            conn.inflight--;
+            conn.lastactive = now;
+
+            if (UringOp(data) == URING_RECV) {
+                if (result > 0) {
+                    // Copy out of the provided buffer and give it straight back
+                    unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+                    buffers.Acquire(conn.inbuf, BUFFER_LENGTH + 1);
+                    conn.inbuf.append(ring.get_buffer(id), result);
+                    capture.Record(conn.captured, ring.get_buffer(id), result);
+                    ring.ReturnBuffer(id);
+                    if (verbose) {
+                        cout << "Received " << result << " bytes:\n" << conn.inbuf << endl;
+                    }
+                    ProcessEvented(conn, verbose);
+                    ring.PrepRecv(fd, UringData(fd, URING_RECV));
+                    conn.inflight++;
+                } else if (result == -ENOBUFS) {
+                    // Every provided buffer is in use, try again
+                    ring.PrepRecv(fd, UringData(fd, URING_RECV));
+                    conn.inflight++;
+                } else {
+                    conn.closing = true;
+                }
+            } else if (UringOp(data) == URING_READ) {
+                // A failed read cancels the linked send, which reports the error
+                if (result < 0) {
+                    conn.closing = true;
+                }
+            } else if (UringOp(data) == URING_SEND) {
+                conn.sending = false;
+                if (result < 0) {
+                    conn.closing = true;
+                } else if (!conn.pending.empty()) {
+                    // Advance past whatever the kernel accepted
+                    response_segment& segment = conn.pending.front();
+                    conn.written += result;
+                    if (segment.mapped != NULL) {
+                        segment.mapped += result;
+                        segment.length -= result;
+                        if (segment.length == 0) {
+                            TraceSent(conn, segment);
+                            conn.pending.pop_front();
+                        }
+                    } else if (segment.file < 0) {
+                        conn.sent += result;
+                        if (conn.sent >= segment.data.length()) {
+                            TraceSent(conn, segment);
+                            conn.pending.pop_front();
+                            conn.sent = 0;
+                        }
+                    } else {
+                        segment.offset += result;
+                        segment.length -= result;
+                        if (segment.length == 0) {
+                            close(segment.file);
+                            TraceSent(conn, segment);
+                            conn.pending.pop_front();
+                        }
+                    }
+                }
+            }
+
+            if (conn.closing) {
+                // Wake a pending receive so the connection can be retired
+                if (conn.inflight > 0) {
+                    shutdown(fd, SHUT_RDWR);
+                    continue;
+                }
+                ReleaseEvented(conn);
+                TRACE_CLOSE(fd);
+                ring.PrepClose(fd, UringData(fd, URING_CLOSE));
+                connections.erase(item);
+                continue;
+            }
+            PumpUring(ring, conn);
+            IdleEvented(conn);
+        }
+    }
+
+    if (verbose) {
+        cout << "Server shutting down...\n";
+    }
+    for (auto item = connections.begin(); item != connections.end(); item++) {
+        ReleaseEvented(item->second);
+        server.Close(item->first);
+    }
+}
+
+void HttpServer::ProcessEvented(evented_connection& conn, bool verbose) {
+    size_t head;
+    size_t total;
+    frame_t frame;
+
+    // After a rejection nothing the client sends is looked at
+    if (conn.draining) {
+        conn.inbuf.clear();
+        return;
+    }
+
+    // HTTP/2 with prior knowledge starts with the connection preface instead of a request
+    if (conn.h2 == NULL && conn.inbuf.compare(0, 3, "PRI") == 0) {
+        if (conn.inbuf.length() < HTTP2_PREFACE_LENGTH) {
+            return;
+        }
+        if (conn.inbuf.compare(0, HTTP2_PREFACE_LENGTH, HTTP2_PREFACE) == 0) {
+            Count(metrics->http2connections);
+            conn.h2 = new Http2Session;
+        }
+    }
+    if (conn.h2 != NULL) {
+        ProcessHttp2(conn, verbose);
+        return;
+    }
+
+    // Answer every complete request, pipelined requests are queued in order. Bodies are
+    // received and dropped, no handler takes one.
+    frame = FrameRequest(conn.inbuf, clients, head, total);
+    while (frame == FRAME_REQUEST) {
+        HttpRequest request;
+        string text = conn.inbuf.substr(0, head);
+        conn.inbuf.erase(0, total);
+        request.set_connection(conn.client.first);
+        ParseRequest(request, verbose, text.c_str());
+        if (UpgradeHttp2(request, verbose, conn)) {
+            ProcessHttp2(conn, verbose);
+            return;
+        }
+        QueueResponse(request, verbose, conn);
+        frame = FrameRequest(conn.inbuf, clients, head, total);
+    }
+    if (frame != FRAME_PARTIAL) {
+        RejectEvented(conn, frame, head);
+        return;
+    }
+
+    // What's left is the start of the next request, or nothing
+    TrackRead(conn.reading, conn.inbuf.empty() ? READ_IDLE : head == 0 ? READ_HEAD : READ_BODY, conn.inbuf.length() - head, clients, MonotonicMs());
+    ArmEvented(conn);
+}
+
+void HttpServer::QueueResponse(HttpRequest& request, bool verbose, evented_connection& conn) {
+    response_segment segment;
+    struct stat info;
+    string response;
+    int file;
+
+    // Rejected requests are answered before any handler runs
+    segment.file = -1;
+    segment.mapped = NULL;
+    segment.ticket = 0;
+    if (ShedEvented(request, conn, segment.data)) {
+        conn.pending.push_back(segment);
+        return;
+    }
+
+    // Pack hits are sent straight from the shared mapping
+    if (LookupPacked(request, segment.data, segment.mapped, segment.length)) {
+        const char* mapped = segment.mapped;
+        segment.mapped = NULL;
+        conn.pending.push_back(segment);
+        if (segment.length > 0) {
+            segment.data = "";
+            segment.mapped = mapped;
+            conn.pending.push_back(segment);
+        }
+        return;
+    }
+
+    // Static files are streamed from the descriptor instead of being copied into the response
+    if (IsStaticGet(request)) {
+        file = open(request.get_path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (file >= 0 && fstat(file, &info) == 0 && S_ISREG(info.st_mode)) {
+            size_t contentlen = info.st_size;
+            TRACE_FILE_OPEN(conn.client.first, request.get_path().c_str(), (long long) info.st_size);
+            segment.data = CreateResponseHeader(request, contentlen, OK);
+            segment.file = -1;
+            conn.pending.push_back(segment);
+
+            segment.data = "";
+            segment.file = file;
+            segment.offset = 0;
+            segment.length = contentlen;
+            conn.pending.push_back(segment);
+            if (verbose) {
+                cout << endl << "Response: " << conn.pending[conn.pending.size() - 2].data << endl << endl;
+            }
+            return;
+        }
+        if (file >= 0) {
+            close(file);
+        }
+    }
+
+    // Handlers that wait on files or upstreams run as coroutines, a placeholder keeps responses in order
+    if (IsAsyncGet(request)) {
+        segment.ticket = ++conn.tickets;
+        conn.pending.push_back(segment);
+        RespondAsync(request, conn.client, conn.serial, segment.ticket, verbose).Detach();
+        return;
+    }
+
+    // Everything else goes through the regular handler
+    response = HandleRequest(request, verbose, conn.client.second);
+    segment.data = response;
+    segment.file = -1;
+    segment.mapped = NULL;
+    conn.pending.push_back(segment);
+}
+
+bool HttpServer::RearmEvented(int epoll, evented_connection& conn, bool open) {
+    struct epoll_event event;
+    int connection = conn.client.first;
+
+    if (open && !conn.handshaking && !FlushEvented(conn)) {
+        open = false;
+    }
+    SettleEvented(conn);
+
+    // HTTP/2 connections end after a GOAWAY has been written out, rejected ones after their answer
+    if (open && conn.h2 != NULL && conn.pending.empty() && conn.h2->is_finished()) {
+        open = false;
+    }
+    if (open && conn.draining && conn.pending.empty()) {
+        shutdown(connection, SHUT_WR);
+        open = false;
+    }
+
+    if (!open) {
+        // Closing the descriptor also removes it from the epoll set, the caller drops the connection
+        ReleaseEvented(conn);
+        server.Close(connection);
+        return false;
+    }
+
+    IdleEvented(conn);
+
+    // Only ask for writability while output is ready to go or the handshake waits to write
+    bool writable = (!conn.pending.empty() && conn.pending.front().ticket == 0) || conn.tlswrite;
+    event.events = writable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.fd = connection;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, connection, &event);
+    return true;
+}
+
+void HttpServer::ReleaseEvented(evented_connection& conn) {
+    // Files still queued for sending and the HTTP/2 session belong to the connection
+    while (!conn.pending.empty()) {
+        if (conn.pending.front().file >= 0) {
+            close(conn.pending.front().file);
+        }
+        conn.pending.pop_front();
+    }
+    delete conn.h2;
+    conn.h2 = NULL;
+    SettleEvented(conn);
+    admission.Close(conn.client.second);
+    capture.Disconnect(conn.captured);
+    conn.captured = 0;
+
+    // The connection's buffers outlive it in the pool
+    conn.inbuf.clear();
+    conn.chunk.clear();
+    buffers.Release(conn.inbuf);
+    buffers.Release(conn.chunk);
+    if (conn.charged > 0) {
+        __sync_sub_and_fetch(&metrics->memoryconnections, 1);
+        __sync_sub_and_fetch(&metrics->memorybytes, conn.charged);
+        conn.charged = 0;
+    }
+    if (conn.tls != NULL) {
+        TlsClose(conn.tls);
+        conn.tls = NULL;
+    }
+}
+
+void HttpServer::TraceSent(evented_connection& conn, const response_segment& segment) {
+    int status;
+
+    // Called as a segment leaves the queue. A response begins with its status line and ends
+    // where the next one or a coroutine's placeholder begins, or where the queue runs dry.
+    if (!TRACE_ENABLED(response_sent) || conn.h2 != NULL) {
+        return;
+    }
+    status = segment.file < 0 && segment.mapped == NULL ? TraceStatus(segment.data.c_str(), segment.data.length()) : 0;
+    if (status != 0) {
+        conn.tracestart = conn.written - segment.data.length();
+        conn.tracestatus = status;
+    }
+    if (conn.pending.size() > 1) {
+        const response_segment& next = conn.pending[1];
+        if (next.ticket == 0 && TraceStatus(next.data.c_str(), next.data.length()) == 0) {
+            return;
+        }
+    }
+    TRACE_RESPONSE_SENT(conn.client.first, conn.tracestatus, conn.written - conn.tracestart);
+}
+
+bool HttpServer::UpgradeHttp2(HttpRequest& request, bool verbose, evented_connection& conn) {
+    response_segment segment;
+    string settings(request.GetHeader(HEADER_HTTP2_SETTINGS));
+
+    // Upgrade: h2c on a bodiless HTTP/1.1 request, otherwise the request is answered over HTTP/1.1
+    if (request.get_method() != GET || request.get_version() != ONE_POINT_ONE || settings.empty() ||
+        request.GetHeader(HEADER_UPGRADE).find("h2c") == string::npos) {
+        return false;
+    }
+    Http2Session* session = new Http2Session;
+    if (!session->Upgrade(settings)) {
+        delete session;
+        return false;
+    }
+    Count(metrics->http2connections);
+    segment.data = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    segment.file = -1;
+    segment.mapped = NULL;
+    segment.ticket = 0;
+    conn.pending.push_back(segment);
+    conn.h2 = session;
+
+    // The upgraded request becomes stream 1, its response follows the server preface
+    RespondHttp2(conn, 1, request, verbose);
+    return true;
+}
+
+void HttpServer::ProcessHttp2(evented_connection& conn, bool verbose) {
+    vector<hpack_field> fields;
+    uint32_t stream;
+
+    conn.h2->Consume(conn.inbuf);
+    while (conn.h2->NextRequest(stream, fields)) {
+        // Rebuild an HTTP/1 request so routing, packs and every handler apply unchanged
+        HttpRequest request;
+        string method = "";
+        string path = "";
+        string headers = "";
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (fields[i].name.compare(":method") == 0) {
+                method = fields[i].value;
+            } else if (fields[i].name.compare(":path") == 0) {
+                path = fields[i].value;
+            } else if (fields[i].name.compare(":authority") == 0) {
+                headers += "host: " + fields[i].value + CRLF;
+            } else if (fields[i].name[0] != ':') {
+                headers += fields[i].name + ": " + fields[i].value + CRLF;
+            }
+        }
+        string text = method + SPACE + path + SPACE + versions[TWO_POINT_ZERO] + CRLF + headers + CRLF;
+        Count(metrics->http2streams);
+        request.set_connection(conn.client.first);
+        ParseRequest(request, verbose, text.c_str());
+        RespondHttp2(conn, stream, request, verbose);
+    }
+
+    // Control frames go out right away, DATA once the queue drains
+    FeedHttp2(conn);
+}
+
+void HttpServer::RespondHttp2(evented_connection& conn, uint32_t stream, HttpRequest& request, bool verbose) {
+    struct stat info;
+    string header;
+    string body = "";
+    string response;
+    const char* mapped;
+    size_t length;
+    int file;
+
+    // Rejected streams get their status without a body
+    if (ShedEvented(request, conn, header)) {
+        conn.h2->Respond(stream, header, body, NULL, 0);
+        return;
+    }
+
+    // Pack hits are framed straight from the shared mapping, with their ETag and 304s
+    if (LookupPacked(request, header, mapped, length)) {
+        conn.h2->Respond(stream, header, body, mapped, length);
+        return;
+    }
+
+    // Static files come from the shared response cache when another worker already read them
+    if (IsStaticGet(request) && IsCacheable(request)) {
+        if (cache.Lookup(cacheKey(request), response)) {
+            Count(metrics->cachehits);
+            TRACE_CACHE_HIT(conn.client.first, request.get_path().c_str(), response.length(), TRACE_CACHE_RESPONSE);
+            RespondHttp2(conn, stream, response);
+            return;
+        }
+        Count(metrics->cachemisses);
+        TRACE_CACHE_MISS(conn.client.first, request.get_path().c_str(), TRACE_CACHE_RESPONSE);
+    }
+
+    // Files, scripts and upstreams are waited on by a coroutine, the stream is answered once it finishes
+    if (reactor.is_attached() && (IsAsyncGet(request) || (IsStaticGet(request) && request.get_route() != NULL &&
+        request.get_route()->handler == STATIC_HANDLER))) {
+        conn.streams++;
+        RespondHttp2Async(request, conn.client, conn.serial, stream, verbose).Detach();
+        return;
+    }
+
+    // Without the reactor static files are read whole here, DATA frames are cut from the buffer as flow control allows
+    if (IsStaticGet(request)) {
+        file = open(request.get_path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (file >= 0 && fstat(file, &info) == 0 && S_ISREG(info.st_mode) && info.st_size <= BODY_LENGTH) {
+            TRACE_FILE_OPEN(conn.client.first, request.get_path().c_str(), (long long) info.st_size);
+            body.resize(info.st_size);
+            off_t offset = 0;
+            while (offset < info.st_size) {
+                ssize_t count = pread(file, &body[offset], info.st_size - offset, offset);
+                if (count <= 0) {
+                    break;
+                }
+                offset += count;
+            }
+            close(file);
+
+            // A file that shrank while being read is not answered with padding
+            if (offset == info.st_size) {
+                header = CreateResponseHeader(request, body.length(), OK);
+                CacheResponse(request, header + body);
+                conn.h2->Respond(stream, header, body, NULL, 0);
+                return;
+            }
+            body = "";
+        } else if (file >= 0) {
+            close(file);
+        }
+    }
+
+    // Everything else goes through the regular handler
+    RespondHttp2(conn, stream, HandleRequest(request, verbose, conn.client.second));
+}
+
+void HttpServer::RespondHttp2(evented_connection& conn, uint32_t stream, const string& response) {
+    // HTTP/1 responses are split at the blank line ending their head
+    size_t end = response.find("\n\r\n");
+    if (end == string::npos) {
+        conn.h2->Respond(stream, response, "", NULL, 0);
+        return;
+    }
+    conn.h2->Respond(stream, response.substr(0, end + 3), response.substr(end + 3), NULL, 0);
+}
+
+Task<void> HttpServer::RespondHttp2Async(HttpRequest request, pair<int, string> client, unsigned serial, uint32_t stream, bool verbose) {
+    string response;
+
+    if (request.get_route()->handler == PROXY_HANDLER) {
+        response = co_await HandleProxyAsync(request, client.second);
+    } else {
+        response = co_await HandleGetAsync(request, OK);
+        CacheResponse(request, response);
+    }
+    if (verbose) {
+        cout << endl << "Response: " << response << endl << endl;
+    }
+
+    // As in RespondAsync, the connection may be gone or its descriptor reused by now
+    if (evented == NULL) {
+        co_return;
+    }
+    auto item = evented->find(client.first);
+    if (item == evented->end() || item->second.serial != serial || item->second.h2 == NULL) {
+        co_return;
+    }
+    evented_connection& conn = item->second;
+    conn.streams--;
+    RespondHttp2(conn, stream, response);
+    FeedHttp2(conn);
+    woken.push_back(client.first);
+}
+
+bool HttpServer::FeedHttp2(evented_connection& conn) {
+    response_segment segment;
+
+    // New DATA is only produced once everything before it was sent, so a slow reader holds little memory
+    if (conn.pending.empty()) {
+        conn.h2->Pump();
+    }
+    if (conn.h2->get_output().empty()) {
+        return false;
+    }
+    segment.data.swap(conn.h2->get_output());
+    segment.file = -1;
+    segment.mapped = NULL;
+    segment.ticket = 0;
+    conn.pending.push_back(segment);
+    return true;
+}
+
+bool HttpServer::HandshakeEvented(evented_connection& conn) {
+    // Returns false when the handshake failed and the connection should close
+    tls_status_t status = TlsHandshake(conn.tls);
+    if (status == TLS_ERROR) {
+        return false;
+    }
+    conn.tlswrite = status == TLS_WANT_WRITE;
+    if (status != TLS_DONE) {
+        return true;
+    }
+    conn.handshaking = false;
+    Count(metrics->tlshandshakes);
+    if (SSL_session_reused(conn.tls)) {
+        Count(metrics->tlsresumed);
+    }
+    if (TlsKernelSend(conn.tls)) {
+        Count(metrics->ktlssend);
+    }
+    return true;
+}
+
+bool HttpServer::FlushEvented(evented_connection& conn) {
+    int connection = conn.client.first;
+
+    // Corked, everything written in one flush leaves in full segments
+    if (conn.pending.empty() && conn.h2 == NULL) {
+        return true;
+    }
+    server.Cork(connection, true);
+    bool alive = WriteEvented(conn);
+    server.Cork(connection, false);
+    return alive;
+}
+
+bool HttpServer::WriteEvented(evented_connection& conn) {
+    int connection = conn.client.first;
+    ssize_t count;
+
+    // Write until the socket buffer fills, returns false on a broken connection
+    while (!conn.pending.empty() || (conn.h2 != NULL && FeedHttp2(conn))) {
+        response_segment& segment = conn.pending.front();
+        if (segment.ticket != 0) {
+            // Nothing goes out ahead of a response a coroutine handler still works on
+            break;
+        }
+        if (segment.mapped != NULL) {
+            if (conn.tls != NULL) {
+                count = TlsWrite(conn.tls, segment.mapped, segment.length);
+            } else {
+                count = send(connection, segment.mapped, segment.length, MSG_NOSIGNAL);
+            }
+            if (count < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            conn.written += count;
+            segment.mapped += count;
+            segment.length -= count;
+            if (segment.length > 0) {
+                continue;
+            }
+        } else if (segment.file < 0) {
+            // MSG_MORE keeps headers and the file body that follows in one segment
+            int flags = conn.pending.size() > 1 ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+            if (conn.tls != NULL) {
+                count = TlsWrite(conn.tls, segment.data.c_str() + conn.sent, segment.data.length() - conn.sent);
+            } else {
+                count = send(connection, segment.data.c_str() + conn.sent, segment.data.length() - conn.sent, flags);
+            }
+            if (count < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            conn.written += count;
+            conn.sent += count;
+            if (conn.sent < segment.data.length()) {
                 continue;
-            } else if (pid == 0) {
-                // Child process
-                DispatchRequestToChild(verbose, client);
+            }
+            conn.sent = 0;
+        } else {
+            // Over TLS the file still goes through sendfile when kTLS took over the record layer
+            if (conn.tls != NULL) {
+                count = TlsSendfile(conn.tls, segment.file, segment.offset, segment.length);
+                if (count > 0) {
+                    segment.offset += count;
+                }
             } else {
-                // Parent process
-                server.Close(connection);
+                count = sendfile(connection, segment.file, &segment.offset, segment.length);
+            }
+            if (count < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+            conn.written += count;
+            segment.length -= count;
+            if (segment.length > 0 && count > 0) {
+                continue;
             }
+            close(segment.file);
         }
-        // Sleep if not connected
-        usleep(SLEEP_MSEC);
-    }
-    if (verbose) {
-        cout << "Server shutting down...\n";
+        TraceSent(conn, segment);
+        conn.pending.pop_front();
     }
+    return true;
 }
 
-void HttpServer::DispatchRequestToChild(bool verbose, pair<int, string> client) {
-    HttpRequest request;
-    string response;
-    time_t begin;
-    time_t end;
-    int connection = client.first;
-
-    // End process when elapsed time exceeds time out interval
-    time(&begin);
-    time(&end);
-    elapsedtime = difftime(end, begin);
+void HttpServer::PumpUring(IoUring& ring, evented_connection& conn) {
+    int connection = conn.client.first;
 
-    do {
-        if (server.Receive(verbose, client)) { 
-            // Handle request and send response
-            ParseRequest(request, verbose, server.get_buffer());
-            response = HandleRequest(request, verbose);
-            server.SendResponse(response, connection);
-        }
-        // Calculate elapsed time
-        time(&end);
-        elapsedtime = difftime(end, begin);
-    } while (elapsedtime < TIME_OUT);
+    // HTTP/2 frames are queued as the previous batch completes, and the connection ends after a GOAWAY
+    if (conn.h2 != NULL && !conn.sending && conn.pending.empty() && !FeedHttp2(conn) && conn.h2->is_finished()) {
+        conn.closing = true;
+        shutdown(connection, SHUT_RDWR);
+    }
+    if (conn.draining && !conn.sending && !conn.closing && conn.pending.empty()) {
+        conn.closing = true;
+        shutdown(connection, SHUT_RDWR);
+    }
+    SettleEvented(conn);
 
-    // Close connection and exit
-    server.Close(connection);
-    exit(EXIT_SUCCESS);
+    // Keep exactly one send in flight per connection so responses stay ordered
+    if (conn.sending || conn.closing || conn.pending.empty()) {
+        return;
+    }
+    response_segment& segment = conn.pending.front();
+    if (segment.mapped != NULL) {
+        ring.PrepSend(connection, segment.mapped, segment.length, UringData(connection, URING_SEND), false, false);
+        conn.inflight++;
+    } else if (segment.file < 0) {
+        ring.PrepSend(connection, segment.data.c_str() + conn.sent, segment.data.length() - conn.sent, UringData(connection, URING_SEND), false, conn.pending.size() > 1);
+        conn.inflight++;
+    } else {
+        // Linked read-then-send moves one chunk of the file per submission
+        size_t length = segment.length < FILE_CHUNK ? segment.length : FILE_CHUNK;
+        buffers.Acquire(conn.chunk, FILE_CHUNK);
+        conn.chunk.resize(FILE_CHUNK);
+        ring.PrepRead(segment.file, &conn.chunk[0], length, segment.offset, UringData(connection, URING_READ), true);
+        ring.PrepSend(connection, conn.chunk.c_str(), length, UringData(connection, URING_SEND), false, length < segment.length);
+        conn.inflight += 2;
+    }
+    conn.sending = true;
 }
 
-void HttpServer::RunMultiThreaded(bool verbose) {
-    vector<pthread_t> threadlist;
-    pthread_t newthread;
-    mthreaded_request_args args;
-    pair<int, string> client;
-    int connection;
-    int error;
+bool HttpServer::IsAsyncGet(HttpRequest& request) {
+    const route* matched = request.get_route();
 
-    // Initialize thread attributes and mutex
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    pthread_mutex_init(&cachemutex, NULL);
-    if (verbose) {
-        cout << "Server starting...\n\n";
+    // Valid GETs whose handler waits on files or upstreams, HandleRequest answers everything else.
+    // Static files are streamed by QueueResponse itself.
+    if (!reactor.is_attached() || matched == NULL || request.get_flag() || request.get_malformed() ||
+        request.get_version() == INVALID_VERSION || request.get_method() != GET || request.get_path().length() > URI_MAX_LENGTH) {
+        return false;
     }
+    return matched->handler == PHP_HANDLER || matched->handler == PROXY_HANDLER;
+}
 
-    // Event loop waits for any new connections
-    while (running) {
-        client = server.Connect();
-        connection = client.first;
-        if (connection > 0) {
-            // Create a new thread and dispatch thread
-            args.verbose = verbose;
-            args.client = client;
-            args.ptr = this;
+Task<void> HttpServer::RespondAsync(HttpRequest request, pair<int, string> client, unsigned serial, unsigned ticket, bool verbose) {
+    string response;
 
-            // Add new thread to threadlist
-            error = pthread_create(&newthread, &attr, HttpServer::CallDispatchRequestToThread, &args);
-            if (error < 0) {
-                perror("pthread_create");
-            }
-            threadlist.push_back(newthread);
-        }
-        // Sleep if no connections
-        usleep(SLEEP_MSEC);
+    if (request.get_route()->handler == PROXY_HANDLER) {
+        response = co_await HandleProxyAsync(request, client.second);
+    } else {
+        response = co_await HandleGetAsync(request, OK);
     }
-
     if (verbose) {
-        cout << "Server shutting down...\n";
+        cout << endl << "Response: " << response << endl << endl;
     }
 
-    // Join all finished threads
-    while (!threadlist.empty()) {
-        error = pthread_join(threadlist.back(), NULL);
-        if (error < 0) {
-            perror("pthread_join");
+    // The connection may have closed while the handler ran, its descriptor even been reused
+    if (evented == NULL) {
+        co_return;
+    }
+    auto item = evented->find(client.first);
+    if (item == evented->end() || item->second.serial != serial) {
+        co_return;
+    }
+    deque<response_segment>& pending = item->second.pending;
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i].ticket == ticket) {
+            pending[i].data = response;
+            pending[i].ticket = 0;
+            break;
         }
-        threadlist.pop_back();
     }
+    woken.push_back(client.first);
+}
 
-    // Clean up mutex and attributes
-    pthread_attr_destroy(&attr);
-    pthread_mutex_destroy(&cachemutex);
-
-    // Allow main thread to exit while waiting for any threads to finish
-    pthread_exit(NULL);
+Task<string> HttpServer::HandleGetAsync(HttpRequest request, http_status_t status) {
+    struct stat info;
+    string body = "";
+    bool php = strcmp(request.get_content_type().c_str(), APP_PHP) == 0;
+
+    // HandleGet, with the file read through the reactor. Directories are not found without a word.
+    int file = open(request.get_path().c_str(), O_RDONLY | O_CLOEXEC);
+    bool found = false;
+    if (file < 0) {
+        perror("open");
+    } else if (fstat(file, &info) < 0) {
+        perror("fstat");
+    } else {
+        found = S_ISREG(info.st_mode);
+    }
+    if (!found) {
+        status = NOT_FOUND;
+        Count(metrics->notfound);
+    } else {
+        TRACE_FILE_OPEN(request.get_connection(), request.get_path().c_str(), (long long) info.st_size);
+
+        // Requests for a script already running wait for its output instead of running it again,
+        // polling since the worker running it may be another process
+        microcache_result_t result = MICROCACHE_PASS;
+        if (php) {
+            result = LookupPhp(request, body, false);
+            while (result == MICROCACHE_WAIT) {
+                co_await reactor.Sleep(MICROCACHE_POLL);
+                result = LookupPhp(request, body, false);
+            }
+        }
+        if (result != MICROCACHE_FRESH && result != MICROCACHE_STALE) {
+            size_t length = php || info.st_size < BODY_LENGTH ? info.st_size : BODY_LENGTH;
+            if (co_await reactor.ReadFile(file, 0, length, body) < 0) {
+                // No output to store either, a flight this request leads lands empty handed
+                perror("pread");
+                body = "";
+                status = INTERNAL_SERVER_ERROR;
+                if (result == MICROCACHE_LEAD) {
+                    microcache.Finish(request.get_path() + "?" + request.get_query(), body, 0, 0, false);
+                }
+            } else if (php) {
+                // PHP itself runs on the loop, it is CPU bound
+                body = RunPhp(request, body, result);
+            }
+        }
+        if (php) {
+            request.set_content_type(HTML);
+        }
+    }
+    if (file >= 0) {
+        close(file);
+    }
+    co_return CreateResponseString(request, "", body, status);
 }
 
-void* HttpServer::DispatchRequestToThread(bool verbose, pair<int, string> client) {
-    HttpRequest *request = new HttpRequest;
-    string response;
-    time_t begin;
-    time_t end;
-    int connection = client.first;
-    bool cached = false;
-        
-    // End process when elapsed time exceeds time out interval
-    time(&begin);
-    time(&end);
-    elapsedtime = difftime(end, begin);
-
-    do {
-        if (server.Receive(verbose, client)) { 
-            // Handle request and send response
-            ParseRequest(*request, verbose, server.get_buffer());
-
-            // Lock mutex before call
-            response = HandleRequestThreaded(*request, verbose, cached);
-            server.SendResponse(response, connection);
+Task<bool> HttpServer::ForwardProxyAsync(HttpRequest& request, const string& peer, upstream*& chosen, int& connection, string& head, string& rest, upstream_response& response, http_status_t& status) {
+    UpstreamPool* pool = upstreams[request.get_route()];
+    string outgoing = BuildUpstreamRequest(request, peer);
+    string chunk(PROXY_CHUNK_LENGTH, '\0');
+    bool reused;
+
+    // ForwardProxy, with every connect, send and receive waiting on the reactor instead
+    for (int attempt = 0; attempt < 3; attempt++) {
+        connection = pool->Acquire(chosen, reused, true);
+        if (connection < 0 && chosen == NULL) {
+            break;
+        } else if (connection < 0) {
+            continue;
+        }
+        if (reused) {
+            Count(metrics->upstreamreuses);
+        } else {
+            Count(metrics->upstreamconnects);
         }
-        // Calculate elapsed time
-        time(&end);
-        elapsedtime = difftime(end, begin);
-    } while (elapsedtime < TIME_OUT);
 
-    // Add item to cache
-    if (!cached) {
-        // Lock cache while updating
-        pthread_mutex_lock(&cachemutex);
-        cache.push_back(make_pair(request, response));
-        pthread_mutex_unlock(&cachemutex);
+        // A connect still in progress shows up as the send waiting for writability
+        errno = 0;
+        string buffer = "";
+        int done = 0;
+        bool sent = co_await reactor.Send(connection, outgoing.c_str(), outgoing.length(), PROXY_TIMEOUT * 1000);
+        while (sent && done == 0) {
+            ssize_t count = co_await reactor.Recv(connection, &chunk[0], chunk.length(), PROXY_TIMEOUT * 1000);
+            if (count <= 0) {
+                break;
+            }
+            buffer.append(chunk, 0, count);
+            done = SplitUpstreamHead(buffer, head, rest);
+        }
+        if (done > 0) {
+            if (ParseUpstreamHead(head, response)) {
+                co_return true;
+            }
+            pool->Release(chosen, connection, false);
+            break;
+        }
+        bool timedout = errno == ETIMEDOUT;
+        bool refused = !reused && errno == ECONNREFUSED;
+        pool->Release(chosen, connection, false);
+        if (refused) {
+            pool->Fail(chosen);
+            continue;
+        }
+        if (timedout) {
+            Count(metrics->upstreamfailures);
+            status = GATEWAY_TIMEOUT;
+            co_return false;
+        }
+        if (!reused) {
+            break;
+        }
     }
-
-    // Close connection and exit
-    server.Close(connection);
-    pthread_exit(NULL);
+    Count(metrics->upstreamfailures);
+    status = BAD_GATEWAY;
+    co_return false;
 }
 
-void* HttpServer::CallDispatchRequestToThread(void* args) {
-    // Unpack arguments and return a function pointer
-    mthreaded_request_args* arguments = (mthreaded_request_args*) args;
-    bool verbose = arguments->verbose;
-    pair<int, string> client = arguments->client;
-    void* ptr = arguments->ptr;
-    return ((HttpServer*) ptr)->DispatchRequestToThread(verbose, client); 
-}
+Task<string> HttpServer::HandleProxyAsync(HttpRequest request, string peer) {
+    UpstreamPool* pool = upstreams[request.get_route()];
+    upstream_response response;
+    upstream_decoder decoder;
+    upstream* chosen;
+    http_status_t status;
+    string head;
+    string body;
+    string chunk(PROXY_CHUNK_LENGTH, '\0');
+    int connection;
 
-void HttpServer::RunEvented(bool verbose) {
-    cout << "Not implemented yet\n";
-    exit(EXIT_SUCCESS);
+    // Buffered relay like HandleProxy
+    if (!co_await ForwardProxyAsync(request, peer, chosen, connection, head, decoder.raw, response, status)) {
+        co_return CreateResponseString(request, "", "", status);
+    }
+    decoder.trailers = false;
+    decoder.excess = false;
+    int done = DecodeUpstreamBody(response, decoder, body, false);
+    while (done == 0) {
+        ssize_t count = co_await reactor.Recv(connection, &chunk[0], chunk.length(), PROXY_TIMEOUT * 1000);
+        if (count > 0) {
+            decoder.raw.append(chunk, 0, count);
+        }
+        done = DecodeUpstreamBody(response, decoder, body, count <= 0);
+    }
+    if (done < 0) {
+        pool->Release(chosen, connection, false);
+        Count(metrics->upstreamfailures);
+        co_return CreateResponseString(request, "", "", BAD_GATEWAY);
+    }
+    pool->Release(chosen, connection, !decoder.excess && !response.close);
+    co_return RewriteUpstreamHead(head, versions[request.get_version()], body.length()) + body;
 }
 
 void HttpServer::ParseRequest(HttpRequest& request, bool verbose, const char* recvbuf) {
@@ -416,10 +2497,8 @@ void HttpServer::ParseRequest(HttpRequest& request, bool verbose, const char* re
         uri += recvbuf[i];
         i++;
     }
-    path = DIRECTORY;
-
     // Parse URI, sanitizing output
-    ParseUri(uri, path, query, type);
+    bool malformed = !ParseUri(uri, path, query, type);
     i++;
     if (verbose && path.length() > URI_MAX_LENGTH) {
         cout << "Request URI too long.\n";
@@ -443,48 +2522,16 @@ void HttpServer::ParseRequest(HttpRequest& request, bool verbose, const char* re
         cout << "Invalid HTTP version.\n";
     }
 
-    // Fill request struct
+    // Fill request struct, parse the header lines that follow and pick a route
     request.Initialize(method, version, copy, path, query, type);
+    request.set_malformed(malformed);
+    request.ParseHeaders(i);
+    ResolveRoute(request);
+    Count(metrics->requests);
+    TRACE_REQUEST(request.get_connection(), method, path.c_str());
 }
 
-string HttpServer::HandleRequestThreaded(HttpRequest& request, bool verbose, bool& cached) {
-    HttpRequest* cachedreq;
-    string response = "";
-
-    // Lock cache and try to read
-    if (verbose) {
-        cout << "Searching cache...\n";
-    }
-    for (auto item = cache.begin(); item != cache.end(); item++) {
-        // Check cache for saved response
-        cachedreq = (*item).first;
-        response = (*item).second;
-        if (request.Equals(*cachedreq)) {
-            if (verbose) {
-                cout << "Serving from cache\n\n";
-            }
-            cached = true;
-        }
-    }
-    // Release lock
-    pthread_mutex_unlock(&cachemutex);
-
-    if (!cached) {
-        // Not found, create a new response
-        if (verbose) {
-            cout << "Not found in cache.\n";
-        }
-        response = HandleRequest(request, verbose);
-    } else {
-        if (verbose) {
-            cout << endl << "Response: " << response << endl << endl;
-        }
-    }
-
-    return response;
-}
-
-string HttpServer::HandleRequest(HttpRequest& request, bool verbose) {
+string HttpServer::HandleRequest(HttpRequest& request, bool verbose, const string& peer) {
     bool toolong = request.get_flag();
     http_status_t status = OK;
     http_method_t method = request.get_method();
@@ -498,8 +2545,8 @@ string HttpServer::HandleRequest(HttpRequest& request, bool verbose) {
     if (toolong) {
         // Request entity too large
         status = REQUEST_ENTITY_TOO_LARGE;
-    } else if (version == INVALID_VERSION) {
-        // Invalid request
+    } else if (version == INVALID_VERSION || request.get_malformed()) {
+        // Invalid request, or a URI that doesn't decode
         status = BAD_REQUEST;
     } else if (method == INVALID_METHOD) {
         // Unrecognized method
@@ -509,16 +2556,31 @@ string HttpServer::HandleRequest(HttpRequest& request, bool verbose) {
         status = REQUEST_URI_TOO_LARGE;
     } else {
         // Handle each HTTP method
-        if (method == GET) {
-            // Get URI resource by opening file
-            response = HandleGet(request, status);
-        } else {
+        if (method != GET) {
             // Unimplemented methods
             cout << "Not implemented yet\n";
             status = NOT_IMPLEMENTED;
+        } else if (request.get_route() == NULL) {
+            // No route matches the URI
+            status = NOT_FOUND;
+        } else if (request.get_route()->handler == STATIC_HANDLER || request.get_route()->handler == PHP_HANDLER) {
+            // Get URI resource by opening file
+            response = HandleGet(request, status);
+        } else if (request.get_route()->handler == REDIRECT_HANDLER) {
+            response = HandleRedirect(request);
+        } else if (request.get_route()->handler == METRICS_HANDLER) {
+            request.set_content_type(PLAINTEXT);
+            response = CreateResponseString(request, "", FormatMetrics(), OK);
+        } else if (request.get_route()->handler == PROXY_HANDLER) {
+            response = HandleProxy(request, peer);
         }
     }
 
+    // Errors carry no body
+    if (response.empty()) {
+        response = CreateResponseString(request, "", "", status);
+    }
+
     // Send response
     if (verbose) {
         cout << endl << "Response: " << response << endl << endl;
@@ -549,12 +2611,22 @@ string HttpServer::HandleGet(HttpRequest request, http_status_t status) {
     if (!file.good()) {
         perror("fstream::open");
         status = NOT_FOUND;
+        Count(metrics->notfound);
+    } else {
+        TRACE_FILE_OPEN(request.get_connection(), path.c_str(), -1LL);
     }
 
     if (method == GET && status == OK) {
         if (strcmp(type.c_str(), APP_PHP) == 0) {
-            // Execute PHP file 
-            body = ExecutePhp(file, copy);
+            // Execute PHP file, unless the micro-cache has its output. The epoll loop must not
+            // block on a flight, the coroutine executing it may be waiting on the loop.
+            microcache_result_t result = LookupPhp(request, body, !reactor.is_attached());
+            if (result != MICROCACHE_FRESH && result != MICROCACHE_STALE) {
+                // Copied through the stream buffer, a read error such as a directory only sets failbit
+                stringstream source;
+                source << file.rdbuf();
+                body = RunPhp(request, source.str(), result);
+            }
 
             // Return output type as plaintext
             request.set_content_type(HTML);
@@ -573,26 +2645,95 @@ string HttpServer::HandleGet(HttpRequest request, http_status_t status) {
     return response;
 }
 
-string HttpServer::CreateResponseString(HttpRequest request, string response, string body, http_status_t status) {
+string HttpServer::HandleRedirect(HttpRequest& request) {
+    const route* matched = request.get_route();
+    string location = matched->target;
+
+    // Prefix redirects carry the rest of the URI over to the target
+    if (!matched->exact) {
+        location += request.get_uri().substr(matched->uri.length());
+    }
+    Count(metrics->redirects);
+    return CreateResponseString(request, "", "", MOVED_PERMANENTLY, LOCATION + location + CRLF);
+}
+
+string HttpServer::FormatMetrics() {
+    stringstream body;
+
+    // One "name value" pair per line
+    body << "connections " << metrics->connections << "\n";
+    body << "requests " << metrics->requests << "\n";
+    body << "pack_hits " << metrics->packhits << "\n";
+    body << "cache_hits " << metrics->cachehits << "\n";
+    body << "cache_misses " << metrics->cachemisses << "\n";
+    body << "cache_stores " << cache.get_stores() << "\n";
+    body << "cache_evictions " << cache.get_evictions() << "\n";
+    body << "php_executions " << metrics->phpexecutions << "\n";
+    body << "microcache_hits " << metrics->microcachehits << "\n";
+    body << "microcache_stale " << metrics->microcachestale << "\n";
+    body << "redirects " << metrics->redirects << "\n";
+    body << "not_found " << metrics->notfound << "\n";
+    body << "upstream_connects " << metrics->upstreamconnects << "\n";
+    body << "upstream_reuses " << metrics->upstreamreuses << "\n";
+    body << "upstream_failures " << metrics->upstreamfailures << "\n";
+    body << "http2_connections " << metrics->http2connections << "\n";
+    body << "http2_streams " << metrics->http2streams << "\n";
+    body << "tls_handshakes " << metrics->tlshandshakes << "\n";
+    body << "tls_resumed " << metrics->tlsresumed << "\n";
+    body << "ktls_send " << metrics->ktlssend << "\n";
+    body << "admission_client_rejects " << metrics->clientrejects << "\n";
+    body << "admission_rate_limited " << metrics->ratelimited << "\n";
+    body << "admission_shed " << metrics->shed << "\n";
+    body << "client_read_timeouts " << metrics->readtimeouts << "\n";
+    body << "client_oversized " << metrics->oversized << "\n";
+    body << "admission_inflight " << admission.get_inflight() << "\n";
+    body << "memory_connections " << metrics->memoryconnections << "\n";
+    body << "memory_connection_bytes " << metrics->memorybytes << "\n";
+    body << "memory_bytes_per_connection " << (metrics->memoryconnections > 0 ? metrics->memorybytes / metrics->memoryconnections : 0) << "\n";
+    body << "memory_pool_bytes " << metrics->poolbytes << "\n";
+    body << "memory_budget " << memory.budget << "\n";
+    body << "memory_shed " << metrics->memoryshed << "\n";
+    body << "memory_rejects " << metrics->memoryrejects << "\n";
+
+    // Pools are per process, so these cover the worker answering this request
+    body << "buffer_pool_reused " << buffers.get_reused() << "\n";
+    body << "buffer_pool_allocated " << buffers.get_allocated() << "\n";
+    for (auto item = upstreams.begin(); item != upstreams.end(); item++) {
+        body << item->second->FormatStats();
+    }
+    return body.str();
+}
+
+string HttpServer::CreateResponseString(HttpRequest request, string response, string body, http_status_t status, string extra) {
+    // Request fields
+    int contentlen = body.length();
+
+    // Create a new response
+    string newresponse = response;
+
+    // Append headers and body to buffer
+    newresponse += CreateResponseHeader(request, contentlen, status, extra);
+    newresponse += body;
+    return newresponse;
+}
+
+string HttpServer::CreateResponseHeader(HttpRequest request, size_t contentlen, http_status_t status, string extra) {
     // Time structs for GMT time
     time_t now;
     struct tm* gmnow;
 
     // Request fields
-    int contentlen = body.length() == 0 ? 0 : body.length() - 1;
     http_method_t method = request.get_method();
     http_version_t version = request.get_version();
     string type = request.get_content_type();
-
-    // Create a new response
-    string newresponse = response;
+    string newresponse = "";
 
     // Get GMT time
     time(&now);
     gmnow = gmtime(&now);
 
-    // Append status line and body to buffer
-    newresponse += versions[version];
+    // Append status line to buffer, answering unparseable versions as HTTP/1.1
+    newresponse += versions[version == INVALID_VERSION ? ONE_POINT_ONE : version];
     newresponse += SPACE;
     newresponse += statuses[status];
     newresponse += CRLF;
@@ -608,16 +2749,61 @@ string HttpServer::CreateResponseString(HttpRequest request, string response, st
         newresponse += CONTENT_LENGTH;
         newresponse += std::to_string(contentlen);
         newresponse += CRLF;
+
+        // Per-route freshness policy
+        if (request.get_route() != NULL && request.get_route()->maxage >= 0) {
+            newresponse += CACHE_CONTROL;
+            newresponse += "max-age=" + std::to_string(request.get_route()->maxage);
+            newresponse += CRLF;
+        }
+    } else if (status != NOT_MODIFIED) {
+        // Keep-alive clients need the length of error and redirect bodies too
+        newresponse += CONTENT_LENGTH;
+        newresponse += std::to_string(contentlen);
+        newresponse += CRLF;
     }
-    // Add time and body
+    // Caller supplied headers, each ending in CRLF
+    newresponse += extra;
+
+    // Add time
     newresponse += DATE;
     newresponse += asctime(gmnow);
     newresponse += CRLF;
-    newresponse += body;
     return newresponse;
 }
 
 string HttpServer::ExecutePhp(fstream& file, string request) {
+    string src = "";
+    int c;
+
+    // Get PHP source code to execute
+    c = file.get();
+    while (c != EOF) {
+        src += (char) c;
+        c = file.get();
+    }
+    return ExecutePhp(src, request);
+}
+
+// header() for scripts. Only Cache-Control is kept, it drives the micro-cache.
+static int phpHeader(ph7_context* context, int argc, ph7_value** argv) {
+    string* control = (string*) ph7_context_user_data(context);
+    int length = 0;
+    int skip = 14;
+
+    if (argc > 0) {
+        const char* line = ph7_value_to_string(argv[0], &length);
+        if (length > skip && strncasecmp(line, "Cache-Control:", skip) == 0) {
+            while (skip < length && line[skip] == ' ') {
+                skip++;
+            }
+            control->assign(line + skip, length - skip);
+        }
+    }
+    return PH7_OK;
+}
+
+string HttpServer::ExecutePhp(const string& source, const string& request, string* control) {
     // PHP engine
     ph7* engine;
     ph7_vm* vm = NULL;
@@ -627,16 +2813,8 @@ string HttpServer::ExecutePhp(fstream& file, string request) {
     int outputlen;
     int error;
     int loglen;
-    int c;
-    string src = "";
     string body = "";
-
-    // Get PHP source code to execute
-    c = file.get();
-    while (c != EOF) {
-        src += (char) c;
-        c = file.get();
-    }
+    string ignored = "";
 
     // Start PHP engine and VM
     error = ph7_init(&engine);
@@ -646,7 +2824,7 @@ string HttpServer::ExecutePhp(fstream& file, string request) {
     }
     
     // Compile source code
-    error = ph7_compile_v2(engine, src.c_str(), -1, &vm, 0);
+    error = ph7_compile_v2(engine, source.c_str(), -1, &vm, 0);
     if (error != PH7_OK) {
         if (error == PH7_COMPILE_ERR) {
             ph7_config(engine, PH7_CONFIG_ERR_LOG, &errlog, &loglen);
@@ -659,14 +2837,18 @@ string HttpServer::ExecutePhp(fstream& file, string request) {
     
     // Populate POST, GET, UPDATE, DELETE fields of PHP engine
     ph7_vm_config(vm, PH7_VM_CONFIG_HTTP_REQUEST, request.c_str(), request.length());
+    ph7_create_function(vm, "header", phpHeader, control != NULL ? control : &ignored);
     
     // The actual execution of code
     ph7_vm_exec(vm, 0);
 
-    // Get output string from VM
+    Count(metrics->phpexecutions);
+
+    // Copy the output out of the VM, it is freed along with the VM
     error = ph7_vm_config(vm, PH7_VM_CONFIG_EXTRACT_OUTPUT, &uncast, &outputlen);
     if (error == PH7_OK) {
         output = (const char*) uncast;
+        body.assign(output, outputlen);
     }
 
     // Clean up any resources held by the execution engine
@@ -675,10 +2857,48 @@ cleanup:
     if (vm != NULL) {
         ph7_vm_release(vm);
     }
+    return body;
+}
+
+microcache_result_t HttpServer::LookupPhp(HttpRequest& request, string& body, bool block) {
+    const route* matched = request.get_route();
+    microcache_result_t result;
+
+    // Keyed by path and query, the routes that enable it vouch for output not varying otherwise
+    if (matched == NULL || matched->microcache <= 0) {
+        return MICROCACHE_PASS;
+    }
+    result = microcache.Begin(request.get_path() + "?" + request.get_query(), body, block);
+    if (result == MICROCACHE_FRESH) {
+        Count(metrics->microcachehits);
+    } else if (result == MICROCACHE_STALE) {
+        Count(metrics->microcachestale);
+    }
+    if (result == MICROCACHE_FRESH || result == MICROCACHE_STALE) {
+        TRACE_CACHE_HIT(request.get_connection(), request.get_path().c_str(), body.length(), TRACE_CACHE_MICRO);
+    } else if (result == MICROCACHE_LEAD) {
+        TRACE_CACHE_MISS(request.get_connection(), request.get_path().c_str(), TRACE_CACHE_MICRO);
+    }
+    return result;
+}
+
+string HttpServer::RunPhp(HttpRequest& request, const string& source, microcache_result_t result) {
+    const route* matched = request.get_route();
+    string control = "";
 
-    if (output != NULL) {
-        body += output;
+    TRACE_PHP_START(request.get_connection(), request.get_path().c_str());
+    string body = ExecutePhp(source, request.get_copy(), &control);
+    TRACE_PHP_END(request.get_connection(), request.get_path().c_str(), body.length());
+
+    if (result != MICROCACHE_LEAD) {
+        return body;
     }
+
+    // The script's Cache-Control overrides the route's lifetimes or keeps the output out
+    int ttl = matched->microcache;
+    int stale = matched->stale;
+    bool store = control.empty() || ParseCacheControl(control, ttl, stale);
+    microcache.Finish(request.get_path() + "?" + request.get_query(), body, ttl > 0 ? ttl : 0, stale > 0 ? stale : 0, store);
     return body;
 }
 
@@ -706,146 +2926,128 @@ http_version_t HttpServer::GetVersion(const string version) {
     return INVALID_VERSION;
 }
 
-string HttpServer::GetMimeType(string extension) {
-    if (extension.compare("txt") == 0) {
-        return "text/plain";
-    } else if (extension.compare("html") == 0) {
-        return "text/html";
-    } else if (extension.compare("js") == 0) {
-        return "application/js";
-    } else if (extension.compare("php") == 0) {
-        return "application/php";
-    } else if (extension.compare("css") == 0) {
-        return "text/css";
-    } else if (extension.compare("png") == 0) {
-        return "image/png";
-    } else if (extension.compare("jpg") == 0) {
-        return "image/jpeg";
-    } else if (extension.compare("gif") == 0) {
-        return "image/gif";
-    } else {
-        return "unknown";
-    }
+bool HttpServer::IsStaticGet(HttpRequest& request) {
+    // Same checks as HandleRequest, for requests that would read a file verbatim
+    return !request.get_flag() && !request.get_malformed() && request.get_version() != INVALID_VERSION && request.get_method() == GET &&
+           request.get_path().length() <= URI_MAX_LENGTH && request.get_content_type().compare(APP_PHP) != 0;
 }
 
-void HttpServer::ParseUri(string& uri, string& path, string& query, string& type) {
-    int relpath = uri.find(PREVDIR);
-    int length;
-    int i = 0;
-    string hex = "";
-    string extension = "";
-    char c;
-
-    // Sanitize string, checking for weird relative paths such as "/.."
-    // "/." is ok
-    while (relpath != string::npos) {
-        uri.erase(relpath, strlen(PREVDIR));
-        relpath = uri.find(PREVDIR);
-    }
-    length = uri.length();
-    
-    // Get path right before query, while sanitizing unsafe ascii characters
-    // "%HEX" is interpreted as the character with ascii value HEX
-    // "+" is interpreted as a space character
-    while (i <= length && uri[i] != '?') {
-        if (uri[i] == '%') {
-            // Unsafe ascii conversion
-            i++;
-            hex += uri[i];
-            i++;
-            hex += uri[i];
-            c = hexToAscii(hex);
-        } else if (uri[i] == '+') {
-            // Space
-            c = ' ';
-        } else {
-            // Safe ascii
-            c = uri[i];   
-        }
-        path += c;
-        i++;
-    }
-
-    // Skip past '?'
-    i++;
+string HttpServer::GetMimeType(string extension) {
+    return MimeType(extension);
+}
 
-    // Get query
-    while (i <= length) {
-        query += uri[i];
-        i++;
-    }
+bool HttpServer::ParseUri(const string& uri, string& path, string& query, string& type) {
+    string extension;
 
-    // Get type from path
-    i = path.length();
-    while (i > 0 && path[i] != '.') {
-        i--;
-    }
-    i++;
-    while (i <= path.length() && !isspace(path[i]) && path[i] != (char) NULL) {
-        extension += path[i];
-        i++;
+    // Decoding, dot segments, query and extension in one scan, see uri.h
+    if (!DecodeUri(uri.c_str(), uri.length(), path, query, extension)) {
+        return false;
     }
 
     // Interpret MIME type using extension string
     type = GetMimeType(extension);
+    return true;
 }
 
 ////////////////////////////////////////////////
 //              HttpRequest                   //
 ////////////////////////////////////////////////
 HttpRequest::HttpRequest(http_method_t method, http_version_t version, string copy, string path, string query, string type) {
+    connection = -1;
     Initialize(method, version, copy, path, query, type);
 }
 
 HttpRequest::HttpRequest() {
+    connection = -1;
     Initialize(INVALID_METHOD, INVALID_VERSION, "", "", "", "");
 }
 
 void HttpRequest::Initialize(http_method_t method, http_version_t version, string copy, string path, string query, string type) {
-    // Call parent initialization
+    // Call parent initialization, dropping headers of a previous request
+    ClearHeaders();
     toolong = false;
+    malformed = false;
     this->method = method;
     this->version = version;
     this->copy = copy;
     this->path = path;
     this->query = query;
     this->type = type;
+    this->uri = "";
+    this->matched = NULL;
 }
 
-void HttpRequest::ParseHeaders(const char* buffer, int index) {
-    int i = index;
-    int length = strlen(buffer);
-    string name = "";
-    string value = "";
-    const Header* header;
+void HttpRequest::ParseHeaders(int index) {
+    const char* text = copy.c_str();
+    size_t length = copy.length();
+    size_t i = index;
 
-    while (i <= length) {
-        // Get name of header
-        while (i <= length && buffer[i] != ':') {
-            name += buffer[i];
-            i++;
-        }
-        // Increment twice for : 
-        i += 2;
+    ClearHeaders();
 
-        // Get value of header
-        while (i <= length && buffer[i] != '\r') {
-            value += buffer[i];
-            i++;
+    // One header per line up to the blank line ending the head, values trimmed of whitespace
+    while (i < length) {
+        size_t end = copy.find(CRLF, i);
+        if (end == string::npos) {
+            end = length;
+        }
+        if (end == i) {
+            break;
         }
-        // Increment twice for \r\n
-        i += 2;
-        
-        // Add new header struct
-        if (!isspace(name.c_str()[0])) {
-            header = new Header(name, value);
-            headers.push_back(header);
+        size_t colon = i;
+        while (colon < end && text[colon] != ':') {
+            colon++;
+        }
+        if (colon < end && colon > i && !isspace(text[i])) {
+            size_t value = colon + 1;
+            size_t last = end;
+            while (value < end && (text[value] == ' ' || text[value] == '\t')) {
+                value++;
+            }
+            while (last > value && (text[last - 1] == ' ' || text[last - 1] == '\t')) {
+                last--;
+            }
+            header_span span = { (uint32_t) i, (uint32_t) (colon - i), (uint32_t) value, (uint32_t) (last - value) };
+
+            // The first of repeated known headers wins, unknown ones beyond the overflow are dropped
+            header_id_t id = LookupHeader(text + i, colon - i);
+            if (id != HEADER_UNKNOWN) {
+                if (known[id].name == 0) {
+                    known[id] = span;
+                }
+            } else if (overflowcount < HEADER_OVERFLOW) {
+                overflow[overflowcount++] = span;
+            }
+        }
+        i = end + 2;
+    }
+}
+
+std::string_view HttpRequest::GetHeader(header_id_t id) {
+    if (id == HEADER_UNKNOWN || known[id].name == 0) {
+        return std::string_view();
+    }
+    return std::string_view(copy.data() + known[id].value, known[id].valuelength);
+}
+
+std::string_view HttpRequest::GetHeader(const char* name) {
+    size_t length = strlen(name);
+    header_id_t id = LookupHeader(name, length);
+
+    // Known names are one probe, the rest a scan of the overflow
+    if (id != HEADER_UNKNOWN) {
+        return GetHeader(id);
+    }
+    for (int i = 0; i < overflowcount; i++) {
+        if (overflow[i].namelength == length && strncasecmp(copy.data() + overflow[i].name, name, length) == 0) {
+            return std::string_view(copy.data() + overflow[i].value, overflow[i].valuelength);
         }
-        
-        // Reset fields
-        name = "";
-        value = "";
     }
+    return std::string_view();
+}
+
+void HttpRequest::ClearHeaders() {
+    memset(known, 0, sizeof(known));
+    overflowcount = 0;
 }
 
 void HttpRequest::Reset() {
@@ -853,10 +3055,7 @@ void HttpRequest::Reset() {
     type = "";
     method = INVALID_METHOD;
     version = INVALID_VERSION;
-    while (!headers.empty()) {
-        delete headers.back();
-        headers.pop_back();
-    }
+    ClearHeaders();
 }
 
 HttpRequest::~HttpRequest() {}
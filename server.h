@@ -7,93 +7,348 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <deque>
 #include <fstream>
+#include <unordered_map>
+#include "admission.h"
+#include "affinity.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "capture.h"
+#include "config.h"
+#include "deadline.h"
 #include "http.h"
+#include "http2.h"
+#include "microcache.h"
+#include "pack.h"
+#include "proxy.h"
+#include "reactor.h"
+#include "router.h"
+#include "sockopt.h"
+#include "tls.h"
+#include "trace.h"
+#include "uring.h"
 
 #define ACCEPT_RANGES  "Accept-Ranges: "
 #define BYTES          "bytes"
+#define CACHE_CONTROL  "Cache-Control: "
 #define CONTENT_TYPE   "Content-Type: "
 #define CONTENT_LENGTH "Content-Length: "
+#define CONTENT_ENCODING "Content-Encoding: "
+#define CONNECTION_CLOSE "Connection: close"
 #define DATE           "Date: "
+#define ETAG           "ETag: "
+#define LOCATION       "Location: "
+#define RETRY_AFTER    "Retry-After: "
+#define VARY           "Vary: "
+#define X_FORWARDED_FOR "X-Forwarded-For: "
+#define FILE_CHUNK     65536
+#define QUEUE_BYTES    576      // an empty deque: its map and first block (libstdc++)
 #define TMPFILE        "tmpfile.out"
 
+using std::deque;
 using std::pair;
+using std::unordered_map;
 
 enum server_type {
-    MPROCESS = 0, MTHREADED, EVENTED,
+    MPROCESS = 0, MTHREADED, EVENTED, IO_URING,
 };
 
 struct mthreaded_request_args {
     pair<int, string> client;
     void* ptr;
     bool verbose;
+    int cpu;
+};
+
+// Counters live in shared memory so forked children report into them too
+struct server_metrics {
+    unsigned long connections;
+    unsigned long requests;
+    unsigned long packhits;
+    unsigned long cachehits;
+    unsigned long cachemisses;
+    unsigned long phpexecutions;
+    unsigned long microcachehits;
+    unsigned long microcachestale;
+    unsigned long redirects;
+    unsigned long notfound;
+    unsigned long upstreamconnects;
+    unsigned long upstreamreuses;
+    unsigned long upstreamfailures;
+    unsigned long http2connections;
+    unsigned long http2streams;
+    unsigned long tlshandshakes;
+    unsigned long tlsresumed;
+    unsigned long ktlssend;
+    unsigned long clientrejects;
+    unsigned long ratelimited;
+    unsigned long shed;
+    unsigned long readtimeouts;
+    unsigned long oversized;
+    unsigned long memoryshed;
+    unsigned long memoryrejects;
+
+    // Gauges: evented connections, the bytes they hold and the bytes worker pools keep free
+    unsigned long memoryconnections;
+    unsigned long memorybytes;
+    unsigned long poolbytes;
+};
+
+struct response_segment {
+    // In-memory bytes, a byte range of an open file (file >= 0),
+    // or a range of the asset pack mapping (mapped != NULL)
+    string data;
+    int file;
+    off_t offset;
+    size_t length;
+    const char* mapped;
+
+    // Non-zero while a coroutine handler is still producing this response, nothing behind it is sent
+    unsigned ticket;
+};
+
+struct evented_connection {
+    pair<int, string> client;
+    string inbuf;
+    deque<response_segment> pending;
+    size_t sent;
+    time_t lastactive;
+
+    // Deadline of the request arriving, and set once a rejection is queued: nothing more is
+    // read and the connection closes when its output is written
+    read_deadline reading;
+    bool draining;
+
+    // Bytes written so far, and where and with which status the response going out began (tracing)
+    size_t written;
+    size_t tracestart;
+    int tracestatus;
+
+    // Capture id of the connection, 0 while not capturing
+    uint32_t captured;
+
+    // Bytes the connection holds as last counted into the memory gauges
+    size_t charged;
+
+    // Tells a coroutine handler finishing late whether its connection is still the same one
+    unsigned serial;
+    unsigned tickets;
+
+    // Holds one server wide in-flight slot while responses are queued
+    bool busy;
+
+    // Set once the connection speaks HTTP/2, by prior knowledge or Upgrade: h2c, and its streams
+    // whose coroutine handler is still running
+    Http2Session* h2;
+    unsigned streams;
+
+    // TLS listener only: the handshake runs on epoll readiness before any request is read
+    SSL* tls;
+    bool handshaking;
+    bool tlswrite;
+
+    // io_uring only: staging buffer for file reads and outstanding operations
+    string chunk;
+    int inflight;
+    bool sending;
+    bool closing;
 };
 
 class SocketServer {
 private:
-    // Addresses for the server and the client
-    struct sockaddr_in serveraddr;
-    struct sockaddr_in clientaddr;
-    char peername[INET_ADDRSTRLEN];
+    // Address of the last client, IPv4 or IPv6
+    struct sockaddr_storage clientaddr;
+    char peername[INET6_ADDRSTRLEN];
     
-    // Socket file descriptors
+    // Socket file descriptors and their tuning
     int listening;
+    int tlslistening;
+    socket_options options;
     char recvbuf[BUFFER_LENGTH + 1];
+
 public:
     // Constructor/Destructor
     SocketServer();
     ~SocketServer();
 
-    // Receiving buffer
+    // Receiving buffer and listening socket
     const char* get_buffer() { return recvbuf; }
+    int get_listening() { return listening; }
+    int get_tls_listening() { return tlslistening; }
+    void set_listening(int fd) { listening = fd; }
+    void set_tls_listening(int fd) { tlslistening = fd; }
+    const socket_options& get_options() { return options; }
+    void Configure(const socket_options& options) { this->options = options; }
+
+    // Bound, non-blocking listening socket, exits on failure. Shared sockets join a SO_REUSEPORT group.
+    int Listen(int port, bool shared = false);
+    void ListenHttp(int port);
+    void ListenTls(int port);
 
     // Socket call wrapper methods
-    pair<int, string> Connect();
-    bool Receive(bool verbose, pair<int, string> client);
+    pair<int, string> Connect(int flags = 0, bool tls = false);
+    string PeerName(int connection);
+    void Tune(int connection) { TuneConnection(connection, options); }
+    void Cork(int connection, bool cork);
+    int Receive(bool verbose, pair<int, string> client, string& input, int timeout);
+    int ReceiveNonBlocking(bool verbose, pair<int, string> client);
+    int ReceiveTls(bool verbose, pair<int, string> client, SSL* ssl);
     bool SendResponse(string buffer, int connection);
+    bool SendResponse(string header, const char* body, size_t length, int connection);
     bool Close(int connection);
 };
 
 class HttpServer {
 private: 
     SocketServer server;
-    vector<pair<HttpRequest*, string> > cache;
-    double elapsedtime;
+    RouteTable routes;
+    AssetPack pack;
+    TlsContext tls;
+    int tlsport;
+    Admission admission;
+    Placement placement;
+    unordered_map<const route*, UpstreamPool*> upstreams;
+    server_metrics* metrics;
+    ResponseCache cache;
+    MicroCache microcache;
+    Capture capture;
+
+    // Coroutine handlers of the epoll loop, and the connections they answer
+    Reactor reactor;
+    unordered_map<int, evented_connection>* evented;
+    vector<int> woken;
+    unsigned serials;
+
+    // Slow and oversized requests, see deadline.h. The wheel holds evented connections' deadlines.
+    client_limits clients;
+    TimerWheel deadlines;
+
+    // Connection buffers and the memory budget, see bufpool.h. Each worker sheds its own
+    // idle connections, at most once a second.
+    BufferPool buffers;
+    memory_limits memory;
+    time_t lastreclaim;
     pthread_attr_t attr;
-    pthread_mutex_t cachemutex;
 public:
     // Constructor/Destructor
     HttpServer();
     ~HttpServer();
 
+    // Route table compiled from the configuration
+    bool Configure(const ServerConfig& config);
+    void ResolveRoute(HttpRequest& request);
+
+    // Preloaded static assets, see mkpack
+    bool LoadPack(const char* filename);
+    bool LookupPacked(HttpRequest& request, string& header, const char*& body, size_t& length);
+
+    // HTTPS listener next to the plain one, see tls.h
+    bool EnableTls(const char* certificate, const char* key, int port);
+
+    // Records what clients send for bench/replay, see capture.h
+    bool EnableCapture(const char* filename);
+
+    // CPU pinning and NUMA placement of workers, see affinity.h
+    bool SetPlacement(const char* cpus, bool numa, bool steer);
+
+    // Admission control, see admission.h. Workers hold an in-flight slot for their connection.
+    bool AdmitConnection(pair<int, string> client, bool worker);
+    void ReleaseConnection(const string& peer, bool worker);
+    bool Throttled(HttpRequest& request, const string& peer, string& response);
+    bool ShedEvented(HttpRequest& request, evented_connection& conn, string& response);
+    void SettleEvented(evented_connection& conn);
+    string HandleOverload(HttpRequest& request, http_status_t status);
+
+    // Request deadlines and size limits, see deadline.h
+    frame_t ReceiveRequest(bool verbose, pair<int, string> client, uint32_t captured, string& input, read_deadline& reading, long long idleuntil, size_t& head, size_t& total);
+    string RejectRequest(frame_t frame, const string& input, size_t head);
+    void RejectEvented(evented_connection& conn, frame_t frame, size_t head);
+    void ArmEvented(evented_connection& conn);
+    void ExpireEvented(unordered_map<int, evented_connection>& connections, vector<int>& expired);
+
+    // Per connection memory accounting, see bufpool.h
+    void ChargeEvented(evented_connection& conn);
+    void IdleEvented(evented_connection& conn);
+    bool OverBudget();
+    bool ReclaimEvented(unordered_map<int, evented_connection>& connections, vector<int>& victims, time_t now);
+
+    // Reverse proxy, see proxy.h
+    string BuildUpstreamRequest(HttpRequest& request, const string& peer);
+    bool ForwardProxy(HttpRequest& request, const string& peer, upstream*& chosen, int& connection, string& head, string& rest, upstream_response& response, http_status_t& status);
+    string HandleProxy(HttpRequest& request, const string& peer);
+    bool RelayProxy(HttpRequest& request, const string& peer, int client);
+    void CheckUpstreams();
+
     // Multi-process request handling
     void Run(server_type type, bool verbose);
+    void RunWorkers(server_type type, bool verbose);
     void RunMultiProcessed(bool verbose);
-    void DispatchRequestToChild(bool verbose, pair<int, string> client);
+    void DispatchRequestToChild(bool verbose, pair<int, string> client, int cpu);
 
     // Multi-threaded request handling
     void RunMultiThreaded(bool verbose);
-    void* DispatchRequestToThread(bool verbose, pair<int, string> client);
+    void* DispatchRequestToThread(bool verbose, pair<int, string> client, int cpu);
     static void* CallDispatchRequestToThread(void* args); 
     
-    // Evented request handling
+    // Evented request handling, epoll or io_uring
     void RunEvented(bool verbose);
+    void RunUring(bool verbose);
+    void ProcessEvented(evented_connection& conn, bool verbose);
+    bool FlushEvented(evented_connection& conn);
+    bool WriteEvented(evented_connection& conn);
+    bool HandshakeEvented(evented_connection& conn);
+    void PumpUring(IoUring& ring, evented_connection& conn);
+    void QueueResponse(HttpRequest& request, bool verbose, evented_connection& conn);
+    bool RearmEvented(int epoll, evented_connection& conn, bool open);
+    void ReleaseEvented(evented_connection& conn);
+    void TraceSent(evented_connection& conn, const response_segment& segment);
+
+    // Coroutine handlers on the epoll loop, see reactor.h. They never block the loop:
+    // files are read through the reactor's file threads and upstreams on readiness.
+    bool IsAsyncGet(HttpRequest& request);
+    Task<void> RespondAsync(HttpRequest request, pair<int, string> client, unsigned serial, unsigned ticket, bool verbose);
+    Task<string> HandleGetAsync(HttpRequest request, http_status_t status);
+    Task<bool> ForwardProxyAsync(HttpRequest& request, const string& peer, upstream*& chosen, int& connection, string& head, string& rest, upstream_response& response, http_status_t& status);
+    Task<string> HandleProxyAsync(HttpRequest request, string peer);
+
+    // HTTP/2 on evented connections, see http2.h
+    bool UpgradeHttp2(HttpRequest& request, bool verbose, evented_connection& conn);
+    void ProcessHttp2(evented_connection& conn, bool verbose);
+    void RespondHttp2(evented_connection& conn, uint32_t stream, HttpRequest& request, bool verbose);
+    void RespondHttp2(evented_connection& conn, uint32_t stream, const string& response);
+    Task<void> RespondHttp2Async(HttpRequest request, pair<int, string> client, unsigned serial, uint32_t stream, bool verbose);
+    bool FeedHttp2(evented_connection& conn);
 
     // Request handling methods
     void ParseRequest(HttpRequest& request, bool verbose, const char* recvbuf);
-    string HandleRequestThreaded(HttpRequest& request, bool verbose, bool& cached);
-    string HandleRequest(HttpRequest& request, bool verbose);
+    string HandleRequest(HttpRequest& request, bool verbose, const string& peer = "");
+
+    // Response cache shared by every worker, see cache.h
+    bool IsCacheable(HttpRequest& request);
+    string HandleRequestCached(HttpRequest& request, bool verbose, const string& peer = "");
+    void CacheResponse(HttpRequest& request, const string& response);
 
     // Response creating method
     string HandleGet(HttpRequest request, http_status_t status);
     string ExecutePhp(fstream& file, string request);
-    string CreateResponseString(HttpRequest request, string response, string body, http_status_t status);
+    string ExecutePhp(const string& source, const string& request, string* control = NULL);
+
+    // PHP output micro-cache for routes with microcache=, see microcache.h
+    microcache_result_t LookupPhp(HttpRequest& request, string& body, bool block);
+    string RunPhp(HttpRequest& request, const string& source, microcache_result_t result);
+    string CreateResponseString(HttpRequest request, string response, string body, http_status_t status, string extra = "");
+    string HandleRedirect(HttpRequest& request);
+    string FormatMetrics();
+    string CreateResponseHeader(HttpRequest request, size_t contentlen, http_status_t status, string extra = "");
     
     // Helper methods
     http_method_t GetMethod(const string method);
     http_version_t GetVersion(const string version);
+    bool IsStaticGet(HttpRequest& request);
+    void Count(unsigned long& counter) { __sync_fetch_and_add(&counter, 1); }
     string GetMimeType(string extension);
-    void ParseUri(string& uri, string& path, string& query, string& type);
+    bool ParseUri(const string& uri, string& path, string& query, string& type);
 };
 
 #endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "http.h"
+#include "sockopt.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+////////////////////////////////////////////////
+//              Socket Options                //
+////////////////////////////////////////////////
+
+socket_options DefaultSocketOptions() {
+    socket_options options;
+    options.port = PORT;
+    options.backlog = BACKLOG;
+    options.ipv6 = false;
+    options.nodelay = true;
+    options.cork = false;
+    options.deferaccept = 0;
+    options.fastopen = 0;
+    options.rcvbuf = 0;
+    options.sndbuf = 0;
+    options.busypoll = 0;
+    return options;
+}
+
+// setsockopt for an int value, perror with the option's name on failure
+static bool setOption(int fd, int level, int name, int value, const char* label) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        perror(label);
+        return false;
+    }
+    return true;
+}
+
+bool TuneListener(int listening, const socket_options& options) {
+    // Restarts may rebind while old connections sit in TIME_WAIT
+    if (!setOption(listening, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR")) {
+        return false;
+    }
+    if (options.ipv6) {
+        setOption(listening, IPPROTO_IPV6, IPV6_V6ONLY, 0, "IPV6_V6ONLY");
+    }
+
+    // Buffer sizes go on the listener so the window scale offered in the SYN-ACK matches them
+    if (options.rcvbuf > 0) {
+        setOption(listening, SOL_SOCKET, SO_RCVBUF, options.rcvbuf, "SO_RCVBUF");
+    }
+    if (options.sndbuf > 0) {
+        setOption(listening, SOL_SOCKET, SO_SNDBUF, options.sndbuf, "SO_SNDBUF");
+    }
+    if (options.deferaccept > 0) {
+        setOption(listening, IPPROTO_TCP, TCP_DEFER_ACCEPT, options.deferaccept, "TCP_DEFER_ACCEPT");
+    }
+    if (options.fastopen > 0) {
+        setOption(listening, IPPROTO_TCP, TCP_FASTOPEN, options.fastopen, "TCP_FASTOPEN");
+    }
+
+    // Raising it past net.core.busy_read needs CAP_NET_ADMIN
+    if (options.busypoll > 0) {
+        setOption(listening, SOL_SOCKET, SO_BUSY_POLL, options.busypoll, "SO_BUSY_POLL");
+    }
+    return true;
+}
+
+void TuneConnection(int connection, const socket_options& options) {
+    // Responses are written whole, so Nagle would only delay the last segment.
+    // Buffer sizes and busy polling are inherited from the listener.
+    if (options.nodelay) {
+        setOption(connection, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+}
+
+void CorkConnection(int connection, bool cork) {
+    int value = cork ? 1 : 0;
+    setsockopt(connection, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+}
+
+// End of file
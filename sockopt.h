@@ -0,0 +1,33 @@
+#pragma once
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+// Socket tuning, set with the config's socket directive. 0 leaves a knob at the kernel default.
+struct socket_options {
+    int port;               // plain HTTP listener
+    int backlog;            // accept queue length passed to listen()
+    bool ipv6;              // listen on [::] and accept IPv4 as mapped addresses too
+    bool nodelay;           // TCP_NODELAY on accepted connections
+    bool cork;              // TCP_CORK while a response's header and body are written
+    int deferaccept;        // TCP_DEFER_ACCEPT, seconds to wait for the request before accept
+    int fastopen;           // TCP_FASTOPEN queue length, data in the SYN skips a round trip
+    int rcvbuf;             // SO_RCVBUF bytes, inherited by accepted connections
+    int sndbuf;             // SO_SNDBUF bytes, inherited by accepted connections
+    int busypoll;           // SO_BUSY_POLL microseconds spent polling the device queue on receive
+};
+
+// Defaults: port PORT, backlog BACKLOG, nodelay on, everything else off
+socket_options DefaultSocketOptions();
+
+// Options that must be set before bind/listen, failures other than SO_REUSEADDR only warn
+bool TuneListener(int listening, const socket_options& options);
+
+// Options set on every accepted connection
+void TuneConnection(int connection, const socket_options& options);
+
+// Holds back partial segments while set, clearing it sends whatever is queued
+void CorkConnection(int connection, bool cork);
+
+#endif
+
+// End of header
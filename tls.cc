@@ -0,0 +1,168 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+////////////////////////////////////////////////
+//              TlsContext                    //
+////////////////////////////////////////////////
+
+// ALPN: h2 when the client offers it, the connection preface then switches to HTTP/2
+static int selectProtocol(SSL* ssl, const unsigned char** out, unsigned char* outlength, const unsigned char* in, unsigned int inlength, void* arg) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    unsigned char* selected;
+
+    if (SSL_select_next_proto(&selected, outlength, protocols, sizeof(protocols) - 1, in, inlength) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext() {
+    ctx = NULL;
+}
+
+TlsContext::~TlsContext() {
+    if (ctx != NULL) {
+        SSL_CTX_free(ctx);
+    }
+}
+
+bool TlsContext::Initialize(const char* certificate, const char* key) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    if (SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1 || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    // kTLS moves record encryption into the kernel once the handshake is done, so sendfile keeps working
+    long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    // Resumption: server side session cache for session IDs, plus stateless tickets
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*) TLS_SESSION_CONTEXT, strlen(TLS_SESSION_CONTEXT));
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_set_num_tickets(ctx, 2);
+    SSL_CTX_set_alpn_select_cb(ctx, selectProtocol, NULL);
+    return true;
+}
+
+SSL* TlsContext::Accept(int connection) {
+    int nodelay = 1;
+
+    // Records already batch the writes, Nagle would only hold back the tail of each flight
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    SSL* ssl = SSL_new(ctx);
+    if (ssl == NULL) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
+    }
+    if (SSL_set_fd(ssl, connection) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+////////////////////////////////////////////////
+//              Connection Helpers            //
+////////////////////////////////////////////////
+
+// Maps an OpenSSL result onto the errno convention of the plain socket calls
+static ssize_t result(SSL* ssl, int count) {
+    int error = SSL_get_error(ssl, count);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ERR_clear_error();
+    if (error == SSL_ERROR_ZERO_RETURN) {
+        return 0;
+    }
+    errno = EPIPE;
+    return -1;
+}
+
+tls_status_t TlsHandshake(SSL* ssl) {
+    int count = SSL_do_handshake(ssl);
+    if (count == 1) {
+        return TLS_DONE;
+    }
+    int error = SSL_get_error(ssl, count);
+    if (error == SSL_ERROR_WANT_READ) {
+        return TLS_WANT_READ;
+    } else if (error == SSL_ERROR_WANT_WRITE) {
+        return TLS_WANT_WRITE;
+    }
+    ERR_clear_error();
+    return TLS_ERROR;
+}
+
+ssize_t TlsRead(SSL* ssl, char* buffer, size_t length) {
+    int count = SSL_read(ssl, buffer, length);
+    return count > 0 ? count : result(ssl, count);
+}
+
+ssize_t TlsWrite(SSL* ssl, const char* data, size_t length) {
+    int count = SSL_write(ssl, data, length);
+    return count > 0 ? count : result(ssl, count);
+}
+
+ssize_t TlsSendfile(SSL* ssl, int file, off_t offset, size_t length) {
+    char chunk[TLS_CHUNK];
+
+    // With kTLS the kernel encrypts straight from the page cache
+    if (TlsKernelSend(ssl)) {
+        ssize_t count = SSL_sendfile(ssl, file, offset, length, 0);
+        return count >= 0 ? count : result(ssl, count);
+    }
+
+    // Otherwise one record's worth goes through user space, a retry re-reads the same bytes
+    if (length > sizeof(chunk)) {
+        length = sizeof(chunk);
+    }
+    ssize_t count = pread(file, chunk, length, offset);
+    if (count <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    return TlsWrite(ssl, chunk, count);
+}
+
+bool TlsKernelSend(SSL* ssl) {
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+void TlsClose(SSL* ssl) {
+    // Best effort close_notify, the socket is non-blocking and closed right after
+    SSL_shutdown(ssl);
+    ERR_clear_error();
+    SSL_free(ssl);
+}
+
+// End of file
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+#define TLS_SESSION_CACHE   20480
+#define TLS_SESSION_TIMEOUT 3600
+#define TLS_SESSION_CONTEXT "http"
+#define TLS_CHUNK           16384
+#define TLS_SESSION_BYTES   8192    // an idle SSL object with its buffers released, roughly
+
+enum tls_status_t {
+    TLS_ERROR = -1, TLS_DONE, TLS_WANT_READ, TLS_WANT_WRITE,
+};
+
+// Server side TLS configuration: certificate, session cache, tickets and kTLS
+class TlsContext {
+private:
+    SSL_CTX* ctx;
+public:
+    // Constructor/Destructor
+    TlsContext();
+    ~TlsContext();
+
+    // Loads the certificate chain and key, false when TLS cannot be offered
+    bool Initialize(const char* certificate, const char* key);
+    bool is_enabled() { return ctx != NULL; }
+
+    // New server side connection on a non-blocking socket, the handshake is driven by TlsHandshake
+    SSL* Accept(int connection);
+};
+
+// Non-blocking connection helpers, reads and writes return -1 with errno EAGAIN when OpenSSL wants to wait
+tls_status_t TlsHandshake(SSL* ssl);
+ssize_t TlsRead(SSL* ssl, char* buffer, size_t length);
+ssize_t TlsWrite(SSL* ssl, const char* data, size_t length);
+ssize_t TlsSendfile(SSL* ssl, int file, off_t offset, size_t length);
+bool TlsKernelSend(SSL* ssl);
+void TlsClose(SSL* ssl);
+
+#endif
+
+// End of header
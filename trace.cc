@@ -0,0 +1,18 @@
+#include "trace.h"
+
+#ifdef HTTP_TRACE
+
+// Raised by tracers for as long as they are attached to the matching probe
+volatile unsigned short http_accept_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_request_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_cache_hit_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_cache_miss_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_file_open_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_php_start_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_php_end_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_response_sent_semaphore __attribute__((section(".probes")));
+volatile unsigned short http_close_semaphore __attribute__((section(".probes")));
+
+#endif
+
+// End of file
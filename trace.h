@@ -0,0 +1,97 @@
+#pragma once
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+// Static tracepoints (USDT) on the request lifecycle, provider "http". Each probe is a nop in
+// the code plus an ELF note that bpftrace, perf and SystemTap attach to, behind a semaphore the
+// tracer raises while attached: untraced, a probe costs one load and a not-taken branch, and its
+// arguments are never evaluated. Without <sys/sdt.h>, or built with -DNO_TRACE, probes compile
+// away entirely. See trace/ for bpftrace scripts.
+//
+// Connection ids are the client descriptor, unique within a process while the connection is open.
+//
+//   accept        (fd, peer)
+//   request       (fd, method, path)             request line and headers parsed
+//   cache_hit     (fd, path, bytes, kind)        kind: TRACE_CACHE_*
+//   cache_miss    (fd, path, kind)
+//   file_open     (fd, path, size)               size -1 when the handler doesn't stat the file
+//   php_start     (fd, path)
+//   php_end       (fd, path, bytes)
+//   response_sent (fd, status, bytes)            last byte of a response handed to the kernel
+//   close         (fd)
+
+#define TRACE_CACHE_RESPONSE  0     // shared response cache
+#define TRACE_CACHE_PACK      1     // preloaded asset pack
+#define TRACE_CACHE_MICRO     2     // PHP output micro-cache
+
+#if !defined(NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HTTP_TRACE 1
+#endif
+#endif
+
+#ifdef HTTP_TRACE
+
+// Semaphores are named the way sdt.h expects them, defined in trace.cc
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+extern volatile unsigned short http_accept_semaphore;
+extern volatile unsigned short http_request_semaphore;
+extern volatile unsigned short http_cache_hit_semaphore;
+extern volatile unsigned short http_cache_miss_semaphore;
+extern volatile unsigned short http_file_open_semaphore;
+extern volatile unsigned short http_php_start_semaphore;
+extern volatile unsigned short http_php_end_semaphore;
+extern volatile unsigned short http_response_sent_semaphore;
+extern volatile unsigned short http_close_semaphore;
+
+#define TRACE_ENABLED(name) __builtin_expect(http_##name##_semaphore != 0, 0)
+
+#define TRACE_ACCEPT(fd, peer) \
+    do { if (TRACE_ENABLED(accept)) DTRACE_PROBE2(http, accept, fd, peer); } while (0)
+#define TRACE_REQUEST(fd, method, path) \
+    do { if (TRACE_ENABLED(request)) DTRACE_PROBE3(http, request, fd, method, path); } while (0)
+#define TRACE_CACHE_HIT(fd, path, bytes, kind) \
+    do { if (TRACE_ENABLED(cache_hit)) DTRACE_PROBE4(http, cache_hit, fd, path, bytes, kind); } while (0)
+#define TRACE_CACHE_MISS(fd, path, kind) \
+    do { if (TRACE_ENABLED(cache_miss)) DTRACE_PROBE3(http, cache_miss, fd, path, kind); } while (0)
+#define TRACE_FILE_OPEN(fd, path, size) \
+    do { if (TRACE_ENABLED(file_open)) DTRACE_PROBE3(http, file_open, fd, path, size); } while (0)
+#define TRACE_PHP_START(fd, path) \
+    do { if (TRACE_ENABLED(php_start)) DTRACE_PROBE2(http, php_start, fd, path); } while (0)
+#define TRACE_PHP_END(fd, path, bytes) \
+    do { if (TRACE_ENABLED(php_end)) DTRACE_PROBE3(http, php_end, fd, path, bytes); } while (0)
+#define TRACE_RESPONSE_SENT(fd, status, bytes) \
+    do { if (TRACE_ENABLED(response_sent)) DTRACE_PROBE3(http, response_sent, fd, status, bytes); } while (0)
+#define TRACE_CLOSE(fd) \
+    do { if (TRACE_ENABLED(close)) DTRACE_PROBE1(http, close, fd); } while (0)
+
+#else
+
+#define TRACE_ENABLED(name) 0
+#define TRACE_ACCEPT(fd, peer) do { } while (0)
+#define TRACE_REQUEST(fd, method, path) do { } while (0)
+#define TRACE_CACHE_HIT(fd, path, bytes, kind) do { } while (0)
+#define TRACE_CACHE_MISS(fd, path, kind) do { } while (0)
+#define TRACE_FILE_OPEN(fd, path, size) do { } while (0)
+#define TRACE_PHP_START(fd, path) do { } while (0)
+#define TRACE_PHP_END(fd, path, bytes) do { } while (0)
+#define TRACE_RESPONSE_SENT(fd, status, bytes) do { } while (0)
+#define TRACE_CLOSE(fd) do { } while (0)
+
+#endif
+
+// Status code of a response starting with its status line, 0 for anything else
+inline int TraceStatus(const char* response, size_t length) {
+    if (length < 12 || response[0] != 'H' || response[4] != '/') {
+        return 0;
+    }
+    return (response[9] - '0') * 100 + (response[10] - '0') * 10 + (response[11] - '0');
+}
+
+#endif
+
+// End of header
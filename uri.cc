@@ -0,0 +1,178 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "uri.h"
+
+////////////////////////////////////////////////
+//              Fast Path                     //
+////////////////////////////////////////////////
+
+// Finds the end of the path, its last '/' and last '.', or returns false as soon as
+// the target holds an escape, a '+' or a segment starting with '.'
+static bool scanPlain(const char* uri, size_t length, size_t& end, size_t& slash, size_t& dot) {
+    size_t i = 0;
+    slash = string::npos;
+    dot = string::npos;
+
+#ifdef __SSE2__
+    // Sixteen bytes per step, one bit per byte in each mask. The carry says whether the
+    // previous block ended in '/', the start of the target counts as one.
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i question = _mm_set1_epi8('?');
+    const __m128i solidus = _mm_set1_epi8('/');
+    const __m128i period = _mm_set1_epi8('.');
+    unsigned carry = 1;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) (uri + i));
+        unsigned escapes = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, percent), _mm_cmpeq_epi8(block, plus)));
+        unsigned questions = _mm_movemask_epi8(_mm_cmpeq_epi8(block, question));
+        unsigned slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(block, solidus));
+        unsigned dots = _mm_movemask_epi8(_mm_cmpeq_epi8(block, period));
+
+        // Only bytes before the query belong to the path
+        if (questions != 0) {
+            unsigned before = (questions & -questions) - 1;
+            escapes &= before;
+            slashes &= before;
+            dots &= before;
+        }
+        if (escapes != 0 || (dots & ((slashes << 1) | carry)) != 0) {
+            return false;
+        }
+        if (slashes != 0) {
+            slash = i + 31 - __builtin_clz(slashes);
+        }
+        if (dots != 0) {
+            dot = i + 31 - __builtin_clz(dots);
+        }
+        if (questions != 0) {
+            end = i + __builtin_ctz(questions);
+            return true;
+        }
+        carry = (slashes >> 15) & 1;
+    }
+#endif
+
+    // Remaining bytes, or the whole target without SSE2
+    for (; i < length; i++) {
+        char c = uri[i];
+        if (c == '?') {
+            end = i;
+            return true;
+        } else if (c == '%' || c == '+') {
+            return false;
+        } else if (c == '.') {
+            if (i == 0 || uri[i - 1] == '/') {
+                return false;
+            }
+            dot = i;
+        } else if (c == '/') {
+            slash = i;
+        }
+    }
+    end = length;
+    return true;
+}
+
+////////////////////////////////////////////////
+//              Decoder                       //
+////////////////////////////////////////////////
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Drops the segment that starts at segment if it is "." or "..", the latter with its parent.
+// Returns true when something was removed, path then ends in '/' (or is empty).
+static bool endSegment(string& path, size_t segment) {
+    size_t length = path.length() - segment;
+    if (length == 1 && path[segment] == '.') {
+        path.resize(segment);
+        return true;
+    }
+    if (length == 2 && path[segment] == '.' && path[segment + 1] == '.') {
+        path.resize(segment);
+        if (segment >= 2) {
+            size_t parent = path.rfind('/', segment - 2);
+            path.resize(parent == string::npos ? 0 : parent + 1);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool DecodeUri(const char* uri, size_t length, string& path, string& query, string& extension) {
+    size_t end;
+    size_t slash;
+    size_t dot;
+
+    // Common case: nothing to decode or resolve, the path is a plain copy
+    if (scanPlain(uri, length, end, slash, dot)) {
+        path.assign(uri, end);
+        query.assign(end < length ? uri + end + 1 : uri + length, end < length ? length - end - 1 : 0);
+        if (dot != string::npos && (slash == string::npos || dot > slash)) {
+            extension.assign(uri + dot + 1, end - dot - 1);
+        } else {
+            extension.clear();
+        }
+        return true;
+    }
+
+    // Decode byte by byte, resolving each segment as it ends
+    size_t segment = 0;
+    dot = string::npos;
+    path.clear();
+    path.reserve(length);
+    query.clear();
+    for (size_t i = 0; i < length; i++) {
+        char c = uri[i];
+        if (c == '?') {
+            query.assign(uri + i + 1, length - i - 1);
+            break;
+        } else if (c == '%') {
+            int high = i + 2 < length ? hexValue(uri[i + 1]) : -1;
+            int low = i + 2 < length ? hexValue(uri[i + 2]) : -1;
+            if (high < 0 || low < 0 || (high == 0 && low == 0)) {
+                return false;
+            }
+            c = (char) (high * 16 + low);
+            i += 2;
+        } else if (c == '+') {
+            c = ' ';
+        }
+
+        if (c == '/') {
+            if (!endSegment(path, segment)) {
+                path += '/';
+            }
+            segment = path.length();
+            dot = string::npos;
+        } else {
+            if (c == '.') {
+                dot = path.length();
+            }
+            path += c;
+        }
+    }
+    if (endSegment(path, segment)) {
+        dot = string::npos;
+    }
+
+    // Extension of the last segment
+    if (dot != string::npos) {
+        extension.assign(path, dot + 1, string::npos);
+    } else {
+        extension.clear();
+    }
+    return true;
+}
+
+// End of file
@@ -0,0 +1,23 @@
+#pragma once
+#ifndef URI_H
+#define URI_H
+
+#include <stddef.h>
+#include <string>
+
+using std::string;
+
+// Splits a request target into its decoded, canonical path, the raw query and
+// the extension of the last path segment, in a single left to right scan.
+//
+//  - %XX escapes are decoded, '+' in the path is a space
+//  - "." and ".." segments are resolved after decoding, ".." never climbs above the root
+//  - truncated or non-hex escapes and escaped NUL bytes make the target malformed
+//
+// Targets without escapes, '+' or segments starting with '.' take a vectorized
+// fast path that copies the path as is. Returns false on a malformed target.
+bool DecodeUri(const char* uri, size_t length, string& path, string& query, string& extension);
+
+#endif
+
+// End of header
@@ -0,0 +1,285 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+////////////////////////////////////////////////
+//              Syscall Wrappers              //
+////////////////////////////////////////////////
+
+// No liburing dependency, the three io_uring syscalls are called directly
+static int uringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ringfd, unsigned submit, unsigned wait, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ringfd, submit, wait, flags, NULL, 0);
+}
+
+static int uringRegister(int ringfd, unsigned opcode, void* arg, unsigned args) {
+    return (int) syscall(__NR_io_uring_register, ringfd, opcode, arg, args);
+}
+
+////////////////////////////////////////////////
+//              IoUring                       //
+////////////////////////////////////////////////
+IoUring::IoUring() {
+    ringfd = -1;
+    sqring = MAP_FAILED;
+    cqring = MAP_FAILED;
+    sqes = (struct io_uring_sqe*) MAP_FAILED;
+    sqringsize = 0;
+    cqringsize = 0;
+    sqessize = 0;
+    sqlocal = 0;
+    bufring = NULL;
+    buffers = NULL;
+    buffersize = 0;
+    buffercount = 0;
+}
+
+IoUring::~IoUring() {
+    // Unmap rings before closing the ring descriptor
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqessize);
+    }
+    if (cqring != MAP_FAILED && cqring != sqring) {
+        munmap(cqring, cqringsize);
+    }
+    if (sqring != MAP_FAILED) {
+        munmap(sqring, sqringsize);
+    }
+    if (ringfd >= 0) {
+        close(ringfd);
+    }
+    if (bufring != NULL) {
+        munmap(bufring, buffercount * sizeof(struct io_uring_buf));
+    }
+    free(buffers);
+}
+
+bool IoUring::Initialize(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // ENOSYS on old kernels, EPERM when disabled by sysctl or seccomp
+    ringfd = uringSetup(entries, &params);
+    if (ringfd < 0) {
+        perror("io_uring_setup");
+        return false;
+    }
+
+    // We rely on a single mmap for both rings and on stable submissions
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring: kernel lacks required features\n");
+        return false;
+    }
+
+    // Map submission and completion rings
+    sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqringsize > sqringsize) {
+        sqringsize = cqringsize;
+    }
+    cqringsize = sqringsize;
+    sqring = mmap(NULL, sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqring == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    cqring = sqring;
+
+    // Map submission queue entries
+    sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*) mmap(NULL, sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    // Resolve ring pointers
+    sqhead = (unsigned*) ((char*) sqring + params.sq_off.head);
+    sqtail = (unsigned*) ((char*) sqring + params.sq_off.tail);
+    sqmask = (unsigned*) ((char*) sqring + params.sq_off.ring_mask);
+    sqarray = (unsigned*) ((char*) sqring + params.sq_off.array);
+    cqhead = (unsigned*) ((char*) cqring + params.cq_off.head);
+    cqtail = (unsigned*) ((char*) cqring + params.cq_off.tail);
+    cqmask = (unsigned*) ((char*) cqring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*) ((char*) cqring + params.cq_off.cqes);
+    sqlocal = *sqtail;
+    return true;
+}
+
+bool IoUring::SetupBufferRing(unsigned count, unsigned size) {
+    struct io_uring_buf_reg reg;
+    size_t ringsize = count * sizeof(struct io_uring_buf);
+    int error;
+
+    // Ring memory must be page aligned, count must be a power of two
+    void* ring = mmap(NULL, ringsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    bufring = (struct io_uring_buf_ring*) ring;
+    buffercount = count;
+    buffersize = size;
+    buffers = (char*) malloc((size_t) count * size);
+    if (buffers == NULL) {
+        perror("malloc");
+        return false;
+    }
+
+    // Register the ring with the kernel (5.19+)
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+    error = uringRegister(ringfd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (error < 0) {
+        perror("io_uring_register");
+        return false;
+    }
+
+    // Hand every buffer to the kernel
+    bufring->tail = 0;
+    for (unsigned i = 0; i < count; i++) {
+        ReturnBuffer(i);
+    }
+    return true;
+}
+
+void IoUring::ReturnBuffer(unsigned id) {
+    // Publish the buffer at the tail of the provided buffer ring
+    // Index the entries by hand, the kernel's flex array header is laid out differently under C++
+    unsigned short tail = bufring->tail;
+    struct io_uring_buf* buf = (struct io_uring_buf*) bufring + (tail & (buffercount - 1));
+    buf->addr = (unsigned long) get_buffer(id);
+    buf->len = buffersize;
+    buf->bid = id;
+    __atomic_store_n(&bufring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe* IoUring::GetSqe() {
+    // Flush to the kernel when the submission queue is full
+    unsigned head = __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+    if (sqlocal - head > *sqmask) {
+        if (Submit(0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+        if (sqlocal - head > *sqmask) {
+            return NULL;
+        }
+    }
+    unsigned index = sqlocal & *sqmask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqarray[index] = index;
+    sqlocal++;
+    return sqe;
+}
+
+int IoUring::Submit(unsigned wait) {
+    // One io_uring_enter submits everything queued and reaps completions
+    unsigned submit = sqlocal - *sqtail;
+    __atomic_store_n(sqtail, sqlocal, __ATOMIC_RELEASE);
+    int count = uringEnter(ringfd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (count < 0 && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter");
+    }
+    return count;
+}
+
+void IoUring::PrepMultishotAccept(int listening, unsigned long long data) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listening;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = data;
+}
+
+void IoUring::PrepRecv(int connection, unsigned long long data) {
+    // Kernel picks a buffer from our provided ring when data arrives
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = data;
+}
+
+void IoUring::PrepSend(int connection, const char* buffer, size_t length, unsigned long long data, bool linked, bool more) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = connection;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->msg_flags = more ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+}
+
+void IoUring::PrepRead(int file, char* buffer, size_t length, off_t offset, unsigned long long data, bool linked) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file;
+    sqe->addr = (unsigned long) buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = data;
+}
+
+void IoUring::PrepClose(int connection, unsigned long long data) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        close(connection);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = connection;
+    sqe->user_data = data;
+}
+
+void IoUring::PrepTimeout(struct __kernel_timespec* ts, unsigned long long data) {
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) ts;
+    sqe->len = 1;
+    sqe->user_data = data;
+}
+
+struct io_uring_cqe* IoUring::PeekCqe() {
+    unsigned head = *cqhead;
+    if (head == __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &cqes[head & *cqmask];
+}
+
+void IoUring::SeenCqe() {
+    __atomic_store_n(cqhead, *cqhead + 1, __ATOMIC_RELEASE);
+}
+
+// End of file
@@ -0,0 +1,81 @@
+#pragma once
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/types.h>
+
+#define URING_ENTRIES      256
+#define URING_BUFFER_COUNT 256
+#define URING_BUFFER_GROUP 0
+
+// Operation tags packed into the low byte of sqe->user_data
+enum uring_op_t {
+    URING_ACCEPT = 1, URING_RECV, URING_SEND, URING_READ, URING_CLOSE, URING_TICK,
+};
+
+class IoUring {
+private:
+    // Ring file descriptor and the mapped ring regions
+    int ringfd;
+    void* sqring;
+    void* cqring;
+    size_t sqringsize;
+    size_t cqringsize;
+    struct io_uring_sqe* sqes;
+    size_t sqessize;
+
+    // Submission queue pointers
+    unsigned* sqhead;
+    unsigned* sqtail;
+    unsigned* sqmask;
+    unsigned* sqarray;
+    unsigned sqlocal;
+
+    // Completion queue pointers
+    unsigned* cqhead;
+    unsigned* cqtail;
+    unsigned* cqmask;
+    struct io_uring_cqe* cqes;
+
+    // Provided buffer ring used for receives
+    struct io_uring_buf_ring* bufring;
+    char* buffers;
+    unsigned buffersize;
+    unsigned buffercount;
+public:
+    // Constructor/Destructor
+    IoUring();
+    ~IoUring();
+
+    // Setup, returns false when the kernel lacks a feature we depend on
+    bool Initialize(unsigned entries);
+    bool SetupBufferRing(unsigned count, unsigned size);
+
+    // Submission helpers
+    struct io_uring_sqe* GetSqe();
+    int Submit(unsigned wait);
+    void PrepMultishotAccept(int listening, unsigned long long data);
+    void PrepRecv(int connection, unsigned long long data);
+    void PrepSend(int connection, const char* buffer, size_t length, unsigned long long data, bool linked, bool more);
+    void PrepRead(int file, char* buffer, size_t length, off_t offset, unsigned long long data, bool linked);
+    void PrepClose(int connection, unsigned long long data);
+    void PrepTimeout(struct __kernel_timespec* ts, unsigned long long data);
+
+    // Completion helpers
+    struct io_uring_cqe* PeekCqe();
+    void SeenCqe();
+
+    // Provided buffer helpers
+    const char* get_buffer(unsigned id) { return buffers + (size_t) id * buffersize; }
+    void ReturnBuffer(unsigned id);
+};
+
+// Pack and unpack sqe->user_data as (file descriptor, operation)
+inline unsigned long long UringData(int fd, uring_op_t op) { return ((unsigned long long) fd << 8) | op; }
+inline int UringFd(unsigned long long data) { return (int) (data >> 8); }
+inline uring_op_t UringOp(unsigned long long data) { return (uring_op_t) (data & 0xff); }
+
+#endif
+
+// End of header